@@ -1,5 +1,6 @@
 #include <iostream>
 #include <autodiff.hpp>
+#include <reverse_autodiff.hpp>
 
 
 using namespace ASC_ode;
@@ -42,7 +43,18 @@ int main()
     // func'' = 2
     std::cout << "addx*addx = " << addx * addx << std::endl;
 
-    // std::cout << "sin(addx) = " << sin(addx) << std::endl;
+    std::cout << "sin(addx) = " << sin(addx) << std::endl;
+  }
+
+  {
+    // reverse mode: record once, one sweep gives the whole gradient
+    Tape tape;
+    ReverseAD rx = tape.variable(x);
+    ReverseAD ry = tape.variable(y);
+    ReverseAD f = func1(rx, ry);
+    tape.gradient(f);
+    std::cout << "reverse: f = " << f << ", df/dx = " << tape.adjoint(rx)
+              << ", df/dy = " << tape.adjoint(ry) << std::endl;
   }
   return 0;
 }
\ No newline at end of file
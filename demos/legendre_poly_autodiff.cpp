@@ -1,7 +1,9 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
 
 #include "../src/autodiff.hpp"
+#include "../src/simd.hpp"
 
 using namespace ASC_ode;
 
@@ -32,23 +34,31 @@ std::vector<AutoDiff<N,T>> Legendre(const AutoDiff<N,T>& x)
 int main()
 {
     const int N = 1; // only x is the variable
+    const size_t W = SIMDWidth; // points per evaluation, one per SIMD lane
+    using Pack = SIMD<W>;
 
     std::cout << "x   P0  dP0  P1  dP1  P2  dP2  P3  dP3  P4  dP4  P5  dP5\n";
 
-    for (int i = 0; i <= 40; i++)
+    for (int first = 0; first <= 40; first += W)
     {
-        double xv = -1.0 + 2.0 * i / 40.0;
+        // W points at once, the lanes past the last point repeat it
+        double xs[W];
+        for (size_t l = 0; l < W; l++)
+            xs[l] = -1.0 + 2.0 * std::min<int>(first + l, 40) / 40.0;
 
-        AutoDiff<N> x = Variable<0,double>(xv);
+        AutoDiff<N, Pack> x = Variable<0, Pack>(Pack::load(xs));
 
-        auto P = Legendre<N>(x);
+        auto P = Legendre<N, Pack>(x);
 
-        std::cout << xv << " ";
-        for (int n = 0; n <= 5; n++)
+        for (size_t l = 0; l < W && first + int(l) <= 40; l++)
         {
-            std::cout << P[n].value() << " " << P[n].deriv()[0] << "  ";
+            std::cout << xs[l] << " ";
+            for (int n = 0; n <= 5; n++)
+            {
+                std::cout << P[n].value()[l] << " " << P[n].deriv()[0][l] << "  ";
+            }
+            std::cout << "\n";
         }
-        std::cout << "\n";
     }
     return 0;
 }
@@ -1,5 +1,7 @@
 #include <iostream>
 #include "../src/autodiff.hpp"
+#include "../src/autodiff_function.hpp"
+#include "../src/timestepper.hpp"
 
 using namespace ASC_ode;
 
@@ -20,6 +22,17 @@ std::array<T,2> T_evaluate(const std::array<T,2> &y)
     return f;
 }
 
+// the same RHS as functor for MakeAutoDiffFunction
+struct Pendulum
+{
+    template <typename T>
+    void operator() (VectorView<T> y, VectorView<T> f) const
+    {
+        f(0) = y(1);
+        f(1) = - (g/l) * sin(y(0));
+    }
+};
+
 int main()
 {
     std::cout << "=== TEST PENDULUM RHS WITH DOUBLE ===\n";
@@ -54,5 +67,22 @@ int main()
         std::cout << "\n";
     }
 
+
+    std::cout << "\n=== PENDULUM AS NONLINEARFUNCTION, IMPLICIT EULER ===\n";
+
+    // Jacobian from AutoDiff<2> in one sweep
+    auto rhs = MakeAutoDiffFunction<2>(Pendulum(), 2, 2);
+
+    Vector<> y({1.0, 0.2});
+    Matrix<> jac(2, 2);
+    rhs->evaluateDeriv(y, jac);
+    std::cout << "Jacobian: " << jac(0,0) << " " << jac(0,1) << " / "
+              << jac(1,0) << " " << jac(1,1) << "\n";
+
+    ImplicitEuler stepper(rhs);
+    for (int i = 0; i < 100; i++)
+        stepper.doStep(0.01, y);
+    std::cout << "t = 1: alpha = " << y(0) << ", alpha' = " << y(1) << "\n";
+
     return 0;
 }
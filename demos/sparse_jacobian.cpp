@@ -0,0 +1,68 @@
+#include <iostream>
+#include <chrono>
+
+#include "autodiff_function.hpp"
+#include "sparse_autodiff.hpp"
+
+using namespace ASC_ode;
+
+// chain of n unit masses between two walls, springs with force
+// k u + k3 u^3 for the elongation u; y = [x, v], y' = [v, a]
+struct Chain
+{
+    size_t n;
+    double k, k3;
+
+    template <typename T>
+    void operator() (VectorView<T> y, VectorView<T> f) const
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            T left = (i > 0) ? y(i-1) : T(0.0);
+            T right = (i+1 < n) ? y(i+1) : T(0.0);
+            T ul = y(i) - left, ur = right - y(i);
+            f(i) = y(n+i);
+            f(n+i) = k*(ur-ul) + k3*(ur*ur*ur - ul*ul*ul);
+        }
+    }
+};
+
+int main()
+{
+    for (size_t n : { 100, 1000, 10000 })
+    {
+        Chain chain{n, 1.0, 0.5};
+        Vector<> y(2*n);
+        for (size_t i = 0; i < 2*n; i++)
+            y(i) = 0.1 * sin(0.3*i);
+
+        auto sparse = MakeSparseAutoDiffFunction<8>(chain, y, 2*n);
+        SparseMatrix jac = sparse->createJacobian();
+
+        auto start = std::chrono::steady_clock::now();
+        sparse->evaluateDerivSparse(y, jac);
+        double tsparse = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+        std::cout << "n = " << 2*n << ": " << jac.nze() << " nonzeros, "
+                  << sparse->numColors() << " colors, sparse " << tsparse << " s";
+
+        // dense AutoDiff, 8 columns per sweep
+        if (n <= 1000)
+        {
+            auto dense = MakeAutoDiffFunction<8>(chain, 2*n, 2*n);
+            Matrix<> ddense(2*n, 2*n);
+            start = std::chrono::steady_clock::now();
+            dense->evaluateDeriv(y, ddense);
+            double tdense = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+            jac.addTo(ddense, -1);
+            double err = 0;
+            for (size_t i = 0; i < 2*n; i++)
+                for (size_t j = 0; j < 2*n; j++)
+                    err = std::max(err, std::abs(ddense(i,j)));
+            std::cout << ", dense " << tdense << " s, difference " << err;
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <cmath>
+#include <chrono>
+
+#include <timestepper.hpp>
+#include <implicitRK.hpp>
+#include <adjoint.hpp>
+
+using namespace ASC_ode;
+
+// y = [x, v], parameters p = [k, m, d]: m x'' = -k x - d x^3
+struct Oscillator
+{
+    template <typename T>
+    void operator() (VectorView<T> y, VectorView<T> p, VectorView<T> f) const
+    {
+        f(0) = y(1);
+        f(1) = -(p(0)*y(0) + p(2)*y(0)*y(0)*y(0)) / p(1);
+    }
+};
+
+
+// least squares fit of x(t_k) to 'measurements' x_meas(t) = cos(1.1 t)
+struct Fit
+{
+    double tau;
+    double operator() (size_t k, VectorView<double> y, VectorView<double> dgdy) const
+    {
+        double diff = y(0) - std::cos(1.1*k*tau);
+        dgdy(0) += 2*diff;
+        return diff*diff;
+    }
+};
+
+
+// J by plain time stepping, for the differences
+double objective (std::shared_ptr<ParametricFunction> rhs, const Matrix<> & a,
+                  const Vector<> & b, const Vector<> & c, Vector<> y, double tau, size_t steps)
+{
+    RungeKuttaStages rk(rhs, a, b, c);
+    Fit fit{tau};
+    Vector<> dummy(y.size());
+    double sum = 0;
+    for (size_t k = 1; k <= steps; k++)
+    {
+        rk.solveValues(tau, y);
+        rk.update(tau, y);
+        sum += fit(k, y, dummy);
+    }
+    return sum;
+}
+
+
+// false if the gradient differs from central differences by more than 1e-6
+bool check (const char * name, const Matrix<> & a, const Vector<> & b, const Vector<> & c,
+            size_t steps, size_t snapshots)
+{
+    auto rhs = MakeParametricAutoDiffFunction<3>(Oscillator(), 2, 2, { 1.0, 1.0, 0.5 });
+    double tau = 10.0 / steps;
+    Vector<> y0({ 1.0, 0.0 }), p(3), gradp(3), grady0(2);
+
+    AdjointRungeKutta adjoint(rhs, a, b, c, snapshots);
+    auto start = std::chrono::steady_clock::now();
+    double J = adjoint.gradient(y0, tau, steps, Fit{tau}, gradp, grady0);
+    double tadj = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+    start = std::chrono::steady_clock::now();
+    double Jplain = objective(rhs, a, b, c, y0, tau, steps);
+    double tsim = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+    // central differences, relative error against the largest gradient entry
+    double err = 0, maxg = 0;
+    rhs->getParameters(p);
+    for (size_t q = 0; q < 3; q++)
+    {
+        Vector<> pp = p;
+        double h = 1e-6;
+        pp(q) = p(q)+h; rhs->setParameters(pp);
+        double Jp = objective(rhs, a, b, c, y0, tau, steps);
+        pp(q) = p(q)-h; rhs->setParameters(pp);
+        double Jm = objective(rhs, a, b, c, y0, tau, steps);
+        err = std::max(err, std::abs((Jp-Jm)/(2*h) - gradp(q)));
+        maxg = std::max(maxg, std::abs(gradp(q)));
+    }
+    rhs->setParameters(p);
+    for (size_t l = 0; l < 2; l++)
+    {
+        Vector<> yp = y0, ym = y0;
+        double h = 1e-6;
+        yp(l) += h; ym(l) -= h;
+        double diff = (objective(rhs, a, b, c, yp, tau, steps)
+                       - objective(rhs, a, b, c, ym, tau, steps)) / (2*h);
+        err = std::max(err, std::abs(diff - grady0(l)));
+    }
+
+    std::cout << name << ", " << steps << " steps, " << snapshots << " snapshots: J = " << J
+              << " (" << Jplain << "), dJ/dp = " << gradp(0) << " " << gradp(1) << " " << gradp(2)
+              << ", difference " << err/maxg
+              << ", recomputed steps/step " << double(adjoint.forwardSteps())/steps
+              << ", time/simulation " << tadj/tsim << std::endl;
+    return err/maxg <= 1e-6 && std::abs(J-Jplain) <= 1e-12 * std::abs(Jplain);
+}
+
+
+int main()
+{
+    Matrix<> ie_a { { 1.0 } };
+    Vector<> ie_b { 1.0 }, ie_c { 1.0 };
+    Matrix<> rk4_a { { 0, 0, 0, 0 }, { 0.5, 0, 0, 0 }, { 0, 0.5, 0, 0 }, { 0, 0, 1, 0 } };
+    Vector<> rk4_b { 1.0/6, 1.0/3, 1.0/3, 1.0/6 }, rk4_c { 0, 0.5, 0.5, 1 };
+
+    Vector<> radau_c(3), radau_w(3);
+    GaussRadau(radau_c, radau_w);
+    auto [radau_a, radau_b] = computeABfromC(radau_c);
+
+    bool ok = check ("RK4", rk4_a, rk4_b, rk4_c, 1000, 1000);
+    ok &= check ("RK4", rk4_a, rk4_b, rk4_c, 1000, 10);
+    ok &= check ("implicit Euler", ie_a, ie_b, ie_c, 1000, 10);
+    ok &= check ("Gauss 2", Gauss2a, Gauss2b, Gauss2c, 1000, 10);
+    ok &= check ("Radau 3", radau_a, radau_b, radau_c, 1000, 10);
+    ok &= check ("RK4", rk4_a, rk4_b, rk4_c, 100000, 20);
+    if (!ok)
+    {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    return 0;
+}
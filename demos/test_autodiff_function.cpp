@@ -0,0 +1,83 @@
+#include <iostream>
+#include <cmath>
+#include <memory>
+
+#include "nonlinfunc.hpp"
+#include "autodiff_function.hpp"
+
+using namespace ASC_ode;
+
+// anharmonic chain with fixed ends, f_i = forces on mass i
+struct Chain
+{
+    size_t n;
+    double alpha;
+
+    template <typename T>
+    void operator() (VectorView<T> x, VectorView<T> f) const
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            T left = (i > 0) ? T(x(i) - x(i-1)) : T(x(i));
+            T right = (i+1 < n) ? T(x(i+1) - x(i)) : T(-x(i));
+            f(i) = right - left + alpha * (right*right - left*left) - 0.1 * sin(x(i));
+        }
+    }
+};
+
+// Jacobians with N < dimX, seeded in chunks of N unknowns, against one sweep
+template <size_t N>
+double ChunkedDifference (const Chain & chain, VectorView<double> x, const Matrix<> & single)
+{
+    auto func = MakeAutoDiffFunction<N>(chain, chain.n, chain.n);
+    Matrix<> df(chain.n, chain.n);
+    func->evaluateDeriv(x, df);
+    double err = 0;
+    for (size_t i = 0; i < chain.n; i++)
+        for (size_t j = 0; j < chain.n; j++)
+            err = std::max(err, std::abs(df(i,j) - single(i,j)));
+    std::cout << "N = " << N << ", " << (chain.n+N-1)/N << " sweeps: difference to one sweep " << err << std::endl;
+    return err;
+}
+
+int main()
+{
+    constexpr size_t n = 11;
+    Chain chain { n, 0.3 };
+    Vector<> x(n);
+    for (size_t i = 0; i < n; i++)
+        x(i) = 0.1 * std::sin(1.0 + i);
+
+    Matrix<> single(n, n);
+    MakeAutoDiffFunction<n>(chain, n, n)->evaluateDeriv(x, single);
+
+    // one sweep against central differences
+    double h = 1e-6, errfd = 0, maxd = 0;
+    Vector<> fp(n), fm(n);
+    for (size_t j = 0; j < n; j++)
+    {
+        double xj = x(j);
+        x(j) = xj + h; chain(VectorView<double>(x), VectorView<double>(fp));
+        x(j) = xj - h; chain(VectorView<double>(x), VectorView<double>(fm));
+        x(j) = xj;
+        for (size_t i = 0; i < n; i++)
+        {
+            errfd = std::max(errfd, std::abs((fp(i)-fm(i))/(2*h) - single(i,j)));
+            maxd = std::max(maxd, std::abs(single(i,j)));
+        }
+    }
+    std::cout << "N = " << n << ", one sweep: difference to central differences " << errfd/maxd << std::endl;
+
+    // the derivatives of each column are computed by the same operations
+    double err = ChunkedDifference<1>(chain, x, single);
+    err = std::max(err, ChunkedDifference<3>(chain, x, single));
+    err = std::max(err, ChunkedDifference<4>(chain, x, single));
+    err = std::max(err, ChunkedDifference<8>(chain, x, single));
+
+    if (err != 0 || errfd/maxd > 1e-8)
+    {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -4,27 +4,21 @@
 
 #include "nonlinfunc.hpp"
 #include "explicitRK.hpp"
+#include "autodiff_function.hpp"
 
 using namespace ASC_ode;
 
-// y = [x, v], y' = [v, -k/m x]
-class MassSpring : public NonlinearFunction
+// y = [x, v], y' = [v, -k/m x], Jacobian by AutoDiff
+struct MassSpring
 {
     double m, k;
 
-public:
-    MassSpring(double m_, double k_) : m(m_), k(k_) {}
-
-    size_t dimX() const override { return 2; }
-    size_t dimF() const override { return 2; }
-
-    void evaluate(VectorView<double> x, VectorView<double> f) const override
+    template <typename T>
+    void operator() (VectorView<T> x, VectorView<T> f) const
     {
         f(0) = x(1);
-        f(1) = -k / m * x(0);
+        f(1) = (-k / m) * x(0);
     }
-
-    void evaluateDeriv(VectorView<double>, MatrixView<double>) const override {}
 };
 
 int main(int argc, char** argv)
@@ -33,7 +27,7 @@ int main(int argc, char** argv)
     if (argc > 1)
         method = argv[1];
 
-    auto rhs = std::make_shared<MassSpring>(1.0, 1.0);
+    auto rhs = MakeAutoDiffFunction<2>(MassSpring{1.0, 1.0}, 2, 2);
 
     
     std::unique_ptr<Matrix<>> A;
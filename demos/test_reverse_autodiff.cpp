@@ -0,0 +1,283 @@
+#include <iostream>
+#include <cmath>
+#include <chrono>
+#include <vector>
+
+#include <autodiff_function.hpp>
+#include <reverse_autodiff.hpp>
+
+using namespace ASC_ode;
+
+// chain of n masses in the plane, hanging from the origin, x = [x0, y0, x1, y1, ...],
+// spring i between mass i-1 (the origin for i = 0) and mass i, rest length 1,
+// stiffness k(i), unit masses
+template <typename T, typename TK>
+T SpringEnergy (VectorView<T> x, const TK & k, size_t n)
+{
+    T energy = 0;
+    T px = 0, py = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        T dx = x(2*i) - px, dy = x(2*i+1) - py;
+        T stretch = sqrt(dx*dx + dy*dy) - 1.0;
+        energy = energy + 0.5 * k(i) * stretch * stretch + 9.81 * x(2*i+1);
+        px = x(2*i);
+        py = x(2*i+1);
+    }
+    return energy;
+}
+
+// the energy with fixed stiffness, f(0) = E(x)
+struct Energy
+{
+    Vector<> k;
+    template <typename T>
+    void operator() (VectorView<T> x, VectorView<T> f) const
+    {
+        f(0) = SpringEnergy(x, k, k.size());
+    }
+};
+
+// one symplectic Euler step of the chain, y = [x, v], forces from k
+template <typename T, typename TK>
+void ChainStep (double tau, const TK & k, size_t n, VectorView<T> y, VectorView<T> ynew)
+{
+    for (size_t i = 0; i < 2*n; i++)
+        ynew(2*n+i) = y(2*n+i) - ((i % 2) ? 9.81*tau : 0.0);
+    T px = 0, py = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        T dx = y(2*i) - px, dy = y(2*i+1) - py;
+        T d = sqrt(dx*dx + dy*dy);
+        T fac = tau * k(i) * (d - 1.0) / d;
+        ynew(2*n+2*i) = ynew(2*n+2*i) - fac * dx;
+        ynew(2*n+2*i+1) = ynew(2*n+2*i+1) - fac * dy;
+        if (i > 0)
+        {
+            ynew(2*n+2*i-2) = ynew(2*n+2*i-2) + fac * dx;
+            ynew(2*n+2*i-1) = ynew(2*n+2*i-1) + fac * dy;
+        }
+        px = y(2*i);
+        py = y(2*i+1);
+    }
+    for (size_t i = 0; i < 2*n; i++)
+        ynew(i) = y(i) + tau * ynew(2*n+i);
+}
+
+struct Step
+{
+    double tau;
+    Vector<> k;
+    template <typename T>
+    void operator() (VectorView<T> y, VectorView<T> ynew) const
+    {
+        ChainStep(tau, k, k.size(), y, ynew);
+    }
+};
+
+
+Vector<> InitialState (size_t n)
+{
+    Vector<> y(4*n);
+    y = 0.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        y(2*i) = 1.1*(i+1);
+        y(2*i+1) = -0.1*(i+1);
+    }
+    return y;
+}
+
+Vector<> Stiffness (size_t n)
+{
+    Vector<> k(n);
+    for (size_t i = 0; i < n; i++)
+        k(i) = 100 + i;
+    return k;
+}
+
+// J(k) = energy of the positions after 'steps' steps, with doubles
+double Objective (const Vector<> & k, Vector<> y, double tau, size_t steps)
+{
+    size_t n = k.size();
+    Vector<> ynew(y.size());
+    for (size_t s = 0; s < steps; s++)
+    {
+        ChainStep<double>(tau, k, n, y, ynew);
+        y = ynew;
+    }
+    return SpringEnergy(VectorView<double>(2*n, y.data()), k, n);
+}
+
+
+int main()
+{
+    {
+        // gradient of the spring energy: one sweep against 2 evaluations per entry
+        size_t n = 1000;
+        Energy energy { Stiffness(n) };
+        Vector<> x = InitialState(n).range(0, 2*n), grad(2*n);
+        Tape tape;
+        auto start = std::chrono::steady_clock::now();
+        double E = Gradient(energy, x, grad, tape);
+        double trev = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+        start = std::chrono::steady_clock::now();
+        double err = 0, maxg = 0, h = 1e-6;
+        Vector<> f(1);
+        for (size_t i = 0; i < 2*n; i++)
+        {
+            double xi = x(i);
+            x(i) = xi + h; energy(VectorView<double>(x), VectorView<double>(f)); double Ep = f(0);
+            x(i) = xi - h; energy(VectorView<double>(x), VectorView<double>(f)); double Em = f(0);
+            x(i) = xi;
+            err = std::max(err, std::abs((Ep-Em)/(2*h) - grad(i)));
+            maxg = std::max(maxg, std::abs(grad(i)));
+        }
+        double tfd = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        std::cout << "energy of " << n << " masses: E = " << E << ", tape entries " << tape.size()
+                  << ", difference to central differences " << err/maxg
+                  << ", time reverse/differences " << trev/tfd << std::endl;
+    }
+
+    {
+        // dJ/dk over a trajectory, once on one tape, once section by section:
+        // the sections are recomputed from checkpoints, recorded after a
+        // mark, swept back to it and rewound, the stiffnesses stay in front
+        size_t n = 20, steps = 200, section = 25;
+        double tau = 1e-3;
+        Vector<> k = Stiffness(n), y0 = InitialState(n);
+        Tape tape;
+
+        // whole trajectory
+        std::vector<ReverseAD> rk, ry, rynew(4*n);
+        for (size_t i = 0; i < n; i++)
+            rk.push_back(tape.variable(k(i)));
+        for (size_t i = 0; i < 4*n; i++)
+            ry.push_back(y0(i));
+        for (size_t s = 0; s < steps; s++)
+        {
+            ChainStep(tau, VectorView<ReverseAD>(n, rk.data()), n,
+                      VectorView<ReverseAD>(4*n, ry.data()), VectorView<ReverseAD>(4*n, rynew.data()));
+            ry = rynew;
+        }
+        ReverseAD J = SpringEnergy(VectorView<ReverseAD>(2*n, ry.data()), VectorView<ReverseAD>(n, rk.data()), n);
+        size_t fullsize = tape.size();
+        tape.gradient(J);
+        Vector<> gradfull(n);
+        for (size_t i = 0; i < n; i++)
+            gradfull(i) = tape.adjoint(rk[i]);
+
+        // forward with doubles, keeping the state at the start of each section
+        std::vector<Vector<>> checkpoints;
+        Vector<> y = y0, ynew(4*n);
+        for (size_t s = 0; s < steps; s++)
+        {
+            if (s % section == 0) checkpoints.push_back(y);
+            ChainStep<double>(tau, k, n, y, ynew);
+            y = ynew;
+        }
+
+        // adjoint of the final state from the energy
+        tape.clear();
+        rk.clear();
+        for (size_t i = 0; i < n; i++)
+            rk.push_back(tape.variable(k(i)));
+        size_t base = tape.mark();
+        for (size_t i = 0; i < 4*n; i++)
+            ry[i] = tape.variable(y(i));
+        J = SpringEnergy(VectorView<ReverseAD>(2*n, ry.data()), VectorView<ReverseAD>(n, rk.data()), n);
+        tape.gradient(J);
+        Vector<> lambda(4*n), gradsec(n);
+        for (size_t i = 0; i < 4*n; i++)
+            lambda(i) = tape.adjoint(ry[i]);
+        for (size_t i = 0; i < n; i++)
+            gradsec(i) = tape.adjoint(rk[i]);
+
+        size_t maxsize = 0;
+        for (size_t c = checkpoints.size(); c-- > 0; )
+        {
+            tape.rewind(base);
+            std::vector<ReverseAD> rin;
+            for (size_t i = 0; i < 4*n; i++)
+                rin.push_back(tape.variable(checkpoints[c](i)));
+            size_t m = tape.mark();
+            ry = rin;
+            for (size_t s = c*section; s < std::min(steps, (c+1)*section); s++)
+            {
+                ChainStep(tau, VectorView<ReverseAD>(n, rk.data()), n,
+                          VectorView<ReverseAD>(4*n, ry.data()), VectorView<ReverseAD>(4*n, rynew.data()));
+                ry = rynew;
+            }
+            maxsize = std::max(maxsize, tape.size());
+
+            tape.clearAdjoints();
+            for (size_t i = 0; i < 4*n; i++)
+                tape.addAdjoint(ry[i], lambda(i));
+            tape.reverse(m, tape.size());
+            tape.rewind(m);
+            for (size_t i = 0; i < 4*n; i++)
+                lambda(i) = tape.adjoint(rin[i]);
+            for (size_t i = 0; i < n; i++)
+                gradsec(i) += tape.adjoint(rk[i]);
+        }
+
+        double err = 0, errfd = 0, maxg = 0, h = 1e-6;
+        for (size_t i = 0; i < n; i++)
+        {
+            Vector<> kp = k, km = k;
+            kp(i) += h; km(i) -= h;
+            double fd = (Objective(kp, y0, tau, steps) - Objective(km, y0, tau, steps)) / (2*h);
+            err = std::max(err, std::abs(gradsec(i) - gradfull(i)));
+            errfd = std::max(errfd, std::abs(fd - gradfull(i)));
+            maxg = std::max(maxg, std::abs(gradfull(i)));
+        }
+        std::cout << "trajectory of " << steps << " steps: J = " << J.value()
+                  << ", sections/full " << err/maxg << ", full/differences " << errfd/maxg
+                  << ", tape entries " << maxsize << " instead of " << fullsize << std::endl;
+    }
+
+    {
+        // Jacobian of a step, W rows per reverse sweep, against forward mode
+        constexpr size_t n = 4;
+        Step step { 1e-2, Stiffness(n) };
+        Vector<> y = InitialState(n);
+        auto forward = MakeAutoDiffFunction<4*n>(step, 4*n, 4*n);
+        auto reverse1 = MakeReverseAutoDiffFunction<1>(step, 4*n, 4*n);
+        auto reverse4 = MakeReverseAutoDiffFunction<4>(step, 4*n, 4*n);
+        auto reverse5 = MakeReverseAutoDiffFunction<5>(step, 4*n, 4*n);
+        Matrix<> df(4*n, 4*n), dr(4*n, 4*n);
+        forward->evaluateDeriv(y, df);
+        for (auto func : { std::shared_ptr<NonlinearFunction>(reverse1),
+                           std::shared_ptr<NonlinearFunction>(reverse4),
+                           std::shared_ptr<NonlinearFunction>(reverse5) })
+        {
+            func->evaluateDeriv(y, dr);
+            double err = 0;
+            for (size_t i = 0; i < 4*n; i++)
+                for (size_t j = 0; j < 4*n; j++)
+                    err = std::max(err, std::abs(dr(i,j) - df(i,j)));
+            std::cout << "step Jacobian " << 4*n << " x " << 4*n << ", reverse against forward: " << err << std::endl;
+        }
+    }
+
+    {
+        // constants and values of other tapes have no adjoint on a tape,
+        // and operands from two tapes are rejected
+        Tape tape, other;
+        ReverseAD x = tape.variable(2), c = 3.0, y = other.variable(1);
+        ReverseAD f = x*x*c;
+        tape.gradient(f);
+        bool mixed = false;
+        try { x*y; }
+        catch (std::logic_error &) { mixed = true; }
+        std::cout << "df/dx = " << tape.adjoint(x) << ", constant " << tape.adjoint(c)
+                  << ", other tape " << tape.adjoint(y) << ", mixed tapes rejected " << mixed << std::endl;
+        if (tape.adjoint(x) != 12 || tape.adjoint(c) != 0 || tape.adjoint(y) != 0 || !mixed)
+        {
+            std::cout << "FAILED" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <cmath>
+#include <chrono>
+
+#include <timestepper.hpp>
+#include <implicitRK.hpp>
+#include <sensitivity.hpp>
+
+using namespace ASC_ode;
+
+// RC circuit as in test_ode_circuit, y = [U_C, t], parameters p = [R, C]
+struct RC
+{
+    template <typename T>
+    void operator() (VectorView<T> y, VectorView<T> p, VectorView<T> f) const
+    {
+        double omega = 100 * M_PI;
+        f(0) = (cos(omega*y(1)) - y(0)) / (p(0)*p(1));
+        f(1) = T(1.0);
+    }
+};
+
+// y = [x, v], parameters p = [k, m, d]: m x'' = -k x - d x^3
+struct Oscillator
+{
+    template <typename T>
+    void operator() (VectorView<T> y, VectorView<T> p, VectorView<T> f) const
+    {
+        f(0) = y(1);
+        f(1) = -(p(0)*y(0) + p(2)*y(0)*y(0)*y(0)) / p(1);
+    }
+};
+
+
+// final state and sensitivities after steps steps, and the largest
+// difference to central differences of the final state
+void check (const char * name, std::shared_ptr<ParametricFunction> rhs,
+            const Matrix<> & a, const Vector<> & b, const Vector<> & c,
+            Vector<> y0, double tend, int steps)
+{
+    size_t n = rhs->dimX(), np = rhs->numParams();
+    double tau = tend / steps;
+
+    auto simulate = [&](VectorView<double> y, MatrixView<double> s)
+    {
+        SensitivityRungeKutta stepper(rhs, a, b, c);
+        for (size_t i = 0; i < n; i++) y(i) = y0(i);
+        s = 0.0;
+        for (int i = 0; i < steps; i++)
+            stepper.doStep(tau, y, s);
+    };
+
+    Vector<> y(n), p(np), pnew(np);
+    Matrix<> s(n, np);
+    auto start = std::chrono::steady_clock::now();
+    simulate(y, s);
+    double tsens = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+    rhs->getParameters(p);
+    double err = 0, maxs = 0;
+    Vector<> yp(n), ym(n);
+    Matrix<> dummy(n, np);
+    start = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < np; q++)
+    {
+        double h = 1e-6 * std::abs(p(q));
+        pnew = p; pnew(q) += h; rhs->setParameters(pnew);
+        simulate(yp, dummy);
+        pnew(q) -= 2*h; rhs->setParameters(pnew);
+        simulate(ym, dummy);
+        for (size_t i = 0; i < n; i++)
+        {
+            err = std::max(err, std::abs((yp(i)-ym(i))/(2*h) - s(i,q)));
+            maxs = std::max(maxs, std::abs(s(i,q)));
+        }
+    }
+    double tfd = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    rhs->setParameters(p);
+
+    std::cout << name << ": dy0/dp = ";
+    for (size_t q = 0; q < np; q++)
+        std::cout << s(0,q) << " ";
+    std::cout << " relative difference to central differences " << err/maxs
+              << ", time " << tsens << " s (differences " << tfd << " s)" << std::endl;
+}
+
+
+int main()
+{
+    auto rc = MakeParametricAutoDiffFunction<2>(RC(), 2, 2, { 1.0, 1.0 });
+    auto osc = MakeParametricAutoDiffFunction<3>(Oscillator(), 2, 2, { 1.0, 1.0, 0.5 });
+
+    Matrix<> ie_a { { 1.0 } };
+    Vector<> ie_b { 1.0 }, ie_c { 1.0 };
+    Matrix<> cn_a { { 0.0, 0.0 }, { 0.5, 0.5 } };
+    Vector<> cn_b { 0.5, 0.5 }, cn_c { 0.0, 1.0 };
+    Matrix<> rk4_a { { 0, 0, 0, 0 }, { 0.5, 0, 0, 0 }, { 0, 0.5, 0, 0 }, { 0, 0, 1, 0 } };
+    Vector<> rk4_b { 1.0/6, 1.0/3, 1.0/3, 1.0/6 }, rk4_c { 0, 0.5, 0.5, 1 };
+
+    check ("RC, implicit Euler", rc, ie_a, ie_b, ie_c, Vector<>({ 0.0, 0.0 }), 0.02, 1000);
+    check ("RC, Crank-Nicolson", rc, cn_a, cn_b, cn_c, Vector<>({ 0.0, 0.0 }), 0.02, 1000);
+    check ("RC, Gauss 2", rc, Gauss2a, Gauss2b, Gauss2c, Vector<>({ 0.0, 0.0 }), 0.02, 1000);
+    check ("oscillator, RK4", osc, rk4_a, rk4_b, rk4_c, Vector<>({ 1.0, 0.0 }), 10, 1000);
+    check ("oscillator, Gauss 2", osc, Gauss2a, Gauss2b, Gauss2c, Vector<>({ 1.0, 0.0 }), 10, 1000);
+    return 0;
+}
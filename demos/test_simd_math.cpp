@@ -0,0 +1,96 @@
+#include <iostream>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <functional>
+
+#include <simd.hpp>
+
+using namespace ASC_ode;
+
+constexpr size_t W = SIMDWidth;
+
+// distance of a to the correctly rounded b in units of the last place of b
+double Ulps (double a, double b)
+{
+    if (a == b) return 0;
+    if (!std::isfinite(a) || !std::isfinite(b)) return std::numeric_limits<double>::infinity();
+    double ulp = std::nextafter(std::abs(b), std::numeric_limits<double>::infinity()) - std::abs(b);
+    return std::abs(a-b) / ulp;
+}
+
+// largest error against libm on random samples in [lo, hi]
+double MaxUlps (std::function<SIMD<W>(SIMD<W>)> fsimd, double (*flibm)(double),
+                double lo, double hi, size_t samples = 1000000)
+{
+    std::mt19937_64 random(42);
+    std::uniform_real_distribution<double> dist(lo, hi);
+    double maxulps = 0;
+    for (size_t i = 0; i < samples; i += W)
+    {
+        SIMD<W> x;
+        for (size_t j = 0; j < W; j++) x.set(j, dist(random));
+        SIMD<W> y = fsimd(x);
+        for (size_t j = 0; j < W; j++)
+            maxulps = std::max(maxulps, Ulps(y[j], flibm(x[j])));
+    }
+    return maxulps;
+}
+
+// same result as libm, NaN for NaN
+bool Same (double a, double b)
+{
+    return (std::isnan(a) && std::isnan(b)) || a == b;
+}
+
+int main()
+{
+    bool ok = true;
+    std::cout << "SIMD<" << W << ">, ulps against libm:" << std::endl;
+
+    struct Case { const char * name; std::function<SIMD<W>(SIMD<W>)> fsimd; double (*flibm)(double); double lo, hi; };
+    Case cases[] =
+    {
+        { "sin", [](SIMD<W> x) { return sin(x); }, std::sin, -1e3, 1e3 },
+        { "cos", [](SIMD<W> x) { return cos(x); }, std::cos, -1e3, 1e3 },
+        { "exp", [](SIMD<W> x) { return exp(x); }, std::exp, -708, 709.7 },
+        { "exp, subnormal results", [](SIMD<W> x) { return exp(x); }, std::exp, -745, -708 },
+        { "log", [](SIMD<W> x) { return log(x); }, std::log, 1e-3, 1e3 },
+        { "log", [](SIMD<W> x) { return log(x); }, std::log, 0, 1e300 },
+        { "log, subnormal arguments", [](SIMD<W> x) { return log(x); }, std::log, 0, 2e-308 },
+    };
+    for (auto & c : cases)
+    {
+        double ulps = MaxUlps(c.fsimd, c.flibm, c.lo, c.hi);
+        std::cout << "  " << c.name << " on [" << c.lo << ", " << c.hi << "]: " << ulps << std::endl;
+        if (!(ulps <= 2)) ok = false;
+    }
+
+    // special values, lane by lane in one pack
+    const double inf = std::numeric_limits<double>::infinity(), nan = std::numeric_limits<double>::quiet_NaN();
+    double expargs[] = { nan, 710, -746, inf, -inf, 709.7, -740, 0 };
+    double logargs[] = { 0, -1, nan, inf, -0.0, -inf, 4.9e-324, 1 };
+    for (size_t first = 0; first < 8; first += W)
+    {
+        SIMD<W> ex, lx;
+        for (size_t j = 0; j < W; j++)
+        {
+            ex.set(j, expargs[first+j]);
+            lx.set(j, logargs[first+j]);
+        }
+        SIMD<W> ey = exp(ex), ly = log(lx);
+        for (size_t j = 0; j < W; j++)
+        {
+            std::cout << "  exp(" << ex[j] << ") = " << ey[j] << ", log(" << lx[j] << ") = " << ly[j] << std::endl;
+            if (!Same(ey[j], std::exp(ex[j])) && Ulps(ey[j], std::exp(ex[j])) > 2) ok = false;
+            if (!Same(ly[j], std::log(lx[j])) && Ulps(ly[j], std::log(lx[j])) > 2) ok = false;
+        }
+    }
+
+    if (!ok)
+    {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    return 0;
+}
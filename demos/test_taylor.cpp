@@ -0,0 +1,106 @@
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <chrono>
+
+#include "nonlinfunc.hpp"
+#include "explicitRK.hpp"
+#include "autodiff_function.hpp"
+#include "taylor.hpp"
+
+using namespace ASC_ode;
+
+// Kepler problem, y = [x, y, vx, vy], GM = 1
+struct Kepler
+{
+    template <typename T>
+    void operator() (VectorView<T> y, VectorView<T> f) const
+    {
+        T r2 = y(0)*y(0) + y(1)*y(1);
+        T r3 = r2 * sqrt(r2);
+        f(0) = y(2);
+        f(1) = y(3);
+        f(2) = -y(0) / r3;
+        f(3) = -y(1) / r3;
+    }
+};
+
+
+// orbit with eccentricity e from the perihelion, period 2 pi
+Vector<> Perihelion (double e)
+{
+    return Vector<>({ 1-e, 0.0, 0.0, std::sqrt((1+e)/(1-e)) });
+}
+
+double Distance (const Vector<> & y, const Vector<> & y0)
+{
+    double sum = 0;
+    for (size_t i = 0; i < y.size(); i++)
+        sum += (y(i)-y0(i)) * (y(i)-y0(i));
+    return std::sqrt(sum);
+}
+
+
+int main()
+{
+    std::cout << std::setprecision(6);
+    double e = 0.5;
+    size_t periods = 10;
+    double tend = periods * 2 * M_PI;
+    Vector<> y0 = Perihelion(e);
+
+    {
+        // derivatives of sin up to order 6 at x = 1, in one pass
+        auto x = Taylor<6>::Variable(1.0);
+        auto s = sin(x);
+        std::cout << "sin derivatives at 1:";
+        for (size_t k = 0; k <= 6; k++)
+            std::cout << " " << s.derivative(k);
+        std::cout << std::endl;
+    }
+
+    // the tolerance is local, after 10 periods the error may be a few hundred
+    // times larger, and round-off limits it to about 1e-12
+    bool ok = true;
+    for (double tol : { 1e-8, 1e-12, 1e-16 })
+    {
+        auto taylor = MakeTaylorIntegrator<30>(Kepler(), 4);
+        Vector<> y = y0;
+        auto start = std::chrono::steady_clock::now();
+        taylor.solve (0, tend, y, tol);
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        std::cout << "Taylor tol = " << tol << ", order " << taylor.order()
+                  << ": " << taylor.steps() << " steps, error = " << Distance(y, y0)
+                  << ", " << time*1e3 << " ms" << std::endl;
+        if (!(Distance(y, y0) <= 1e3*tol + 1e-11)) ok = false;
+    }
+
+    auto rhs = MakeAutoDiffFunction<4>(Kepler(), 4, 4);
+    Matrix<> a(4, 4);
+    a = 0.0;
+    a(1, 0) = 0.5;
+    a(2, 1) = 0.5;
+    a(3, 2) = 1.0;
+    Vector<> b({ 1.0/6, 1.0/3, 1.0/3, 1.0/6 });
+    Vector<> c({ 0.0, 0.5, 0.5, 1.0 });
+    ExplicitRungeKutta rk4(rhs, a, b, c);
+
+    for (size_t steps : { 10000, 100000, 1000000 })
+    {
+        Vector<> y = y0;
+        double tau = tend / steps;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < steps; i++)
+            rk4.doStep(tau, y);
+        double time = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        std::cout << "RK4 " << steps << " steps, error = " << Distance(y, y0)
+                  << ", " << time*1e3 << " ms" << std::endl;
+    }
+
+    if (!ok)
+    {
+        std::cout << "FAILED: Taylor error above 1000 tol + 1e-11" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,108 +1,785 @@
 #ifndef NEWMARK_HPP
 #define NEWMARK_HPP
 
+#include <functional>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <memory>
+
 #include <nonlinfunc.hpp>
+#include <Newton.hpp>
+#include <constraintfunc.hpp>
+#include "mass_matrix.hpp"
+
+
 
 
 
-  
-  
   // Newmark and generalized alpha:
   // https://miaodi.github.io/finite%20element%20method/newmark-generalized/
-  
-  // Newmark method for  mass*d^2x/dt^2 = rhs
-  void SolveODE_Newmark(double tend, int steps,
-                        VectorView<double> x, VectorView<double> dx,
-                        std::shared_ptr<NonlinearFunction> rhs,   
-                        std::shared_ptr<NonlinearFunction> mass,  
-                        std::function<void(double,VectorView<double>)> callback = nullptr)
+
+
+  // parameters of the step size control in SecondOrderStepper::solveAdaptive
+  struct AdaptiveOptions
   {
-    double dt = tend/steps;
-    double gamma = 0.5;
-    double beta = 0.25;
+    double rtol = 1e-6;
+    double atol = 1e-8;
+    double dtmin = 1e-12;
+    double dtmax = std::numeric_limits<double>::max();
+    double safety = 0.9;
+    double facmin = 0.2;
+    double facmax = 5;
+    double hysteresis = 1.2;   // don't increase dt by less than this factor
+  };
+
+  // step size history, t is the start of the step, err < 0 marks a Newton failure
+  struct StepInfo
+  {
+    double t;
+    double dt;
+    double err;
+    bool accepted;
+  };
+
 
-    Vector<> a(x.size());
-    Vector<> v(x.size());
+  // Common base of the implicit second order steppers for  M d^2x/dt^2 = rhs(x).
+  //
+  // The stepper owns x, v, a and all work vectors, so doStep does not allocate.
+  // The mass is a linear MassOperator, so the residual costs one application
+  // of M (O(n) for lumped masses). The unknown of the Newton iteration is the
+  // new acceleration, the iteration matrix is
+  //      S = (1-alpham) M - (1-alphaf) beta dt^2 rhs'(x).
+  // Its inverse is kept over Newton iterations and time steps (modified Newton),
+  // and is only rebuilt when dt changes or the Newton contraction deteriorates.
+  // If rhs provides a sparse Jacobian, setSparse(true) keeps S as sparse
+  // matrix instead, and Newton corrections are computed by BiCGStab.
+  // setBanded(true) copies the sparse S into a band matrix and factors it,
+  // which pays off for chain-like systems with a bandwidth-reducing numbering.
+  //
+  // With setConstraints, the stepper solves the index-3 system
+  //      M d^2x/dt^2 = rhs(x) + diag(s) G^T lambda,   g(x) = 0
+  // for all multipliers jointly. The Newton matrix is the KKT matrix
+  //      [ S  -diag(s)G^T ]
+  //      [ G       0      ]
+  // where S includes the curvature term -beta dt^2 K of the constraint
+  // forces (see ConstraintFunction::addForceDeriv) on the dense and the
+  // sparse path, reduced to the Schur complement G S^{-1} diag(s) G^T. The dense solver uses the exact
+  // Schur complement, the sparse ones approximate S^{-1} by its diagonal,
+  // which keeps the Schur complement sparse and is exact for lumped masses.
+  // The multipliers of the last step are the start values of the next one.
+  class SecondOrderStepper
+  {
+  protected:
+    std::shared_ptr<NonlinearFunction> m_rhs;
+    double m_alpham, m_alphaf, m_gamma, m_beta;
+    size_t m_n;
 
-    auto xold = std::make_shared<ConstantFunction>(x);
-    auto vold = std::make_shared<ConstantFunction>(dx);
-    auto aold = std::make_shared<ConstantFunction>(x);
-    rhs->evaluate (xold->get(), aold->get());
+    std::shared_ptr<MassOperator> m_mass;
+    Vector<> m_x, m_v, m_a;     // state at time m_t
+    Vector<> m_fold;            // rhs(m_x)
+    Vector<> m_xpred, m_vpred;  // predictors, i.e. x and v for anew = 0
+    Vector<> m_anew, m_xnew, m_fnew, m_tmp, m_res;
+    std::unique_ptr<Matrix<>> m_jac;
+    std::unique_ptr<Matrix<>> m_iterinv;  // inverse of the iteration matrix S
 
-    auto anew = std::make_shared<IdentityFunction>(a.size());
-    auto vnew = vold + dt*((1-gamma)*aold+gamma*anew);
-    auto xnew = xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew);    
+    std::shared_ptr<SparseJacobianFunction> m_sparserhs;
+    bool m_sparse = false;
+    SparseMatrix m_sjac, m_siter;
+    std::vector<size_t> m_jacpos;         // position of m_sjac entries in m_siter
+    size_t m_patternversion = 0;          // of m_sjac
+    std::unique_ptr<SparseBiCGStabSolver> m_ssolver;
+    bool m_banded = false;
+    std::unique_ptr<BandMatrix> m_band;   // LU factors of S
 
-    auto equ = Compose(mass, anew) - Compose(rhs, xnew);
+    struct ConstraintData
+    {
+      std::shared_ptr<ConstraintFunction> func;
+      Vector<> scale;             // force scaling s
+      Vector<> lambda, lambdanew; // multipliers at m_t, and of the last tryStep
+      Vector<> g, dlambda, res;
+      Vector<> weight;            // diag(S)^{-1} s, sparse solvers
+      SparseMatrix G, Giter;      // at m_xnew, and frozen with the iteration matrix
+      SparseMatrix curv;          // dense solver: curvature of the constraint forces
+      ConstraintSchurComplement schur;
+      std::unique_ptr<Matrix<>> schurinv;   // dense solver: (G S^{-1} diag(s) G^T)^{-1}
+      std::unique_ptr<Matrix<>> sinvb;      // dense solver: S^{-1} diag(s) G^T
 
-    double t = 0;
-    for (int i = 0; i < steps; i++)            
+      ConstraintData (std::shared_ptr<ConstraintFunction> _func)
+        : func(_func), scale(func->dimX()),
+          lambda(func->numConstraints()), lambdanew(func->numConstraints()),
+          g(func->numConstraints()), dlambda(func->numConstraints()),
+          res(func->numConstraints()), weight(func->dimX()),
+          G(func->createJacobian()), Giter(G), schur(G)
       {
-        NewtonSolver (equ, a);
-        xnew -> evaluate (a, x);
-        vnew -> evaluate (a, v);
-
-        xold->set(x);
-        vold->set(v);
-        aold->set(a);
-        t += dt;
-        if (callback) callback(t, x);
+        std::vector<std::array<size_t,2>> entries;
+        func->getForceDerivPattern(entries);
+        curv = SparseMatrix(func->dimX(), func->dimX(), std::move(entries));
+        func->getForceScaling(scale);
+        lambda = 0.0;
       }
-    dx = v;
-  }
+    };
+    std::unique_ptr<ConstraintData> m_constr;
+    double m_ctol = 1e-12;
+    double m_t = 0;
+    double m_dtiter = -1;       // dt the iteration matrix was built for
+    bool m_foldvalid = false;
+    double m_dtnew = 0;         // dt of the last tryStep
 
+    double m_tol = 1e-10;
+    int m_maxsteps = 50;
+    double m_maxcontraction = 0.25;
 
+    size_t m_numupdates = 0;
+    size_t m_numiterations = 0;
 
+    SecondOrderStepper (std::shared_ptr<NonlinearFunction> rhs,
+                        std::shared_ptr<MassOperator> mass,
+                        double alpham, double alphaf, double gamma, double beta)
+      : m_rhs(rhs), m_alpham(alpham), m_alphaf(alphaf), m_gamma(gamma), m_beta(beta),
+        m_n(rhs->dimX()), m_mass(mass),
+        m_x(m_n), m_v(m_n), m_a(m_n), m_fold(m_n),
+        m_xpred(m_n), m_vpred(m_n),
+        m_anew(m_n), m_xnew(m_n), m_fnew(m_n), m_tmp(m_n), m_res(m_n)
+    {
+      m_sparserhs = std::dynamic_pointer_cast<SparseJacobianFunction>(rhs);
+      m_x = 0.0;
+      m_v = 0.0;
+      m_a = 0.0;
+    }
 
-  // Generalized alpha method for M d^2x/dt^2 = rhs
-  void SolveODE_Alpha (double tend, int steps, double rhoinf,
-                       VectorView<double> x, VectorView<double> dx, VectorView<double> ddx,
-                       std::shared_ptr<NonlinearFunction> rhs,   
-                       std::shared_ptr<NonlinearFunction> mass,  
-                       std::function<void(double,VectorView<double>)> callback = nullptr)
+    void setParameters (double alpham, double alphaf, double gamma, double beta)
+    {
+      m_alpham = alpham;
+      m_alphaf = alphaf;
+      m_gamma = gamma;
+      m_beta = beta;
+      m_dtiter = -1;
+    }
+
+    void updateIterationMatrix (VectorView<double> x, double dt)
+    {
+      double ck = (1-m_alphaf)*m_beta*dt*dt;
+      if (m_sparse)
+        {
+          m_sparserhs->evaluateDerivSparse(x, m_sjac);
+          if (m_sparserhs->patternVersion() != m_patternversion)
+            {
+              // e.g. new contacts, rebuild the pattern of S
+              initSparse();
+              m_sparserhs->evaluateDerivSparse(x, m_sjac);
+            }
+          m_siter.setZero();
+          for (size_t k = 0; k < m_sjac.nze(); k++)
+            m_siter.val(m_jacpos[k]) = -ck * m_sjac.val(k);
+          m_mass->addTo(m_siter, 1-m_alpham);
+          if (m_constr)
+            m_constr->func->addForceDeriv(x, m_constr->lambdanew, m_siter, -m_beta*dt*dt);
+          if (m_banded)
+            {
+              m_band->setZero();
+              for (size_t i = 0; i < m_n; i++)
+                for (size_t k = m_siter.firstInRow(i); k < m_siter.nextInRow(i); k++)
+                  (*m_band)(i, m_siter.colNr(k)) = m_siter.val(k);
+              m_band->factorLU();
+            }
+          else
+            m_ssolver->setMatrix(m_siter);
+        }
+      else
+        {
+          if (!m_jac)
+            {
+              m_jac = std::make_unique<Matrix<>>(m_n, m_n);
+              m_iterinv = std::make_unique<Matrix<>>(m_n, m_n);
+            }
+          m_rhs->evaluateDeriv(x, *m_jac);
+          *m_iterinv = (-ck) * (*m_jac);
+          m_mass->addTo(*m_iterinv, 1-m_alpham);
+          if (m_constr)
+            {
+              auto & cd = *m_constr;
+              cd.curv.setZero();
+              cd.func->addForceDeriv(x, cd.lambdanew, cd.curv, 1);
+              cd.curv.addTo(*m_iterinv, -m_beta*dt*dt);
+            }
+          calcInverse(*m_iterinv);
+        }
+      if (m_constr)
+        updateConstraintMatrix(x);
+      m_dtiter = dt;
+      m_numupdates++;
+    }
+
+    // m_tmp = S^{-1} m_res
+    void solveIteration ()
+    {
+      if (m_banded)
+        {
+          m_tmp = m_res;
+          m_band->solveLU(m_tmp);
+        }
+      else if (m_sparse)
+        {
+          m_tmp = 0.0;
+          m_ssolver->solve(m_siter, m_res, m_tmp);
+        }
+      else
+        m_tmp = (*m_iterinv)*m_res;
+    }
+
+    // pattern of S from the Jacobian, the mass and the constraint curvature
+    void initSparse ()
+    {
+      m_sjac = m_sparserhs->createJacobian();
+      m_patternversion = m_sparserhs->patternVersion();
+      auto entries = m_sjac.entries();
+      m_mass->getPattern(entries);
+      if (m_constr)
+        m_constr->func->getForceDerivPattern(entries);
+      m_siter = SparseMatrix(m_n, m_n, entries);
+      m_jacpos.resize(m_sjac.nze());
+      for (size_t i = 0; i < m_n; i++)
+        for (size_t k = m_sjac.firstInRow(i); k < m_sjac.nextInRow(i); k++)
+          m_jacpos[k] = m_siter.position(i, m_sjac.colNr(k));
+      if (!m_ssolver)
+        m_ssolver = std::make_unique<SparseBiCGStabSolver>(m_n, 1e-10);
+      if (m_banded)
+        {
+          auto [kl, ku] = m_siter.bandwidth();
+          m_band = std::make_unique<BandMatrix>(m_n, kl, ku);
+        }
+    }
+
+    // Schur complement of the KKT matrix, with G at x
+    void updateConstraintMatrix (VectorView<double> x)
+    {
+      auto & cd = *m_constr;
+      cd.func->evaluateJacobian(x, cd.Giter);
+      size_t m = cd.lambda.size();
+      if (m_sparse)
+        {
+          m_siter.getDiag(cd.weight);
+          for (size_t j = 0; j < m_n; j++)
+            cd.weight(j) = cd.scale(j) / cd.weight(j);
+          cd.schur.assemble(cd.Giter, cd.weight);
+          return;
+        }
+
+      if (!cd.schurinv)
+        {
+          cd.schurinv = std::make_unique<Matrix<>>(m, m);
+          cd.sinvb = std::make_unique<Matrix<>>(m_n, m);
+        }
+      auto & sinv = *m_iterinv;
+      auto & sinvb = *cd.sinvb;
+      auto & schur = *cd.schurinv;
+      sinvb = 0.0;
+      for (size_t c = 0; c < m; c++)
+        for (size_t k = cd.Giter.firstInRow(c); k < cd.Giter.nextInRow(c); k++)
+          {
+            size_t j = cd.Giter.colNr(k);
+            double val = cd.scale(j) * cd.Giter.val(k);
+            for (size_t i = 0; i < m_n; i++)
+              sinvb(i,c) += val * sinv(i,j);
+          }
+      schur = 0.0;
+      for (size_t c = 0; c < m; c++)
+        for (size_t k = cd.Giter.firstInRow(c); k < cd.Giter.nextInRow(c); k++)
+          for (size_t d = 0; d < m; d++)
+            schur(c,d) += cd.Giter.val(k) * sinvb(cd.Giter.colNr(k), d);
+      calcInverse(schur);
+    }
+
+    // m_tmp = S^{-1} m_res on input. Block elimination of the KKT system
+    // with right hand side (m_res, g/(beta dt^2)): the corrections are
+    // lambda -= dlambda and anew -= m_tmp.
+    void solveConstraintCorrection (double dt)
+    {
+      auto & cd = *m_constr;
+      // res = g/(beta dt^2) - G S^{-1} m_res
+      cd.res = (1/(m_beta*dt*dt)) * cd.g;
+      cd.Giter.multAdd(-1, m_tmp, cd.res);
+
+      if (m_sparse)
+        {
+          cd.schur.solve(cd.res, cd.dlambda);
+          AddConstraintForce(cd.Giter, cd.weight, 1, cd.dlambda, m_tmp);
+        }
+      else
+        {
+          cd.dlambda = (*cd.schurinv) * cd.res;
+          m_tmp += (*cd.sinvb) * cd.dlambda;
+        }
+      cd.lambdanew -= cd.dlambda;
+    }
+
+  public:
+    virtual ~SecondOrderStepper() = default;
+
+    void setState (VectorView<double> x, VectorView<double> v, VectorView<double> a)
+    {
+      m_x = x;
+      m_v = v;
+      m_a = a;
+      m_foldvalid = false;
+    }
+
+    // set x and v, and compute a consistent initial acceleration from M a = rhs(x)
+    void setState (VectorView<double> x, VectorView<double> v)
+    {
+      m_x = x;
+      m_v = v;
+      m_rhs->evaluate(m_x, m_fold);
+      m_foldvalid = true;
+      m_mass->solve(m_fold, m_a);
+    }
+
+    void setTime (double t) { m_t = t; }
+    double time() const { return m_t; }
+
+    VectorView<double> position() { return m_x; }
+    VectorView<double> velocity() { return m_v; }
+    VectorView<double> acceleration() { return m_a; }
+
+    void setTolerance (double tol) { m_tol = tol; }
+    void setMaxSteps (int maxsteps) { m_maxsteps = maxsteps; }
+    // refresh the iteration matrix if residuals decrease slower than this factor
+    void setMaxContraction (double theta) { m_maxcontraction = theta; }
+
+    // force a rebuild of the iteration matrix in the next step,
+    // e.g. after rhs has been modified
+    void invalidate()
+    {
+      m_dtiter = -1;
+      m_foldvalid = false;
+    }
+
+    // use the sparse Jacobian of rhs and an iterative solver for S
+    void setSparse (bool sparse)
+    {
+      if (sparse && !m_sparserhs)
+        throw std::invalid_argument("SecondOrderStepper: rhs has no sparse Jacobian");
+      m_sparse = sparse;
+      m_banded = false;
+      m_dtiter = -1;
+      if (sparse)
+        initSparse();
+    }
+
+    // use the sparse Jacobian of rhs and a band LU factorization of S,
+    // the bandwidth is taken from the pattern of S
+    void setBanded (bool banded)
+    {
+      if (banded && !m_sparserhs)
+        throw std::invalid_argument("SecondOrderStepper: rhs has no sparse Jacobian");
+      m_sparse = banded;
+      m_banded = banded;
+      m_dtiter = -1;
+      if (banded)
+        initSparse();
+    }
+
+    // Solve for the constraints g(x) = 0 with Lagrange multipliers. rhs should
+    // not enforce them itself, see MSS_Function::setConstraintProjection.
+    // The iteration stops if also |g| < ctol, the tolerance of the
+    // residual becomes relative to the size of the constraint forces.
+    void setConstraints (std::shared_ptr<ConstraintFunction> constraints, double ctol = 1e-12)
+    {
+      if (constraints && constraints->dimX() != m_n)
+        throw std::invalid_argument("SecondOrderStepper: constraints have wrong dimension");
+      m_constr = constraints ? std::make_unique<ConstraintData>(constraints) : nullptr;
+      m_ctol = ctol;
+      m_dtiter = -1;
+      // the curvature of the constraint forces may extend the pattern of S
+      if (m_sparse)
+        initSparse();
+    }
+
+    // multipliers of the constraints at time()
+    VectorView<double> lagrangeMultipliers()
+    {
+      if (!m_constr)
+        throw std::logic_error("SecondOrderStepper: no constraints set");
+      return m_constr->lambda;
+    }
+    bool hasConstraints() const { return bool(m_constr); }
+
+    // dt of the last step
+    double stepSize() const { return m_dtnew; }
+    // e.g. from a checkpoint, to continue with stepSize() as before
+    void setStepSize (double dt) { m_dtnew = dt; }
+
+    size_t numJacobianUpdates() const { return m_numupdates; }
+    size_t numNewtonIterations() const { return m_numiterations; }
+
+    // compute a candidate step of size dt, returns false if Newton fails.
+    // The state is changed only by acceptStep().
+    bool tryStep (double dt)
+    {
+      double dt2 = dt*dt;
+
+      m_xpred = m_x;
+      m_xpred += dt*m_v;
+      m_xpred += (0.5*dt2*(1-2*m_beta))*m_a;
+      m_vpred = m_v;
+      m_vpred += (dt*(1-m_gamma))*m_a;
+
+      if (m_alphaf != 0 && !m_foldvalid)
+        {
+          m_rhs->evaluate(m_x, m_fold);
+          m_foldvalid = true;
+        }
+
+      m_anew = m_a;
+      if (m_constr)
+        m_constr->lambdanew = m_constr->lambda;
+      m_dtnew = dt;
+      double errold = 0;
+
+      for (int it = 0; it < m_maxsteps; it++)
+        {
+          m_xnew = m_xpred;
+          m_xnew += (m_beta*dt2)*m_anew;
+          m_rhs->evaluate(m_xnew, m_fnew);
+
+          // res = M ((1-alpham) anew + alpham a) - (1-alphaf) f(xnew) - alphaf f(x)
+          m_tmp = (1-m_alpham)*m_anew;
+          m_tmp += m_alpham*m_a;
+          m_mass->mult(m_tmp, m_res);
+          m_res -= (1-m_alphaf)*m_fnew;
+          if (m_alphaf != 0)
+            m_res -= m_alphaf*m_fold;
+
+          double err = norm(m_res);
+          bool converged = err < m_tol;
+          if (m_constr)
+            {
+              // res -= diag(s) G^T lambda,  and the constraint violation
+              auto & cd = *m_constr;
+              cd.func->evaluateJacobian(m_xnew, cd.G);
+              m_tmp = 0.0;
+              AddConstraintForce(cd.G, cd.scale, 1, cd.lambdanew, m_tmp);
+              m_res -= m_tmp;
+              cd.func->evaluate(m_xnew, cd.g);
+              err = norm(m_res);
+              double gerr = norm(cd.g);
+              // relative to the constraint forces, which may be large
+              converged = err < m_tol * (1+norm(m_tmp)) && gerr < m_ctol;
+              err += gerr / (m_beta*dt2);
+            }
+          if (converged) return true;
+          if (!std::isfinite(err)) break;
+
+          if (dt != m_dtiter || (it > 0 && err > m_maxcontraction*errold))
+            updateIterationMatrix(m_xnew, dt);
+          errold = err;
+
+          try
+            {
+              solveIteration();
+              if (m_constr)
+                solveConstraintCorrection(dt);
+            }
+          catch (std::domain_error &)
+            {
+              break;
+            }
+          m_anew -= m_tmp;
+          m_numiterations++;
+        }
+      // the matrix may be far off, don't reuse it for the retry
+      m_dtiter = -1;
+      return false;
+    }
+
+    // scaled norm of the local error estimate of the last tryStep.
+    // Zienkiewicz-Xie estimator: the difference of the corrected displacement
+    // to a Taylor expansion with linear acceleration,
+    //    e = (beta - 1/6) dt^2 (anew - a)
+    double errorEstimate (double rtol, double atol) const
+    {
+      double fac = (m_beta - 1.0/6) * m_dtnew*m_dtnew;
+      double sum = 0;
+      for (size_t i = 0; i < m_n; i++)
+        {
+          double sc = atol + rtol * std::max(std::abs(m_x(i)), std::abs(m_xnew(i)));
+          double ei = fac * (m_anew(i)-m_a(i)) / sc;
+          sum += ei*ei;
+        }
+      return std::sqrt(sum / m_n);
+    }
+
+    void acceptStep ()
+    {
+      m_x = m_xnew;
+      m_v = m_vpred;
+      m_v += (m_gamma*m_dtnew)*m_anew;
+      m_a = m_anew;
+      m_fold = m_fnew;
+      m_foldvalid = true;
+      if (m_constr)
+        m_constr->lambda = m_constr->lambdanew;
+      m_t += m_dtnew;
+    }
+
+    void doStep (double dt)
+    {
+      if (!tryStep(dt))
+        throw std::domain_error("Newton did not converge");
+      acceptStep();
+    }
+
+    void solve (double tend, int steps,
+                std::function<void(double,VectorView<double>)> callback = nullptr)
+    {
+      double dt = tend/steps;
+      for (int i = 0; i < steps; i++)
+        {
+          doStep(dt);
+          if (callback) callback(m_t, m_x);
+        }
+    }
+
+    // integrate to time() + tend with step size control from errorEstimate.
+    // Rejected steps and Newton failures are retried with a smaller dt.
+    void solveAdaptive (double tend, double dt,
+                        const AdaptiveOptions & opts = AdaptiveOptions(),
+                        std::function<void(double,VectorView<double>)> callback = nullptr,
+                        std::vector<StepInfo> * history = nullptr)
+    {
+      double tfinal = m_t + tend;
+      dt = std::min(dt, opts.dtmax);
+
+      while (m_t < tfinal - 1e-14 * std::max(1.0, std::abs(tfinal)))
+        {
+          double dtstep = std::min(dt, tfinal - m_t);
+          bool lastpart = dtstep < dt;
+
+          if (!tryStep(dtstep))
+            {
+              if (history) history->push_back ( { m_t, dtstep, -1, false } );
+              dt = 0.5 * dtstep;
+              if (dt < opts.dtmin)
+                throw std::domain_error("Newton did not converge, time step too small");
+              continue;
+            }
+
+          double err = errorEstimate(opts.rtol, opts.atol);
+          // local error is O(dt^3)
+          double fac = opts.safety * std::pow(std::max(err, 1e-10), -1.0/3);
+          fac = std::min(opts.facmax, std::max(opts.facmin, fac));
+
+          if (err > 1)
+            {
+              if (history) history->push_back ( { m_t, dtstep, err, false } );
+              dt = fac * dtstep;
+              if (dt < opts.dtmin)
+                throw std::domain_error("time step too small");
+              continue;
+            }
+
+          if (history) history->push_back ( { m_t, dtstep, err, true } );
+          acceptStep();
+          if (callback) callback(m_t, m_x);
+
+          // keep dt for small increases, to reuse the iteration matrix
+          if (!lastpart && (fac < 1 || fac > opts.hysteresis))
+            dt = std::min(fac * dtstep, opts.dtmax);
+        }
+    }
+  };
+
+
+  // Newmark method for  mass*d^2x/dt^2 = rhs
+  class NewmarkStepper : public SecondOrderStepper
   {
-    double dt = tend/steps;
-    double alpham = (2*rhoinf-1)/(rhoinf+1);
-    double alphaf = rhoinf/(rhoinf+1);
-    double gamma = 0.5-alpham+alphaf;
-    double beta = 0.25 * (1-alpham+alphaf)*(1-alpham+alphaf);
+  public:
+    NewmarkStepper (std::shared_ptr<NonlinearFunction> rhs,
+                    std::shared_ptr<MassOperator> mass,
+                    double gamma = 0.5, double beta = 0.25)
+      : SecondOrderStepper(rhs, mass, 0, 0, gamma, beta) { }
+
+    NewmarkStepper (std::shared_ptr<NonlinearFunction> rhs,
+                    std::shared_ptr<NonlinearFunction> mass,
+                    double gamma = 0.5, double beta = 0.25)
+      : NewmarkStepper(rhs, MakeMassOperator(mass), gamma, beta) { }
+  };
 
-    Vector<> a(x.size());
-    Vector<> v(x.size());
 
-    auto xold = std::make_shared<ConstantFunction>(x);
-    auto vold = std::make_shared<ConstantFunction>(dx);
-    auto aold = std::make_shared<ConstantFunction>(ddx);
-    // rhs->evaluate (xold->get(), aold->get()); // solve with M ???
+  // Generalized alpha method for M d^2x/dt^2 = rhs,
+  // rhoinf is the spectral radius for dt -> infinity
+  class GeneralizedAlphaStepper : public SecondOrderStepper
+  {
+  public:
+    GeneralizedAlphaStepper (std::shared_ptr<NonlinearFunction> rhs,
+                             std::shared_ptr<MassOperator> mass,
+                             double rhoinf = 0.8)
+      : SecondOrderStepper(rhs, mass, 0, 0, 0.5, 0.25)
+    {
+      double alpham = (2*rhoinf-1)/(rhoinf+1);
+      double alphaf = rhoinf/(rhoinf+1);
+      setParameters (alpham, alphaf,
+                     0.5-alpham+alphaf,
+                     0.25 * (1-alpham+alphaf)*(1-alpham+alphaf));
+    }
 
-    auto anew = std::make_shared<IdentityFunction>(a.size());
-    auto vnew = vold + dt*((1-gamma)*aold+gamma*anew);
-    auto xnew = xold + dt*vold + dt*dt/2 * ((1-2*beta)*aold+2*beta*anew);    
+    GeneralizedAlphaStepper (std::shared_ptr<NonlinearFunction> rhs,
+                             std::shared_ptr<NonlinearFunction> mass,
+                             double rhoinf = 0.8)
+      : GeneralizedAlphaStepper(rhs, MakeMassOperator(mass), rhoinf) { }
+  };
 
-    // auto equ = Compose(mass, (1-alpham)*anew+alpham*aold) - Compose(rhs, (1-alphaf)*xnew+alphaf*xold);
-    auto equ = Compose(mass, (1-alpham)*anew+alpham*aold) - (1-alphaf)*Compose(rhs,xnew) - alphaf*Compose(rhs, xold);
 
-    double t = 0;
-    a = ddx;
 
-    for (int i = 0; i < steps; i++)
-      {
-        NewtonSolver (equ, a);
-        xnew -> evaluate (a, x);
-        vnew -> evaluate (a, v);
-
-        xold->set(x);
-        vold->set(v);
-        aold->set(a);
-        t += dt;
-        if (callback) callback(t, x);
-      }
-    dx = v;
-    ddx = a;
+  // RATTLE for  d^2x/dt^2 = rhs(x) + diag(s) G^T lambda,  g(x) = 0,
+  // with rhs in acceleration form. Velocity Verlet, where the positions are
+  // projected onto g = 0 (SHAKE) and the velocities onto G v = 0, each time
+  // for all multipliers jointly. Explicit and symplectic, the constraints
+  // hold up to ctol in every step. The position projection is a simplified
+  // Newton iteration with the Schur complement G diag(s) G^T at the old
+  // positions, started from the multipliers of the last step.
+  class RattleStepper
+  {
+    std::shared_ptr<NonlinearFunction> m_rhs;
+    std::shared_ptr<ConstraintFunction> m_constr;
+    size_t m_n;
+    Vector<> m_x, m_v, m_f, m_xnew;
+    Vector<> m_scale, m_lambda, m_g, m_dlambda;
+    SparseMatrix m_G;
+    ConstraintSchurComplement m_schur;   // at m_x
+    double m_t = 0;
+    double m_ctol;
+    int m_maxsteps = 100;
+    size_t m_numiterations = 0;
+
+    // v -= diag(s) G^T A^{-1} G v,  and the Schur complement A at m_x
+    void projectVelocity ()
+    {
+      m_constr->evaluateJacobian(m_x, m_G);
+      m_schur.assemble(m_G, m_scale);
+      m_G.mult(m_v, m_g);
+      m_schur.solve(m_g, m_dlambda);
+      AddConstraintForce(m_G, m_scale, -1, m_dlambda, m_v);
+    }
+
+  public:
+    RattleStepper (std::shared_ptr<NonlinearFunction> rhs,
+                   std::shared_ptr<ConstraintFunction> constraints,
+                   double ctol = 1e-12)
+      : m_rhs(rhs), m_constr(constraints), m_n(rhs->dimX()),
+        m_x(m_n), m_v(m_n), m_f(m_n), m_xnew(m_n),
+        m_scale(m_n), m_lambda(constraints->numConstraints()),
+        m_g(constraints->numConstraints()), m_dlambda(constraints->numConstraints()),
+        m_G(constraints->createJacobian()), m_schur(m_G), m_ctol(ctol)
+    {
+      m_constr->getForceScaling(m_scale);
+      m_x = 0.0;
+      m_v = 0.0;
+      m_lambda = 0.0;
+    }
+
+    // x must satisfy the constraints, v is projected to G v = 0
+    void setState (VectorView<double> x, VectorView<double> v)
+    {
+      m_x = x;
+      m_v = v;
+      m_rhs->evaluate(m_x, m_f);
+      projectVelocity();
+    }
+
+    void setTime (double t) { m_t = t; }
+    double time() const { return m_t; }
+    VectorView<double> position() { return m_x; }
+    VectorView<double> velocity() { return m_v; }
+    VectorView<double> lagrangeMultipliers() { return m_lambda; }
+
+    void setTolerance (double ctol) { m_ctol = ctol; }
+    void setMaxSteps (int maxsteps) { m_maxsteps = maxsteps; }
+    size_t numProjectionIterations() const { return m_numiterations; }
+
+    void doStep (double dt)
+    {
+      // xnew = x + dt v + dt^2/2 (f + diag(s) G^T lambda)
+      double c = 0.5*dt*dt;
+      m_xnew = m_x;
+      m_xnew += dt*m_v;
+      m_xnew += c*m_f;
+      AddConstraintForce(m_G, m_scale, c, m_lambda, m_xnew);
+
+      int it = 0;
+      for ( ; it < m_maxsteps; it++)
+        {
+          m_constr->evaluate(m_xnew, m_g);
+          if (norm(m_g) < m_ctol) break;
+          // G(xnew) diag(s) G(x)^T  ~  A
+          m_schur.solve(m_g, m_dlambda);
+          AddConstraintForce(m_G, m_scale, -1, m_dlambda, m_xnew);
+          m_lambda -= (1/c) * m_dlambda;
+          m_numiterations++;
+        }
+      if (it == m_maxsteps)
+        throw std::domain_error("RATTLE: position projection did not converge");
+
+      // v_{1/2} = (xnew-x)/dt,  v = v_{1/2} + dt/2 f(xnew), projected
+      m_v = (1/dt)*m_xnew;
+      m_v -= (1/dt)*m_x;
+      m_x = m_xnew;
+      m_rhs->evaluate(m_x, m_f);
+      m_v += (0.5*dt)*m_f;
+      projectVelocity();
+      m_t += dt;
+    }
+
+    void solve (double tend, int steps,
+                std::function<void(double,VectorView<double>)> callback = nullptr)
+    {
+      double dt = tend/steps;
+      for (int i = 0; i < steps; i++)
+        {
+          doStep(dt);
+          if (callback) callback(m_t, m_x);
+        }
+    }
+  };
+
+
+
+  // Newmark method for  mass*d^2x/dt^2 = rhs
+  void SolveODE_Newmark(double tend, int steps,
+                        VectorView<double> x, VectorView<double> dx,
+                        std::shared_ptr<NonlinearFunction> rhs,
+                        std::shared_ptr<NonlinearFunction> mass,
+                        std::function<void(double,VectorView<double>)> callback = nullptr)
+  {
+    NewmarkStepper stepper(rhs, mass);
+    stepper.setState(x, dx);
+    stepper.solve(tend, steps, callback);
+    x = stepper.position();
+    dx = stepper.velocity();
+  }
+
+
+
+
+  // Generalized alpha method for M d^2x/dt^2 = rhs
+  void SolveODE_Alpha (double tend, int steps, double rhoinf,
+                       VectorView<double> x, VectorView<double> dx, VectorView<double> ddx,
+                       std::shared_ptr<NonlinearFunction> rhs,
+                       std::shared_ptr<NonlinearFunction> mass,
+                       std::function<void(double,VectorView<double>)> callback = nullptr)
+  {
+    GeneralizedAlphaStepper stepper(rhs, mass, rhoinf);
+    stepper.setState(x, dx, ddx);
+    stepper.solve(tend, steps, callback);
+    x = stepper.position();
+    dx = stepper.velocity();
+    ddx = stepper.acceleration();
   }
 
 
 
 
 
-#endif // NEWMARK_HPP
\ No newline at end of file
+#endif // NEWMARK_HPP
@@ -0,0 +1,147 @@
+// timings of force and Jacobian assembly on a 3D lattice
+//   bench_mass_spring [n=40] [maxthreads=64]
+// builds n^3 masses with springs to the axis- and face-diagonal neighbours
+//
+//   bench_mass_spring contact [maxmasses=1000000]
+// times force evaluation with contacts for random masses of fixed density
+
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "mass_spring.hpp"
+
+
+void BuildLattice (MassSpringSystem<3> & mss, size_t n)
+{
+  auto index = [n](size_t i, size_t j, size_t k) { return (i*n+j)*n+k; };
+
+  std::vector<Connector> masses;
+  for (size_t i = 0; i < n; i++)
+    for (size_t j = 0; j < n; j++)
+      for (size_t k = 0; k < n; k++)
+        masses.push_back (mss.addMass ( { 1, { double(i), double(j), double(k) } } ));
+
+  int offsets[][3] = { {1,0,0}, {0,1,0}, {0,0,1}, {1,1,0}, {1,0,1}, {0,1,1} };
+  for (size_t i = 0; i < n; i++)
+    for (size_t j = 0; j < n; j++)
+      for (size_t k = 0; k < n; k++)
+        for (auto & off : offsets)
+          {
+            size_t i2 = i+off[0], j2 = j+off[1], k2 = k+off[2];
+            if (i2 >= n || j2 >= n || k2 >= n) continue;
+            double length = std::sqrt(double(off[0]+off[1]+off[2]));
+            mss.addSpring ( { length, 100, { masses[index(i,j,k)], masses[index(i2,j2,k2)] } } );
+          }
+
+  for (size_t i = 0; i < n; i++)
+    for (size_t j = 0; j < n; j++)
+      {
+        auto fix = mss.addFix ( { { double(i), double(j), -1.0 } } );
+        mss.addSpring ( { 1, 100, { fix, masses[index(i,j,0)] } } );
+      }
+}
+
+
+template <typename FUNC>
+double Time (FUNC func, int runs)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++)
+    func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end-start).count() / runs;
+}
+
+
+void BenchContacts (size_t maxmasses)
+{
+  std::cout << "masses  candidates  evaluate[ms]  per mass[ns]" << std::endl;
+  for (size_t n = 1000; n <= maxmasses; n *= 10)
+    {
+      MassSpringSystem<3> mss;
+      std::mt19937 gen(1);
+      std::uniform_real_distribution<double> uniform(0, std::cbrt(double(n)));
+      for (size_t i = 0; i < n; i++)
+        mss.addMass ( { 1, { uniform(gen), uniform(gen), uniform(gen) } } );
+      mss.setContact (0.3, 100);
+      mss.addContactPlane ( { 0, 0, 1 }, 0.5 );
+      // masses along a space-filling curve, for locality of grid and forces
+      mss.reorderMasses (MassOrdering::MORTON);
+
+      MSS_Function<3> func(mss);
+      Vector<> x(3*n), v(3*n), a(3*n), f(3*n);
+      mss.getState (x, v, a);
+      func.evaluate (x, f);
+
+      // small motions, such that the grid is updated incrementally
+      double t = Time ([&]
+        {
+          for (size_t i = 0; i < x.size(); i++)
+            x(i) += 0.01;
+          func.evaluate (x, f);
+        }, 5);
+      SparseMatrix jac = func.createJacobian();
+      size_t ncandidates = (jac.nze()/9 - n) / 2;
+      std::cout << n << "  " << ncandidates << "  " << 1e3*t << "  " << 1e9*t/n << std::endl;
+    }
+}
+
+
+int main (int argc, char ** argv)
+{
+  if (argc > 1 && std::string(argv[1]) == "contact")
+    {
+      BenchContacts ((argc > 2) ? std::stoul(argv[2]) : 1000000);
+      return 0;
+    }
+
+  size_t n = (argc > 1) ? std::stoul(argv[1]) : 40;
+  int maxthreads = (argc > 2) ? std::stoi(argv[2]) : 64;
+
+  MassSpringSystem<3> mss;
+  mss.setGravity ( { 0, 0, -9.81 } );
+  BuildLattice (mss, n);
+
+  MSS_Function<3> func(mss);
+  size_t ndof = func.dimX();
+
+  Vector<> x(ndof), v(ndof), a(ndof), f(ndof), fref(ndof);
+  mss.getState (x, v, a);
+  // perturb, such that all springs carry force
+  for (size_t i = 0; i < ndof; i++)
+    x(i) += 0.01 * std::sin(double(i));
+
+  std::cout << "masses = " << mss.masses().size() << ", springs = " << mss.springs().size()
+            << ", colors = " << func.compiled().numColors() << std::endl;
+
+  SparseMatrix jac = func.createJacobian();
+  func.evaluate (x, fref);
+
+  std::cout << "threads  evaluate[ms]  jacobian[ms]  reproducible" << std::endl;
+  for (int threads = 1; threads <= maxthreads; threads *= 2)
+    {
+#ifdef _OPENMP
+      omp_set_num_threads (threads);
+#else
+      if (threads > 1) break;
+#endif
+      double tf = Time ([&] { func.evaluate (x, f); }, 20);
+      double tj = Time ([&] { func.evaluateDerivSparse (x, jac); }, 3);
+      bool same = std::memcmp (f.data(), fref.data(), ndof*sizeof(double)) == 0;
+      std::cout << threads << "  " << 1e3*tf << "  " << 1e3*tj << "  " << (same ? "yes" : "no") << std::endl;
+    }
+
+  // overhead of the fused energy computation
+  func.setDiagnostics (true);
+  double tdiag = Time ([&] { func.evaluate (x, f); func.diagnostics (x, v); }, 20);
+  func.setDiagnostics (false);
+  double tplain = Time ([&] { func.evaluate (x, f); }, 20);
+  std::cout << "evaluate + diagnostics[ms] = " << 1e3*tdiag
+            << ", overhead = " << 100*(tdiag/tplain-1) << "%" << std::endl;
+}
@@ -2,16 +2,90 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
+#include <pybind11/numpy.h>
 
 #include "mass_spring.hpp"
 #include "Newmark.hpp"
+#include "mss_generators.hpp"
+#include "simulator.hpp"
+#include "checkpoint.hpp"
+#include "multirate.hpp"
+#include "modal_reduction.hpp"
+#include "statics.hpp"
 
 namespace py = pybind11;
 
-PYBIND11_MAKE_OPAQUE(std::vector<Mass<3>>);
 PYBIND11_MAKE_OPAQUE(std::vector<Fix<3>>);
 PYBIND11_MAKE_OPAQUE(std::vector<Spring>);
 
+using DoubleArray = py::array_t<double, py::array::c_style | py::array::forcecast>;
+
+// n x 3 positions as contiguous array
+static DoubleArray Positions3d (DoubleArray pos)
+{
+  if (pos.ndim() != 2 || pos.shape(1) != 3)
+    throw std::invalid_argument("positions must be an (n,3) array");
+  return pos;
+}
+
+// scalar or array of length n, returns pointer and stride
+static std::pair<const double*, size_t> ScalarOrArray (const DoubleArray & a, size_t n, const char * name)
+{
+  if (a.ndim() == 0 || (a.ndim() == 1 && a.shape(0) == 1))
+    return { a.data(), 0 };
+  if (a.ndim() != 1 || size_t(a.shape(0)) != n)
+    throw std::invalid_argument(std::string(name)+" must be a scalar or have one entry per item");
+  return { a.data(), 1 };
+}
+
+static Vec<3> ToVec (std::array<double,3> p) { return Vec<3>{ p[0], p[1], p[2] }; }
+
+// numpy view to n x 3 doubles owned by owner, no copy
+static py::array_t<double> StateArray (py::object owner, double * data, size_t n)
+{
+  if (n == 0) return py::array_t<double>(std::vector<size_t>{ 0, 3 });
+  return py::array_t<double>(std::vector<size_t>{ n, 3 }, data, owner);
+}
+
+// stepper callback, which hands a snapshot of the system with the stepper
+// state to the writer every 'every' steps
+template <typename STEPPER>
+std::function<void(double,VectorView<double>)>
+CheckpointCallback (MassSpringSystem<3> & mss, STEPPER & stepper,
+                    AsyncCheckpointWriter * writer, std::string filename, size_t every)
+{
+  if (!writer) return nullptr;
+  auto count = std::make_shared<size_t>(0);
+  return [&mss, &stepper, writer, filename, every, count] (double, VectorView<double>)
+  {
+    if (++*count % every != 0) return;
+    StepperState state = GetStepperState(stepper);
+    size_t n = state.x.size();
+    mss.setState (VectorView<double>(n, state.x.data()), VectorView<double>(n, state.v.data()),
+                  VectorView<double>(n, state.a.data()));
+    writer->write (filename, SerializeCheckpoint(mss, &state));
+  };
+}
+
+// reduced model of a system, positions come back in the numbering of the system
+struct ModalModel
+{
+  MassSpringSystem<3> & mss;
+  ModalReduction<3> reduction;
+
+  ModalModel (MassSpringSystem<3> & _mss, const MSS_Function<3> & func, VectorView<double> x, size_t k, double shift)
+    : mss(_mss), reduction(func, x, k, shift) { }
+
+  // full state at time t, in state order
+  void state (double t, VectorView<double> x, VectorView<double> v) const
+  {
+    Vector<> q(reduction.numModes()), dq(reduction.numModes());
+    reduction.state (t, q, dq);
+    reduction.expand (q, x);
+    reduction.expandVelocity (dq, v);
+  }
+};
+
 PYBIND11_MODULE(mass_spring, m) {
     m.doc() = "mass-spring-system simulator"; 
 
@@ -43,6 +117,30 @@ PYBIND11_MODULE(mass_spring, m) {
       return Mass<3>{m, { p[0], p[1], p[2] }};
     });
 
+    py::class_<MassView<3>> (m, "MassView3d", "mass in a system, pos/vel/acc are views to its state")
+      .def_property("mass",
+                    [](const MassView<3> & m) { return m.mass(); },
+                    [](MassView<3> & m, double mass) { m.setMass(mass); })
+      .def_property_readonly("pos", [](py::object self) {
+        return py::array_t<double>(3, self.cast<MassView<3>&>().pos.data(), self); })
+      .def_property_readonly("vel", [](py::object self) {
+        return py::array_t<double>(3, self.cast<MassView<3>&>().vel.data(), self); })
+      .def_property_readonly("acc", [](py::object self) {
+        return py::array_t<double>(3, self.cast<MassView<3>&>().acc.data(), self); })
+      ;
+
+    using MassList3d = MassList<MassSpringSystem<3>>;
+    py::class_<MassList3d> (m, "MassList3d")
+      .def("__len__", &MassList3d::size)
+      .def("__getitem__", [](const MassList3d & list, size_t i) {
+        if (i >= list.size()) throw py::index_error();
+        return list[i];
+      }, py::keep_alive<0,1>())
+      .def("__iter__", [](const MassList3d & list) {
+        return py::make_iterator(list.begin(), list.end());
+      }, py::keep_alive<0,1>())
+      ;
+
 
 
     py::class_<Fix<2>> (m, "Fix2d")
@@ -74,7 +172,6 @@ PYBIND11_MODULE(mass_spring, m) {
       ;
 
     
-    py::bind_vector<std::vector<Mass<3>>>(m, "Masses3d");
     py::bind_vector<std::vector<Fix<3>>>(m, "Fixes3d");
     py::bind_vector<std::vector<Spring>>(m, "Springs");        
     
@@ -99,38 +196,383 @@ PYBIND11_MODULE(mass_spring, m) {
       .def("add", [](MassSpringSystem<3> & mss, Spring s) { return mss.addSpring(s); })
 
       .def("addDistanceConstraint",&MassSpringSystem<3>::addDistanceConstraint)
+      .def("setContact", &MassSpringSystem<3>::setContact, py::arg("radius"), py::arg("stiffness"),
+           "penalty contacts between masses as balls of the radius, not between masses joined by a spring, stiffness 0 switches them off")
+      .def("addContactPlane", [](MassSpringSystem<3> & mss, std::array<double,3> n, double offset) {
+        mss.addContactPlane (Vec<3>{n[0],n[1],n[2]}, offset);
+      }, py::arg("normal"), py::arg("offset")=0.0, "masses stay in  normal.x >= offset")
+
+      .def("reserve", &MassSpringSystem<3>::reserve,
+           py::arg("masses"), py::arg("fixes")=0, py::arg("springs")=0)
+      .def("addMasses", [](MassSpringSystem<3> & mss, DoubleArray pos, DoubleArray mass) {
+        pos = Positions3d(pos);
+        size_t n = pos.shape(0);
+        auto [mp, ms] = ScalarOrArray(mass, n, "mass");
+        return mss.addMasses (n, pos.data(), mp, ms);
+      }, py::arg("positions"), py::arg("mass"),
+        "add masses at the rows of the (n,3) array, returns the number of the first one")
+      .def("addFixes", [](MassSpringSystem<3> & mss, DoubleArray pos) {
+        pos = Positions3d(pos);
+        return mss.addFixes (pos.shape(0), pos.data());
+      }, py::arg("positions"), "add fixes, returns the number of the first one")
+      .def("addSprings", [](MassSpringSystem<3> & mss,
+                            py::array_t<size_t, py::array::c_style | py::array::forcecast> pairs,
+                            DoubleArray stiffness, std::optional<DoubleArray> lengths, bool fixfirst) {
+        if (pairs.ndim() != 2 || pairs.shape(1) != 2)
+          throw std::invalid_argument("pairs must be an (m,2) array");
+        size_t n = pairs.shape(0);
+        auto [sp, ss] = ScalarOrArray(stiffness, n, "stiffness");
+        const double * lp = nullptr;
+        size_t ls = 0;
+        if (lengths)
+          std::tie(lp, ls) = ScalarOrArray(*lengths, n, "lengths");
+        return mss.addSprings (n, pairs.data(), lp, ls, sp, ss,
+                               fixfirst ? Connector::FIX : Connector::MASS, Connector::MASS);
+      }, py::arg("pairs"), py::arg("stiffness"), py::arg("lengths")=py::none(), py::arg("fix_first")=false,
+        "springs between the masses in the rows of pairs, rest lengths default to the current distances.\n"
+        "With fix_first, the first column numbers fixes.")
 
-      .def_property_readonly("masses", [](MassSpringSystem<3> & mss) -> auto& { return mss.masses(); })
-      .def_property_readonly("fixes", [](MassSpringSystem<3> & mss) -> auto& { return mss.fixes(); })
-      .def_property_readonly("springs", [](MassSpringSystem<3> & mss) -> auto& { return mss.springs(); })
-      .def("__getitem__", [](MassSpringSystem<3> mss, Connector & c) {
-        if (c.type==Connector::FIX) return py::cast(mss.fixes()[c.nr]);
-        else return py::cast(mss.masses()[c.nr]);
+      .def("addChain", [](MassSpringSystem<3> & mss, size_t n, std::array<double,3> start,
+                          std::array<double,3> end, double mass, double stiffness, bool fixstart) {
+        return AddChain (mss, n, ToVec(start), ToVec(end), mass, stiffness, fixstart);
+      }, py::arg("n"), py::arg("start"), py::arg("end"), py::arg("mass"), py::arg("stiffness"),
+        py::arg("fix_start")=true)
+      .def("addCloth", [](MassSpringSystem<3> & mss, size_t nx, size_t ny, std::array<double,3> origin,
+                          std::array<double,3> e1, std::array<double,3> e2,
+                          double mass, double stiffness, bool shear, bool bend) {
+        return AddCloth (mss, nx, ny, ToVec(origin), ToVec(e1), ToVec(e2), mass, stiffness, shear, bend);
+      }, py::arg("nx"), py::arg("ny"), py::arg("origin"), py::arg("e1"), py::arg("e2"),
+        py::arg("mass"), py::arg("stiffness"), py::arg("shear")=true, py::arg("bend")=false,
+        "mass (i,j) at origin + i e1 + j e2 has number first + j*nx + i")
+      .def("addLattice", [](MassSpringSystem<3> & mss, size_t nx, size_t ny, size_t nz,
+                            std::array<double,3> origin, double spacing,
+                            double mass, double stiffness, bool diagonals, bool bend) {
+        return AddLattice (mss, nx, ny, nz, ToVec(origin), spacing, mass, stiffness, diagonals, bend);
+      }, py::arg("nx"), py::arg("ny"), py::arg("nz"), py::arg("origin"), py::arg("spacing"),
+        py::arg("mass"), py::arg("stiffness"), py::arg("diagonals")=false, py::arg("bend")=false,
+        "mass (i,j,k) has number first + (k*ny+j)*nx + i")
+
+      .def_property_readonly("masses", py::cpp_function([](MassSpringSystem<3> & mss) { return mss.masses(); },
+                                                        py::keep_alive<0,1>()))
+      .def_property_readonly("fixes", [](const MassSpringSystem<3> & mss) -> auto& { return mss.fixes(); })
+      .def_property_readonly("springs", [](const MassSpringSystem<3> & mss) -> auto& { return mss.springs(); })
+      .def("__getitem__", [](const MassSpringSystem<3> & mss, Connector & c) {
+        if (c.type==Connector::FIX) return py::cast(mss.fix(c));
+        else return py::cast(mss.mass(c));
+      })
+
+      .def("reorder", [](MassSpringSystem<3> & mss, std::string ordering) {
+        if (ordering == "rcm") mss.reorderMasses(MassOrdering::RCM);
+        else if (ordering == "morton") mss.reorderMasses(MassOrdering::MORTON);
+        else if (ordering == "insertion") mss.reorderMasses(MassOrdering::INSERTION);
+        else throw std::invalid_argument("unknown ordering '"+ordering+"'");
+      }, py::arg("ordering")="rcm",
+        "renumber the masses in the state vector: 'rcm', 'morton' or 'insertion'")
+      .def("massIndex", [](const MassSpringSystem<3> & mss, Connector & c) {
+        return mss.massIndex(c.nr);
+      })
+      .def("jacobianBandwidth", [](const MassSpringSystem<3> & mss) {
+        return MSS_Function<3>(mss).createJacobian().bandwidth();
       })
       
-      .def("getState", [] (MassSpringSystem<3> & mss) {
-        Vector<> x(3*mss.masses().size());
-        Vector<> dx(3*mss.masses().size());
-        Vector<> ddx(3*mss.masses().size());
-        mss.getState (x, dx, ddx);
-        return std::vector<double>(x);
+      .def_property_readonly("positions", [](py::object self) {
+        auto & mss = self.cast<MassSpringSystem<3>&>();
+        return StateArray (self, mss.positions(), mss.numMasses());
+      }, "positions of the masses as writable (n,3) array without copy, rows in insertion order.\n"
+        "Adding masses invalidates the array.")
+      .def_property_readonly("velocities", [](py::object self) {
+        auto & mss = self.cast<MassSpringSystem<3>&>();
+        return StateArray (self, mss.velocities(), mss.numMasses());
+      })
+      .def_property_readonly("accelerations", [](py::object self) {
+        auto & mss = self.cast<MassSpringSystem<3>&>();
+        return StateArray (self, mss.accelerations(), mss.numMasses());
       })
 
-      .def("simulate", [](MassSpringSystem<3> & mss, double tend, size_t steps) {
-        Vector<> x(3*mss.masses().size());
-        Vector<> dx(3*mss.masses().size());
-        Vector<> ddx(3*mss.masses().size());
+      .def("getState", [] (const MassSpringSystem<3> & mss) {
+        py::array_t<double> x(3*mss.numMasses());
+        mss.getPositions (VectorView<double>(x.size(), x.mutable_data()));
+        return x;
+      }, "positions in the order of the state vector")
+
+      .def("save", [](const MassSpringSystem<3> & mss, std::string filename) {
+        SaveCheckpoint (filename, mss);
+      }, py::arg("filename"), "binary snapshot of the model and the state of the masses")
+      .def_static("load", [](std::string filename) {
+        auto mss = std::make_unique<MassSpringSystem<3>>();
+        LoadCheckpoint (filename, *mss);
+        return mss;
+      }, py::arg("filename"), "system from a snapshot of save or a checkpoint")
+
+      .def("simulate", [](MassSpringSystem<3> & mss, double tend, size_t steps,
+                          bool sparse, bool banded, std::string constraints,
+                          std::string checkpoint, size_t checkpointevery) {
+        Vector<> x(3*mss.numMasses());
+        Vector<> dx(3*mss.numMasses());
+        Vector<> ddx(3*mss.numMasses());
         mss.getState (x, dx, ddx);
 
         auto mss_func = std::make_shared<MSS_Function<3>> (mss);
-        auto mass = std::make_shared<IdentityFunction> (x.size());
+        auto mass = std::make_shared<IdentityMass> (x.size());
 
-        SolveODE_Alpha(tend, steps, 0.8, x, dx, ddx, mss_func, mass);
+        if (constraints != "projection" && constraints != "kkt" && constraints != "rattle")
+          throw std::invalid_argument("unknown constraint method '"+constraints+"'");
+        bool projection = constraints == "projection" || mss.constraints().empty();
+        mss_func->setConstraintProjection (projection);
 
-        mss.setState (x, dx, ddx);  
-    });
+        std::unique_ptr<AsyncCheckpointWriter> writer;
+        if (!checkpoint.empty() && checkpointevery > 0)
+          writer = std::make_unique<AsyncCheckpointWriter>();
+
+        if (constraints == "rattle" && !projection)
+          {
+            RattleStepper stepper(mss_func, std::make_shared<MSS_Constraints<3>>(mss));
+            stepper.setState (x, dx);
+            stepper.solve (tend, steps,
+                           CheckpointCallback(mss, stepper, writer.get(), checkpoint, checkpointevery));
+            if (writer) writer->wait();
+            ddx = 0.0;
+            mss.setState (stepper.position(), stepper.velocity(), ddx);
+            return;
+          }
+
+        GeneralizedAlphaStepper stepper(mss_func, mass, 0.8);
+        if (banded)
+          stepper.setBanded (true);
+        else
+          stepper.setSparse (sparse);
+        if (!projection)
+          stepper.setConstraints (std::make_shared<MSS_Constraints<3>>(mss));
+        stepper.setState (x, dx, ddx);
+        stepper.solve (tend, steps,
+                       CheckpointCallback(mss, stepper, writer.get(), checkpoint, checkpointevery));
+        if (writer) writer->wait();
+
+        mss.setState (stepper.position(), stepper.velocity(), stepper.acceleration());
+      }, py::arg("tend"), py::arg("steps"), py::arg("sparse")=false, py::arg("banded")=false,
+        py::arg("constraints")="projection", py::arg("checkpoint")="", py::arg("checkpoint_every")=0,
+        "constraints: 'projection' (sequential, per constraint), 'kkt' (implicit, joint multipliers) or 'rattle' (explicit).\n"
+        "With checkpoint, the system and stepper state are written to that file every checkpoint_every\n"
+        "steps, in a background thread.",
+        py::call_guard<py::gil_scoped_release>())
+
+      .def("simulateAdaptive", [](MassSpringSystem<3> & mss, double tend,
+                                  double rtol, double atol, double dt0) {
+        Vector<> x(3*mss.numMasses());
+        Vector<> dx(3*mss.numMasses());
+        Vector<> ddx(3*mss.numMasses());
+        mss.getState (x, dx, ddx);
+
+        auto mss_func = std::make_shared<MSS_Function<3>> (mss);
+        auto mass = std::make_shared<IdentityMass> (x.size());
+
+        GeneralizedAlphaStepper stepper(mss_func, mass, 0.8);
+        stepper.setState (x, dx, ddx);
+
+        AdaptiveOptions opts;
+        opts.rtol = rtol;
+        opts.atol = atol;
+        std::vector<StepInfo> history;
+        stepper.solveAdaptive (tend, dt0, opts, nullptr, &history);
+
+        mss.setState (stepper.position(), stepper.velocity(), stepper.acceleration());
 
+        // accepted steps as (t, dt)
+        std::vector<std::array<double,2>> steps;
+        for (auto & info : history)
+          if (info.accepted)
+            steps.push_back ( { info.t, info.dt } );
+        return steps;
+      }, py::arg("tend"), py::arg("rtol")=1e-6, py::arg("atol")=1e-8, py::arg("dt0")=1e-3)
+
+      .def("solveStatic", [](MassSpringSystem<3> & mss, double tol, int maxit, int loadsteps, bool sparse) {
+        StaticOptions opts;
+        opts.tol = tol;
+        opts.maxit = maxit;
+        opts.loadsteps = loadsteps;
+        opts.sparse = sparse;
+        StaticSolver<3> solver(mss, opts);
+        StaticInfo info;
+        {
+          py::gil_scoped_release release;
+          info = solver.solve();
+        }
+        py::dict d;
+        d["iterations"] = info.iterations;
+        d["loadsteps"] = info.loadsteps;
+        d["residual"] = info.residual;
+        d["multipliers"] = solver.multipliers();
+        return d;
+      }, py::arg("tol")=1e-10, py::arg("maxit")=50, py::arg("loadsteps")=1, py::arg("sparse")=true,
+        "static equilibrium under gravity, springs, contacts and distance constraints, by Newton\n"
+        "with line search and continuation in gravity. Writes the positions, zero velocities.\n"
+        "Throws if no equilibrium is found.")
+
+      .def("simulateMultirate", [](MassSpringSystem<3> & mss, double tend, size_t steps,
+                                   size_t substeps, std::optional<std::vector<size_t>> fastmasses,
+                                   double maxphase) {
+        Vector<> x(3*mss.numMasses());
+        Vector<> dx(3*mss.numMasses());
+        Vector<> ddx(3*mss.numMasses());
+        mss.getState (x, dx, ddx);
+
+        double dt = tend/steps;
+        auto fast = fastmasses ? MultirateStepper<3>::PartitionByMasses (mss, *fastmasses)
+                               : MultirateStepper<3>::PartitionByStiffness (mss, dt, maxphase);
+        if (substeps == 0)
+          substeps = MultirateStepper<3>::Substeps (mss, fast, dt, maxphase);
+
+        MultirateStepper<3> stepper(mss, fast, substeps);
+        stepper.setState (x, dx);
+        stepper.solve (tend, steps);
+        ddx = 0.0;
+        mss.setState (stepper.position(), stepper.velocity(), ddx);
+
+        std::map<std::string,size_t> info;
+        info["substeps"] = stepper.substeps();
+        info["fast_springs"] = std::count (fast.begin(), fast.end(), true);
+        info["fast_masses"] = stepper.numFastMasses();
+        info["slow_evaluations"] = stepper.numSlowEvaluations();
+        info["fast_evaluations"] = stepper.numFastEvaluations();
+        return info;
+      }, py::arg("tend"), py::arg("steps"), py::arg("substeps")=0, py::arg("fast_masses")=py::none(),
+        py::arg("maxphase")=0.5,
+        "multirate (impulse) integration: the springs at fast_masses, or by default the stiff springs\n"
+        "with omega*dt > maxphase and their neighbours, are subcycled with dt/substeps,\n"
+        "the others evaluated once per step. substeps=0 chooses them from the stiffness.",
+        py::call_guard<py::gil_scoped_release>())
+      ;
 
   
     
+
+    py::class_<Simulator<3>> (m, "Simulator",
+                              "persistent generalized-alpha simulation of a system, keeps the stepper state.\n"
+                              "start/stop run it in a background thread, latestFrame polls the positions.")
+      .def(py::init([](MassSpringSystem<3> & mss, double rhoinf, size_t ringsize, bool sparse, bool banded) {
+        auto sim = std::make_unique<Simulator<3>>(mss, rhoinf, ringsize);
+        if (banded)
+          sim->stepper().setBanded (true);
+        else
+          sim->stepper().setSparse (sparse);
+        return sim;
+      }), py::arg("mss"), py::arg("rhoinf")=0.8, py::arg("ringsize")=4,
+        py::arg("sparse")=false, py::arg("banded")=false, py::keep_alive<1,2>())
+      .def_property_readonly("time", &Simulator<3>::time)
+      .def_property_readonly("running", &Simulator<3>::running)
+      .def("advance", &Simulator<3>::advance, py::arg("dt"), py::arg("steps"),
+           py::call_guard<py::gil_scoped_release>(),
+           "integrate over dt with the given number of steps, and write the state to the system")
+      .def("start", &Simulator<3>::start, py::arg("dt"), py::arg("steps"),
+           py::arg("tend")=std::numeric_limits<double>::max(),
+           "integrate in a background thread in chunks of steps over dt, until stop or time >= tend.\n"
+           "The system must not be changed while running.")
+      .def("setDiagnostics", &Simulator<3>::setDiagnostics, py::arg("every")=1,
+           "record energies and momentum every 'every' steps, computed in the force loops; 0 switches off")
+      .def("diagnostics", [](const Simulator<3> & sim) {
+        auto diag = sim.diagnostics();
+        size_t n = diag.size();
+        py::array_t<double> t(n), kinetic(n), spring(n), contact(n), gravity(n), total(n);
+        py::array_t<double> momentum(std::vector<size_t>{ n, 3 });
+        auto mom = momentum.mutable_unchecked<2>();
+        for (size_t k = 0; k < n; k++)
+          {
+            auto & d = diag.series()[k];
+            t.mutable_at(k) = d.t;
+            kinetic.mutable_at(k) = d.kinetic;
+            spring.mutable_at(k) = d.spring;
+            contact.mutable_at(k) = d.contact;
+            gravity.mutable_at(k) = d.gravity;
+            total.mutable_at(k) = d.total();
+            for (int a = 0; a < 3; a++)
+              mom(k, a) = d.momentum[a];
+          }
+        py::dict res;
+        res["t"] = t;
+        res["kinetic"] = kinetic;
+        res["spring"] = spring;
+        res["contact"] = contact;
+        res["gravity"] = gravity;
+        res["total"] = total;
+        res["momentum"] = momentum;
+        res["drift"] = diag.drift();
+        res["maxdrift"] = diag.maxDrift();
+        return res;
+      }, "time series of the energies and momentum, and the relative drift of the total energy")
+      .def("checkpoint", &Simulator<3>::checkpoint, py::arg("filename"),
+           py::call_guard<py::gil_scoped_release>(), "save the system with the stepper state")
+      .def("restore", &Simulator<3>::restore, py::arg("filename"),
+           py::call_guard<py::gil_scoped_release>(),
+           "continue from the stepper state of a checkpoint of the same model")
+      .def("stop", &Simulator<3>::stop, py::call_guard<py::gil_scoped_release>(),
+           "stop the background thread and write the state to the system")
+      .def("latestFrame", [](const Simulator<3> & sim) -> py::object {
+        auto & frames = sim.frames();
+        py::array_t<double> frame(std::vector<size_t>{ frames.frameSize()/3, 3 });
+        double * data = frame.mutable_data();
+        double t;
+        size_t nr;
+        {
+          py::gil_scoped_release release;
+          nr = frames.latest (t, data);
+        }
+        if (nr == 0) return py::none();
+        return py::make_tuple(t, nr, frame);
+      }, "(time, frame number, (n,3) positions) of the newest frame, or None")
+      ;
+
+
+    py::class_<ModalModel> (m, "ModalReduction",
+                            "linear model of the k lowest modes around the current state of the system,\n"
+                            "solved exactly in time, starting from the state at construction or setInitial")
+      .def(py::init([](MassSpringSystem<3> & mss, size_t k, double shift) {
+        Vector<> x(3*mss.numMasses()), v(3*mss.numMasses()), a(3*mss.numMasses());
+        mss.getState (x, v, a);
+        MSS_Function<3> func(mss);
+        auto model = std::make_unique<ModalModel>(mss, func, x, k, shift);
+        model->reduction.setInitial (x, v);
+        return model;
+      }), py::arg("mss"), py::arg("k"), py::arg("shift")=0.0, py::keep_alive<1,2>(),
+        py::call_guard<py::gil_scoped_release>(),
+        "shift must lie below the spectrum (ValueError otherwise), 0 chooses one slightly below zero, for stable equilibria")
+      .def_property_readonly("eigenvalues", [](const ModalModel & model) { return model.reduction.eigenvalues(); },
+                             "omega^2 of the modes")
+      .def_property_readonly("lanczosSteps", [](const ModalModel & model) { return model.reduction.lanczosSteps(); })
+      .def_property_readonly("error", [](const ModalModel & model) {
+        auto & err = model.reduction.error();
+        py::dict d;
+        d["displacement"] = err.displacement;
+        d["velocity"] = err.velocity;
+        d["load"] = err.load;
+        d["cutoff"] = err.cutoff;
+        d["residual"] = err.residual;
+        return d;
+      }, "relative parts of the initial state and the load outside the modes, omega^2 of the first\n"
+         "dropped mode, and the largest eigenpair residual")
+      .def("setInitial", [](ModalModel & model) {
+        auto & mss = model.mss;
+        Vector<> x(3*mss.numMasses()), v(3*mss.numMasses()), a(3*mss.numMasses());
+        mss.getState (x, v, a);
+        model.reduction.setInitial (x, v);
+      }, "start from the current state of the system")
+      .def("positions", [](const ModalModel & model, double t) {
+        auto & mss = model.mss;
+        size_t nm = mss.numMasses();
+        Vector<> x(3*nm), v(3*nm);
+        model.state (t, x, v);
+        py::array_t<double> pos(std::vector<size_t>{ nm, 3 });
+        auto p = pos.mutable_unchecked<2>();
+        for (size_t i = 0; i < nm; i++)
+          for (int a = 0; a < 3; a++)
+            p(i,a) = x(3*mss.massIndex(i)+a);
+        return pos;
+      }, py::arg("t"), "(n,3) positions at time t")
+      .def("apply", [](ModalModel & model, double t) {
+        size_t n = 3*model.mss.numMasses();
+        Vector<> x(n), v(n), a(n);
+        model.state (t, x, v);
+        a = 0.0;
+        model.mss.setState (x, v, a);
+      }, py::arg("t"), "write positions and velocities at time t to the system")
+      ;
 }
@@ -0,0 +1,554 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+// Binary snapshots of a MassSpringSystem and the state of its stepper.
+//
+// File layout (native endianness, all entries 8 bytes):
+//   CheckpointHeader
+//   gravity[D]
+//   fixes:        pos[nfixes*D]
+//   masses:       mass[nmasses], pos, vel, acc [nmasses*D], massindex[nmasses]
+//   springs:      length[nsprings], stiffness[nsprings], connectors[nsprings*4]
+//   constraints:  length[nconstraints], connectors[nconstraints*4]
+//   contact:      radius, stiffness, planes[nplanes*(D+1)]
+//   stepper:      t, dt, x, v, a [nstate], lambda[nlambda]
+// Connectors are stored as (type, nr) pairs. The steppers are one-step
+// methods, x, v, a (and the multipliers) are their complete history.
+//
+// Loading maps the file (mmap on POSIX) and copies the arrays, there is
+// no parsing. The format version is checked, old versions are rejected.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <io.h>
+#include <windows.h>
+#endif
+
+#include "mass_spring.hpp"
+#include "Newmark.hpp"
+
+
+struct CheckpointHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t dim;
+  uint64_t nfixes, nmasses, nsprings, nconstraints, nplanes;
+  uint64_t nstate, nlambda;     // 0 without stepper state
+
+  static constexpr char MAGIC[8] = { 'M', 'S', 'S', 'C', 'K', 'P', 'T', 0 };
+  static constexpr uint32_t VERSION = 1;
+};
+
+
+// integrator state, as stored in a checkpoint
+struct StepperState
+{
+  double t = 0;
+  double dt = 0;
+  std::vector<double> x, v, a, lambda;
+};
+
+inline StepperState GetStepperState (SecondOrderStepper & stepper)
+{
+  StepperState state;
+  state.t = stepper.time();
+  state.dt = stepper.stepSize();
+  auto x = stepper.position(), v = stepper.velocity(), a = stepper.acceleration();
+  for (size_t i = 0; i < x.size(); i++)
+    {
+      state.x.push_back(x(i));
+      state.v.push_back(v(i));
+      state.a.push_back(a(i));
+    }
+  if (stepper.hasConstraints())
+    {
+      auto lam = stepper.lagrangeMultipliers();
+      for (size_t i = 0; i < lam.size(); i++)
+        state.lambda.push_back(lam(i));
+    }
+  return state;
+}
+
+inline void SetStepperState (SecondOrderStepper & stepper, const StepperState & state)
+{
+  size_t n = state.x.size();
+  if (n != stepper.position().size())
+    throw std::invalid_argument("SetStepperState: state has wrong size");
+  Vector<> x(n), v(n), a(n);
+  for (size_t i = 0; i < n; i++)
+    {
+      x(i) = state.x[i];
+      v(i) = state.v[i];
+      a(i) = state.a[i];
+    }
+  stepper.setState (x, v, a);
+  stepper.setTime (state.t);
+  stepper.setStepSize (state.dt);
+  if (stepper.hasConstraints() && state.lambda.size())
+    {
+      auto lam = stepper.lagrangeMultipliers();
+      if (lam.size() != state.lambda.size())
+        throw std::invalid_argument("SetStepperState: wrong number of multipliers");
+      for (size_t i = 0; i < lam.size(); i++)
+        lam(i) = state.lambda[i];
+    }
+}
+
+inline StepperState GetStepperState (RattleStepper & stepper)
+{
+  StepperState state;
+  state.t = stepper.time();
+  auto x = stepper.position(), v = stepper.velocity(), lam = stepper.lagrangeMultipliers();
+  for (size_t i = 0; i < x.size(); i++)
+    {
+      state.x.push_back(x(i));
+      state.v.push_back(v(i));
+    }
+  state.a.assign(x.size(), 0.0);
+  for (size_t i = 0; i < lam.size(); i++)
+    state.lambda.push_back(lam(i));
+  return state;
+}
+
+inline void SetStepperState (RattleStepper & stepper, const StepperState & state)
+{
+  size_t n = state.x.size();
+  if (n != stepper.position().size() || state.lambda.size() != stepper.lagrangeMultipliers().size())
+    throw std::invalid_argument("SetStepperState: state has wrong size");
+  Vector<> x(n), v(n);
+  for (size_t i = 0; i < n; i++)
+    {
+      x(i) = state.x[i];
+      v(i) = state.v[i];
+    }
+  stepper.setState (x, v);
+  stepper.setTime (state.t);
+  auto lam = stepper.lagrangeMultipliers();
+  for (size_t i = 0; i < lam.size(); i++)
+    lam(i) = state.lambda[i];
+}
+
+
+
+// snapshot into a memory buffer, e.g. to be written by AsyncCheckpointWriter
+template <int D>
+std::vector<char> SerializeCheckpoint (const MassSpringSystem<D> & mss,
+                                       const StepperState * state = nullptr)
+{
+  CheckpointHeader header;
+  std::memcpy (header.magic, CheckpointHeader::MAGIC, 8);
+  header.version = CheckpointHeader::VERSION;
+  header.dim = D;
+  header.nfixes = mss.fixes().size();
+  header.nmasses = mss.numMasses();
+  header.nsprings = mss.springs().size();
+  header.nconstraints = mss.constraints().size();
+  header.nplanes = mss.contact().planes.size();
+  header.nstate = state ? state->x.size() : 0;
+  header.nlambda = state ? state->lambda.size() : 0;
+
+  size_t nm = header.nmasses;
+  size_t size = sizeof(header) + 8 * (D + D*header.nfixes + nm*(2+3*D)
+                                      + 6*header.nsprings + 5*header.nconstraints
+                                      + 2 + (D+1)*header.nplanes
+                                      + 2 + 3*header.nstate + header.nlambda);
+  std::vector<char> buf;
+  buf.reserve(size);
+  auto put = [&buf](const void * data, size_t bytes)
+  {
+    auto p = static_cast<const char*>(data);
+    buf.insert(buf.end(), p, p+bytes);
+  };
+  auto putd = [&put](double val) { put(&val, 8); };
+  auto putu = [&put](uint64_t val) { put(&val, 8); };
+  auto putcon = [&putu](Connector c) { putu(c.type); putu(c.nr); };
+
+  put (&header, sizeof(header));
+  for (int a = 0; a < D; a++)
+    putd (mss.getGravity()(a));
+
+  for (auto & f : mss.fixes())
+    for (int a = 0; a < D; a++)
+      putd (f.pos(a));
+
+  for (size_t i = 0; i < nm; i++)
+    putd (mss.massValue(i));
+  put (mss.positions(), 8*D*nm);
+  put (mss.velocities(), 8*D*nm);
+  put (mss.accelerations(), 8*D*nm);
+  for (size_t i = 0; i < nm; i++)
+    putu (mss.massIndex(i));
+
+  for (auto & sp : mss.springs()) putd (sp.length);
+  for (auto & sp : mss.springs()) putd (sp.stiffness);
+  for (auto & sp : mss.springs())
+    {
+      putcon (sp.connectors[0]);
+      putcon (sp.connectors[1]);
+    }
+
+  for (auto & con : mss.constraints()) putd (con.length);
+  for (auto & con : mss.constraints())
+    {
+      putcon (con.connectors[0]);
+      putcon (con.connectors[1]);
+    }
+
+  putd (mss.contact().radius);
+  putd (mss.contact().stiffness);
+  for (auto & plane : mss.contact().planes)
+    {
+      put (plane.normal, 8*D);
+      putd (plane.offset);
+    }
+
+  putd (state ? state->t : 0.0);
+  putd (state ? state->dt : 0.0);
+  if (state)
+    {
+      put (state->x.data(), 8*header.nstate);
+      put (state->v.data(), 8*header.nstate);
+      put (state->a.data(), 8*header.nstate);
+      put (state->lambda.data(), 8*header.nlambda);
+    }
+  return buf;
+}
+
+
+// restore mss (which must be empty) from a snapshot in memory,
+// and the stepper state, if wanted and stored
+template <int D>
+void DeserializeCheckpoint (const char * data, size_t size,
+                            MassSpringSystem<D> & mss, StepperState * state = nullptr)
+{
+  if (mss.numMasses() || mss.fixes().size() || mss.springs().size())
+    throw std::invalid_argument("checkpoint: system is not empty");
+
+  const char * pos = data;
+  const char * end = data + size;
+  auto take = [&](size_t bytes)
+  {
+    if (size_t(end-pos) < bytes)
+      throw std::runtime_error("checkpoint: file truncated");
+    const char * p = pos;
+    pos += bytes;
+    return p;
+  };
+  auto getd = [&]() { double val; std::memcpy(&val, take(8), 8); return val; };
+  auto getu = [&]() { uint64_t val; std::memcpy(&val, take(8), 8); return val; };
+  auto getcon = [&]()
+  {
+    Connector c;
+    c.type = Connector::CONTYPE(getu());
+    c.nr = getu();
+    return c;
+  };
+
+  CheckpointHeader header;
+  std::memcpy (&header, take(sizeof(header)), sizeof(header));
+  if (std::memcmp(header.magic, CheckpointHeader::MAGIC, 8) != 0)
+    throw std::runtime_error("checkpoint: not a mass-spring checkpoint");
+  if (header.version != CheckpointHeader::VERSION)
+    throw std::runtime_error("checkpoint: unsupported version "+std::to_string(header.version));
+  if (header.dim != D)
+    throw std::runtime_error("checkpoint: wrong dimension");
+
+  Vec<D> gravity;
+  for (int a = 0; a < D; a++)
+    gravity(a) = getd();
+  mss.setGravity (gravity);
+
+  size_t nm = header.nmasses;
+  mss.reserve (nm, header.nfixes, header.nsprings);
+  // the buffer need not be aligned, copy the arrays
+  std::vector<double> fixpos(D*header.nfixes);
+  std::memcpy (fixpos.data(), take(8*fixpos.size()), 8*fixpos.size());
+  if (header.nfixes)
+    mss.addFixes (header.nfixes, fixpos.data());
+
+  std::vector<double> masses(nm), tmp(D*nm);
+  std::memcpy (masses.data(), take(8*nm), 8*nm);
+  std::memcpy (tmp.data(), take(8*D*nm), 8*D*nm);
+  if (nm)
+    mss.addMasses (nm, tmp.data(), masses.data());
+  for (double * dst : { mss.velocities(), mss.accelerations() })
+    {
+      const char * src = take(8*D*nm);
+      if (nm) std::memcpy (dst, src, 8*D*nm);
+    }
+
+  std::vector<size_t> massindex(nm);
+  bool identity = true;
+  for (size_t i = 0; i < nm; i++)
+    {
+      massindex[i] = getu();
+      identity = identity && massindex[i] == i;
+    }
+  if (!identity)
+    mss.setMassNumbering (massindex);
+
+  size_t ns = header.nsprings;
+  std::vector<double> lengths(ns), stiffness(ns);
+  for (auto & l : lengths) l = getd();
+  for (auto & k : stiffness) k = getd();
+  for (size_t s = 0; s < ns; s++)
+    {
+      Connector c1 = getcon(), c2 = getcon();
+      mss.addSpring ( { lengths[s], stiffness[s], { c1, c2 } } );
+    }
+
+  size_t nc = header.nconstraints;
+  std::vector<double> clengths(nc);
+  for (auto & l : clengths) l = getd();
+  for (size_t c = 0; c < nc; c++)
+    {
+      Connector c1 = getcon(), c2 = getcon();
+      mss.addDistanceConstraint (c1, c2, clengths[c]);
+    }
+
+  ContactModel<D> contact;
+  contact.radius = getd();
+  contact.stiffness = getd();
+  contact.planes.resize(header.nplanes);
+  for (auto & plane : contact.planes)
+    {
+      for (int a = 0; a < D; a++)
+        plane.normal[a] = getd();
+      plane.offset = getd();
+    }
+  mss.setContactModel (contact);
+
+  double t = getd();
+  double dt = getd();
+  if (state && header.nstate)
+    {
+      state->t = t;
+      state->dt = dt;
+      for (auto * vec : { &state->x, &state->v, &state->a })
+        {
+          vec->resize(header.nstate);
+          std::memcpy (vec->data(), take(8*header.nstate), 8*header.nstate);
+        }
+      state->lambda.resize(header.nlambda);
+      std::memcpy (state->lambda.data(), take(8*header.nlambda), 8*header.nlambda);
+    }
+}
+
+
+// write buffer to filename, through a temporary file, such that an existing
+// checkpoint is replaced only by a complete one. The temporary file is
+// flushed to disk before it replaces the checkpoint.
+inline void WriteCheckpointFile (const std::string & filename, const std::vector<char> & buf)
+{
+  std::string tmpname = filename + ".tmp";
+  std::FILE * out = std::fopen (tmpname.c_str(), "wb");
+  if (!out)
+    throw std::runtime_error("checkpoint: cannot open '"+tmpname+"'");
+  bool ok = std::fwrite (buf.data(), 1, buf.size(), out) == buf.size()
+    && std::fflush (out) == 0;
+#ifndef _WIN32
+  ok = ok && ::fsync (fileno(out)) == 0;
+#else
+  ok = ok && ::_commit (_fileno(out)) == 0;
+#endif
+  ok = (std::fclose (out) == 0) && ok;
+  if (!ok)
+    {
+      std::remove (tmpname.c_str());
+      throw std::runtime_error("checkpoint: cannot write '"+tmpname+"'");
+    }
+
+  // replaces an existing checkpoint atomically
+#ifndef _WIN32
+  if (std::rename (tmpname.c_str(), filename.c_str()) != 0)
+#else
+  if (!MoveFileExA (tmpname.c_str(), filename.c_str(),
+                    MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+#endif
+    throw std::runtime_error("checkpoint: cannot rename to '"+filename+"'");
+}
+
+template <int D>
+void SaveCheckpoint (const std::string & filename, const MassSpringSystem<D> & mss,
+                     const StepperState * state = nullptr)
+{
+  WriteCheckpointFile (filename, SerializeCheckpoint(mss, state));
+}
+
+
+// read-only view of a file, mapped where possible
+class MappedFile
+{
+  const char * m_data = nullptr;
+  size_t m_size = 0;
+  std::vector<char> m_buffer;   // fallback without mmap
+public:
+  MappedFile (const std::string & filename)
+  {
+#ifndef _WIN32
+    int fd = ::open (filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("cannot open '"+filename+"'");
+    struct stat st;
+    if (::fstat (fd, &st) != 0)
+      {
+        ::close (fd);
+        throw std::runtime_error("cannot stat '"+filename+"'");
+      }
+    m_size = st.st_size;
+    if (m_size)
+      {
+        void * p = ::mmap (nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close (fd);
+        if (p == MAP_FAILED)
+          throw std::runtime_error("cannot map '"+filename+"'");
+        m_data = static_cast<const char*>(p);
+      }
+    else
+      ::close (fd);
+#else
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in)
+      throw std::runtime_error("cannot open '"+filename+"'");
+    m_size = in.tellg();
+    m_buffer.resize(m_size);
+    in.seekg(0);
+    in.read (m_buffer.data(), m_size);
+    m_data = m_buffer.data();
+#endif
+  }
+
+  ~MappedFile ()
+  {
+#ifndef _WIN32
+    if (m_data)
+      ::munmap (const_cast<char*>(m_data), m_size);
+#endif
+  }
+
+  MappedFile (const MappedFile &) = delete;
+  MappedFile & operator= (const MappedFile &) = delete;
+
+  const char * data() const { return m_data; }
+  size_t size() const { return m_size; }
+};
+
+template <int D>
+void LoadCheckpoint (const std::string & filename, MassSpringSystem<D> & mss,
+                     StepperState * state = nullptr)
+{
+  MappedFile file(filename);
+  DeserializeCheckpoint (file.data(), file.size(), mss, state);
+}
+
+
+
+// Writes checkpoints in a background thread, so the simulation only pays
+// for the snapshot in memory. Holds at most one pending snapshot, a new
+// one replaces a pending one which has not been started yet.
+class AsyncCheckpointWriter
+{
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::string m_filename;
+  std::vector<char> m_pending;
+  bool m_haspending = false;
+  bool m_busy = false;
+  bool m_quit = false;
+  std::string m_error;
+  size_t m_written = 0;
+
+  void run ()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+      {
+        m_cv.wait (lock, [this] { return m_haspending || m_quit; });
+        if (!m_haspending) return;
+        std::vector<char> buf = std::move(m_pending);
+        std::string filename = m_filename;
+        m_haspending = false;
+        m_busy = true;
+        lock.unlock();
+        std::string error;
+        try
+          {
+            WriteCheckpointFile (filename, buf);
+          }
+        catch (std::exception & e)
+          {
+            error = e.what();
+          }
+        lock.lock();
+        m_busy = false;
+        if (error.empty()) m_written++;
+        else m_error = error;
+        m_cv.notify_all();
+      }
+  }
+
+public:
+  AsyncCheckpointWriter () : m_thread([this] { run(); }) { }
+
+  ~AsyncCheckpointWriter ()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+  }
+
+  void write (const std::string & filename, std::vector<char> && buf)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_filename = filename;
+      m_pending = std::move(buf);
+      m_haspending = true;
+    }
+    m_cv.notify_all();
+  }
+
+  // wait until all snapshots are on disk, throws if writing one failed
+  void wait ()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait (lock, [this] { return !m_haspending && !m_busy; });
+    if (!m_error.empty())
+      {
+        std::string error = m_error;
+        m_error.clear();
+        throw std::runtime_error(error);
+      }
+  }
+
+  size_t numWritten ()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+  }
+};
+
+#endif
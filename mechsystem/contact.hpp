@@ -0,0 +1,166 @@
+#ifndef CONTACT_HPP
+#define CONTACT_HPP
+
+#include <vector>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+
+// Uniform hash grid for the broad phase of contact detection.
+// Points are kept in buckets of a hash table over integer cell coordinates.
+// update() moves only the points which changed their cell, so between time
+// steps or Newton iterations the cost is O(n) key computations plus O(moved).
+// Pairs closer than the cell size are found in the 3^D neighbour cells.
+template <int D>
+class SpatialHashGrid
+{
+  double m_cellsize = 1;
+  std::vector<std::vector<size_t>> m_buckets;
+  std::vector<std::array<int64_t,D>> m_cell;   // cell of every point
+  std::vector<size_t> m_bucket;                // bucket of every point
+  std::vector<size_t> m_slot;                  // position in the bucket
+
+  size_t hash (const std::array<int64_t,D> & cell) const
+  {
+    static constexpr uint64_t primes[3] = { 73856093, 19349663, 83492791 };
+    uint64_t h = 0;
+    for (int a = 0; a < D; a++)
+      h ^= uint64_t(cell[a]) * primes[a%3];
+    return h & (m_buckets.size()-1);
+  }
+
+  std::array<int64_t,D> cellOf (const double * p) const
+  {
+    std::array<int64_t,D> cell;
+    for (int a = 0; a < D; a++)
+      cell[a] = int64_t(std::floor(p[a] / m_cellsize));
+    return cell;
+  }
+
+  void insert (size_t i, size_t b)
+  {
+    m_bucket[i] = b;
+    m_slot[i] = m_buckets[b].size();
+    m_buckets[b].push_back(i);
+  }
+
+  void remove (size_t i)
+  {
+    auto & bucket = m_buckets[m_bucket[i]];
+    size_t last = bucket.back();
+    bucket[m_slot[i]] = last;
+    m_slot[last] = m_slot[i];
+    bucket.pop_back();
+  }
+
+  // func(j) for all points j in the cell, no hash collisions
+  template <typename FUNC>
+  void loopCell (const std::array<int64_t,D> & cell, FUNC func) const
+  {
+    for (size_t j : m_buckets[hash(cell)])
+      if (m_cell[j] == cell)
+        func(j);
+  }
+
+public:
+  double cellSize() const { return m_cellsize; }
+  size_t size() const { return m_cell.size(); }
+
+  // a changed cell size or number of points rebuilds the grid
+  // in the next update
+  void setCellSize (double cellsize)
+  {
+    if (cellsize == m_cellsize) return;
+    m_cellsize = cellsize;
+    m_cell.clear();
+  }
+
+  // x: n points as contiguous n x D array, returns the number of moved points
+  size_t update (const double * x, size_t n)
+  {
+    if (n != m_cell.size())
+      {
+        size_t nbuckets = 16;
+        while (nbuckets < 2*n) nbuckets *= 2;
+        m_buckets.assign(nbuckets, {});
+        m_cell.resize(n);
+        m_bucket.resize(n);
+        m_slot.resize(n);
+        for (size_t i = 0; i < n; i++)
+          {
+            m_cell[i] = cellOf(x+D*i);
+            insert(i, hash(m_cell[i]));
+          }
+        return n;
+      }
+
+    size_t moved = 0;
+    for (size_t i = 0; i < n; i++)
+      {
+        auto cell = cellOf(x+D*i);
+        if (cell == m_cell[i]) continue;
+        remove(i);
+        m_cell[i] = cell;
+        insert(i, hash(cell));
+        moved++;
+      }
+    return moved;
+  }
+
+  // all pairs i < j with |xi-xj| < dist, for dist <= cellSize(), sorted
+  void findPairs (const double * x, double dist,
+                  std::vector<std::array<size_t,2>> & pairs) const
+  {
+    pairs.clear();
+    double dist2 = dist*dist;
+    int noffsets = 1;
+    for (int a = 0; a < D; a++) noffsets *= 3;
+
+    // half stencil: offset k and noffsets-1-k are opposite, so every
+    // pair of cells is visited once, pairs within a cell with i < j
+    int center = noffsets/2;
+    for (size_t i = 0; i < m_cell.size(); i++)
+      for (int off = center; off < noffsets; off++)
+        {
+          auto cell = m_cell[i];
+          for (int a = 0, rest = off; a < D; a++, rest /= 3)
+            cell[a] += rest%3 - 1;
+          loopCell (cell, [&](size_t j)
+            {
+              if (off == center && j <= i) return;
+              double d2 = 0;
+              for (int a = 0; a < D; a++)
+                d2 += (x[D*j+a]-x[D*i+a]) * (x[D*j+a]-x[D*i+a]);
+              if (d2 < dist2)
+                pairs.push_back ( { std::min(i,j), std::max(i,j) } );
+            });
+        }
+    std::sort (pairs.begin(), pairs.end());
+  }
+};
+
+
+// half space  n.x >= offset  with unit normal n, masses are pushed out of it
+template <int D>
+struct ContactPlane
+{
+  double normal[D];
+  double offset;
+};
+
+// Penalty contact model: masses are balls of the contact radius, overlapping
+// balls and balls penetrating a plane are pushed apart by linear springs
+// of the contact stiffness which act in compression only.
+template <int D>
+struct ContactModel
+{
+  double radius = 0;
+  double stiffness = 0;
+  std::vector<ContactPlane<D>> planes;
+
+  bool active() const { return stiffness > 0; }
+};
+
+#endif
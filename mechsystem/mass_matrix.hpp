@@ -0,0 +1,215 @@
+#ifndef MASS_MATRIX_HPP
+#define MASS_MATRIX_HPP
+
+#include <memory>
+
+#include <nonlinfunc.hpp>
+#include <inverse.hpp>
+#include <sparsematrix.hpp>
+#include <bandmatrix.hpp>
+
+using namespace ASC_ode;
+
+
+// Linear mass operator M for the second order solvers  M d^2x/dt^2 = rhs(x).
+// Implementations know how to multiply, solve, and how to add themselves
+// into the Newton iteration matrix, so no generic composition is needed.
+class MassOperator
+{
+public:
+  virtual ~MassOperator() = default;
+  virtual size_t size() const = 0;
+  // y = M x
+  virtual void mult (VectorView<double> x, VectorView<double> y) const = 0;
+  // solve M x = b
+  virtual void solve (VectorView<double> b, VectorView<double> x) const = 0;
+  // mat += fac M
+  virtual void addTo (MatrixView<double> mat, double fac) const = 0;
+  // mat += fac M, the pattern of mat must contain the one from getPattern
+  virtual void addTo (SparseMatrix & mat, double fac) const = 0;
+  // append the nonzero entries of M
+  virtual void getPattern (std::vector<std::array<size_t,2>> & entries) const
+  {
+    for (size_t i = 0; i < size(); i++)
+      entries.push_back ( { i, i } );
+  }
+};
+
+
+class IdentityMass : public MassOperator
+{
+  size_t m_n;
+public:
+  IdentityMass (size_t n) : m_n(n) { }
+  size_t size() const override { return m_n; }
+  void mult (VectorView<double> x, VectorView<double> y) const override { y = x; }
+  void solve (VectorView<double> b, VectorView<double> x) const override { x = b; }
+  void addTo (MatrixView<double> mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_n; i++)
+      mat(i,i) += fac;
+  }
+  void addTo (SparseMatrix & mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_n; i++)
+      mat(i,i) += fac;
+  }
+};
+
+
+// lumped mass matrix
+class DiagonalMass : public MassOperator
+{
+  Vector<> m_diag;
+public:
+  DiagonalMass (VectorView<double> diag) : m_diag(diag) { }
+  size_t size() const override { return m_diag.size(); }
+  VectorView<double> diag() { return m_diag; }
+
+  void mult (VectorView<double> x, VectorView<double> y) const override
+  {
+    for (size_t i = 0; i < m_diag.size(); i++)
+      y(i) = m_diag(i) * x(i);
+  }
+  void solve (VectorView<double> b, VectorView<double> x) const override
+  {
+    for (size_t i = 0; i < m_diag.size(); i++)
+      x(i) = b(i) / m_diag(i);
+  }
+  void addTo (MatrixView<double> mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_diag.size(); i++)
+      mat(i,i) += fac * m_diag(i);
+  }
+  void addTo (SparseMatrix & mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_diag.size(); i++)
+      mat(i,i) += fac * m_diag(i);
+  }
+};
+
+
+// symmetric positive definite band matrix, Cholesky factors are computed once
+class BandedMass : public MassOperator
+{
+  BandMatrix m_mat;
+  BandMatrix m_factor;
+public:
+  BandedMass (const BandMatrix & mat)
+    : m_mat(mat), m_factor(mat)
+  {
+    m_factor.factorCholesky();
+  }
+  size_t size() const override { return m_mat.size(); }
+
+  void mult (VectorView<double> x, VectorView<double> y) const override { m_mat.mult(x, y); }
+  void solve (VectorView<double> b, VectorView<double> x) const override
+  {
+    x = b;
+    m_factor.solveCholesky(x);
+  }
+  void addTo (MatrixView<double> mat, double fac) const override { m_mat.addTo(mat, fac); }
+  void addTo (SparseMatrix & mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_mat.size(); i++)
+      for (size_t j = m_mat.firstCol(i); j < m_mat.nextCol(i); j++)
+        if (m_mat(i,j) != 0)
+          mat(i,j) += fac * m_mat(i,j);
+  }
+  void getPattern (std::vector<std::array<size_t,2>> & entries) const override
+  {
+    for (size_t i = 0; i < m_mat.size(); i++)
+      for (size_t j = m_mat.firstCol(i); j < m_mat.nextCol(i); j++)
+        if (m_mat(i,j) != 0)
+          entries.push_back ( { i, j } );
+  }
+};
+
+
+// sparse symmetric positive definite mass matrix, solves with preconditioned CG
+class SparseMass : public MassOperator
+{
+  SparseMatrix m_mat;
+  mutable SparseCGSolver m_solver;
+public:
+  SparseMass (const SparseMatrix & mat)
+    : m_mat(mat), m_solver(mat.height())
+  {
+    m_solver.setMatrix(m_mat);
+  }
+  size_t size() const override { return m_mat.height(); }
+  const SparseMatrix & matrix() const { return m_mat; }
+
+  void mult (VectorView<double> x, VectorView<double> y) const override { m_mat.mult(x, y); }
+  void solve (VectorView<double> b, VectorView<double> x) const override
+  {
+    x = 0.0;
+    m_solver.solve(m_mat, b, x);
+  }
+  void addTo (MatrixView<double> mat, double fac) const override { m_mat.addTo(mat, fac); }
+  void addTo (SparseMatrix & mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_mat.height(); i++)
+      for (size_t k = m_mat.firstInRow(i); k < m_mat.nextInRow(i); k++)
+        mat(i, m_mat.colNr(k)) += fac * m_mat.val(k);
+  }
+  void getPattern (std::vector<std::array<size_t,2>> & entries) const override
+  {
+    auto ent = m_mat.entries();
+    entries.insert(entries.end(), ent.begin(), ent.end());
+  }
+};
+
+
+// general dense mass matrix, e.g. the Jacobian of a linear NonlinearFunction
+class DenseMass : public MassOperator
+{
+  Matrix<> m_mat;
+  Matrix<> m_inv;
+public:
+  DenseMass (const Matrix<> & mat)
+    : m_mat(mat), m_inv(mat)
+  {
+    calcInverse(m_inv);
+  }
+  size_t size() const override { return m_mat.rows(); }
+
+  void mult (VectorView<double> x, VectorView<double> y) const override { y = m_mat*x; }
+  void solve (VectorView<double> b, VectorView<double> x) const override { x = m_inv*b; }
+  void addTo (MatrixView<double> mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_mat.rows(); i++)
+      for (size_t j = 0; j < m_mat.cols(); j++)
+        mat(i,j) += fac * m_mat(i,j);
+  }
+  void addTo (SparseMatrix & mat, double fac) const override
+  {
+    for (size_t i = 0; i < m_mat.rows(); i++)
+      for (size_t j = 0; j < m_mat.cols(); j++)
+        if (m_mat(i,j) != 0)
+          mat(i,j) += fac * m_mat(i,j);
+  }
+  void getPattern (std::vector<std::array<size_t,2>> & entries) const override
+  {
+    for (size_t i = 0; i < m_mat.rows(); i++)
+      for (size_t j = 0; j < m_mat.cols(); j++)
+        if (m_mat(i,j) != 0)
+          entries.push_back ( { i, j } );
+  }
+};
+
+
+// mass operator for a mass given as (linear) NonlinearFunction
+inline std::shared_ptr<MassOperator> MakeMassOperator (std::shared_ptr<NonlinearFunction> mass)
+{
+  if (std::dynamic_pointer_cast<IdentityFunction>(mass))
+    return std::make_shared<IdentityMass>(mass->dimX());
+
+  Vector<> zero(mass->dimX());
+  zero = 0.0;
+  Matrix<> mat(mass->dimF(), mass->dimX());
+  mass->evaluateDeriv(zero, mat);
+  return std::make_shared<DenseMass>(mat);
+}
+
+#endif
@@ -1,8 +1,17 @@
 #ifndef MASS_SPRING_HPP
 #define MASS_SPRING_HPP
 
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <cstdint>
+#include <stdexcept>
+
 #include <nonlinfunc.hpp>
 #include <timestepper.hpp>
+#include <sparsematrix.hpp>
+#include <constraintfunc.hpp>
+#include "contact.hpp"
 
 using namespace ASC_ode;
 
@@ -58,14 +67,76 @@ struct DistanceConstraint
   double    length;         // prescribed distance
 };
 
+template <int D> class MassSpringSystem;
+
+// a mass of a MassSpringSystem, pos/vel/acc refer to the state arrays of
+// the system. The mass value is part of the model, it is changed through
+// the system (setMass), such that derived data are rebuilt.
+template <int D>
+class MassView
+{
+  MassSpringSystem<D> * m_mss;
+  size_t m_nr;
+public:
+  VectorView<double> pos, vel, acc;
+
+  MassView (MassSpringSystem<D> & mss, size_t nr, VectorView<double> _pos,
+            VectorView<double> _vel, VectorView<double> _acc)
+    : m_mss(&mss), m_nr(nr), pos(_pos), vel(_vel), acc(_acc) { }
+
+  size_t nr() const { return m_nr; }
+  double mass() const { return m_mss->massValue(m_nr); }
+  void setMass (double mass) { m_mss->setMass (Connector { Connector::MASS, m_nr }, mass); }
+};
+
+// numberings of the masses in the state vector, see MassSpringSystem::reorderMasses
+enum class MassOrdering { INSERTION, RCM, MORTON };
+
+
+// the masses of a MassSpringSystem without copies: [i] is a MassView for
+// a mutable system, a Mass<D> copy for a const one
+template <typename MSS>
+class MassList
+{
+  MSS * m_mss;
+public:
+  class iterator
+  {
+    MSS * m_mss;
+    size_t m_i;
+  public:
+    iterator (MSS * mss, size_t i) : m_mss(mss), m_i(i) { }
+    auto operator* () const { return m_mss->massAt(m_i); }
+    iterator & operator++ () { m_i++; return *this; }
+    bool operator== (const iterator & other) const { return m_i == other.m_i; }
+    bool operator!= (const iterator & other) const { return m_i != other.m_i; }
+  };
+
+  MassList (MSS & mss) : m_mss(&mss) { }
+  size_t size() const { return m_mss->numMasses(); }
+  auto operator[] (size_t i) const { return m_mss->massAt(i); }
+  iterator begin() const { return { m_mss, 0 }; }
+  iterator end() const { return { m_mss, size() }; }
+};
+
 template <int D>
 class MassSpringSystem
 {
   std::vector<Fix<D>> m_fixes;
-  std::vector<Mass<D>> m_masses;
+  // the masses, their states as contiguous nm x D arrays (row major, in
+  // insertion order), such that they can be handed out without copies
+  std::vector<double> m_mass;
+  std::vector<double> m_pos, m_vel, m_acc;
   std::vector<Spring> m_springs;
   std::vector<DistanceConstraint> m_constraints;
+  ContactModel<D> m_contact;
   Vec<D> m_gravity=0.0;
+  // counts modifications of the model (not of the state), such that
+  // derived data like CompiledMSS know when to rebuild
+  size_t m_version = 0;
+  // position of mass nr in the state vector, empty for insertion order.
+  // Connectors always refer to the insertion order, so handles stay valid.
+  std::vector<size_t> m_massindex;
 public:
 
 // read-only access (comme pour masses(), fixes(), springs())
@@ -78,64 +149,442 @@ void addDistanceConstraint(Connector c1, Connector c2, double length)
   dc.connectors[1] = c2;
   dc.length        = length;
   m_constraints.push_back(dc);
+  m_version++;
 }
 
-  void setGravity (Vec<D> gravity) { m_gravity = gravity; }
+  void setGravity (Vec<D> gravity) { m_gravity = gravity; m_version++; }
   Vec<D> getGravity() const { return m_gravity; }
 
+  // penalty contacts between masses (balls of the given radius),
+  // not between masses joined by a spring, stiffness 0 switches contacts off
+  void setContact (double radius, double stiffness)
+  {
+    m_contact.radius = radius;
+    m_contact.stiffness = stiffness;
+    m_version++;
+  }
+
+  // masses are kept in the half space  normal.x >= offset
+  void addContactPlane (Vec<D> normal, double offset)
+  {
+    ContactPlane<D> plane;
+    double len = norm(normal);
+    for (int a = 0; a < D; a++)
+      plane.normal[a] = normal(a) / len;
+    plane.offset = offset / len;
+    m_contact.planes.push_back(plane);
+    m_version++;
+  }
+
+  const ContactModel<D> & contact() const { return m_contact; }
+  void setContactModel (const ContactModel<D> & contact) { m_contact = contact; m_version++; }
+
   Connector addFix (Fix<D> p)
   {
     m_fixes.push_back(p);
+    m_version++;
     return { Connector::FIX, m_fixes.size()-1 };
   }
 
+  void reserve (size_t nmasses, size_t nfixes = 0, size_t nsprings = 0)
+  {
+    size_t nm = numMasses()+nmasses;
+    m_mass.reserve(nm);
+    for (auto * buf : { &m_pos, &m_vel, &m_acc })
+      buf->reserve(D*nm);
+    if (m_massindex.size())
+      m_massindex.reserve(nm);
+    m_fixes.reserve(m_fixes.size()+nfixes);
+    m_springs.reserve(m_springs.size()+nsprings);
+  }
+
+  // Bulk versions of addMass/addFix/addSpring, for arrays from numpy or the
+  // generators. Positions are contiguous n x D arrays, a stride 0 uses the
+  // same mass/length/stiffness for all. Return the number of the first new
+  // object, the others follow consecutively.
+  size_t addMasses (size_t n, const double * pos, const double * mass, size_t massstride = 1)
+  {
+    size_t first = numMasses();
+    for (size_t i = 0; i < n; i++)
+      if (!(mass[i*massstride] > 0))
+        throw std::invalid_argument("addMasses: masses must be positive");
+
+    reserve (n);
+    for (size_t i = 0; i < n; i++)
+      {
+        if (m_massindex.size())
+          m_massindex.push_back (first+i);
+        m_mass.push_back (mass[i*massstride]);
+      }
+    m_pos.insert (m_pos.end(), pos, pos+D*n);
+    m_vel.resize (D*(first+n), 0.0);
+    m_acc.resize (D*(first+n), 0.0);
+    m_version++;
+    return first;
+  }
+
+  size_t addFixes (size_t n, const double * pos)
+  {
+    size_t first = m_fixes.size();
+    m_fixes.reserve(first+n);
+    for (size_t i = 0; i < n; i++)
+      {
+        Fix<D> f;
+        for (int a = 0; a < D; a++)
+          f.pos(a) = pos[D*i+a];
+        m_fixes.push_back (f);
+      }
+    m_version++;
+    return first;
+  }
+
+  // springs between (type1, pairs[2k]) and (type2, pairs[2k+1]).
+  // Without lengths, the current distances are the rest lengths.
+  size_t addSprings (size_t n, const size_t * pairs,
+                     const double * lengths, size_t lengthstride,
+                     const double * stiffness, size_t stiffnessstride,
+                     Connector::CONTYPE type1 = Connector::MASS,
+                     Connector::CONTYPE type2 = Connector::MASS)
+  {
+    size_t first = m_springs.size();
+    m_springs.reserve(first+n);
+    for (size_t k = 0; k < n; k++)
+      {
+        Connector c1 { type1, pairs[2*k] }, c2 { type2, pairs[2*k+1] };
+        size_t size1 = (type1 == Connector::MASS) ? numMasses() : m_fixes.size();
+        size_t size2 = (type2 == Connector::MASS) ? numMasses() : m_fixes.size();
+        if (c1.nr >= size1 || c2.nr >= size2)
+          throw std::out_of_range("addSprings: connector number out of range");
+        double length = lengths ? lengths[k*lengthstride] : norm(position(c2)-position(c1));
+        m_springs.push_back ( { length, stiffness[k*stiffnessstride], { c1, c2 } } );
+      }
+    m_version++;
+    return first;
+  }
+
+  // position of a mass or a fix
+  Vec<D> position (Connector c) const
+  {
+    if (c.type == Connector::FIX) return m_fixes[c.nr].pos;
+    Vec<D> p;
+    for (int a = 0; a < D; a++)
+      p(a) = m_pos[D*c.nr+a];
+    return p;
+  }
+
   Connector addMass (Mass<D> m)
   {
-    m_masses.push_back (m);
-    return { Connector::MASS, m_masses.size()-1 };
+    if (!(m.mass > 0))
+      throw std::invalid_argument("addMass: masses must be positive");
+    size_t nr = numMasses();
+    if (m_massindex.size())
+      m_massindex.push_back (nr);
+    m_mass.push_back (m.mass);
+    for (int a = 0; a < D; a++)
+      {
+        m_pos.push_back (m.pos(a));
+        m_vel.push_back (m.vel(a));
+        m_acc.push_back (m.acc(a));
+      }
+    m_version++;
+    return { Connector::MASS, nr };
   }
   
   size_t addSpring (Spring s) 
   {
     m_springs.push_back (s); 
+    m_version++;
     return m_springs.size()-1;
   }
 
-  auto & fixes() { return m_fixes; } 
-  auto & masses() { return m_masses; } 
-  auto & springs() { return m_springs; }
+  void clearSprings ()
+  {
+    m_springs.clear();
+    m_version++;
+  }
+
+  void setMass (Connector c, double mass)
+  {
+    if (!(mass > 0))
+      throw std::invalid_argument("setMass: masses must be positive");
+    m_mass[c.nr] = mass;
+    m_version++;
+  }
+
+  // the masses as views to their states; writing the states does not
+  // change the model
+  MassList<MassSpringSystem> masses() { return { *this }; }
+
+  auto const & fixes() const { return m_fixes; }
+  MassList<const MassSpringSystem> masses() const { return { *this }; }
+  auto const & springs() const { return m_springs; }
+
+  size_t numMasses() const { return m_mass.size(); }
+  double massValue (size_t nr) const { return m_mass[nr]; }
+
+  // the states of the masses as contiguous numMasses() x D arrays, row
+  // major in insertion order (not in the order of the state vector, see
+  // massIndex). Writing to them changes the state, not the model.
+  // Adding masses invalidates the pointers.
+  double * positions() { return m_pos.data(); }
+  double * velocities() { return m_vel.data(); }
+  double * accelerations() { return m_acc.data(); }
+  const double * positions() const { return m_pos.data(); }
+  const double * velocities() const { return m_vel.data(); }
+  const double * accelerations() const { return m_acc.data(); }
+
+  size_t version() const { return m_version; }
+
+  // row of mass nr in the state vector (as nm x D matrix)
+  size_t massIndex (size_t nr) const
+  { return m_massindex.size() ? m_massindex[nr] : nr; }
+
+  // the same connector, with the mass number replaced by its massIndex
+  Connector stateConnector (Connector c) const
+  {
+    if (c.type == Connector::MASS)
+      c.nr = massIndex(c.nr);
+    return c;
+  }
+
+  // the mass, resp. fix a connector refers to
+  MassView<D> mass (Connector c) { return massAt(c.nr); }
+  Mass<D> mass (Connector c) const { return massAt(c.nr); }
+  const Fix<D> & fix (Connector c) const { return m_fixes[c.nr]; }
 
-  void getState (VectorView<> values, VectorView<> dvalues, VectorView<> ddvalues)
+  // set the positions of the masses in the state vector, a permutation
+  void setMassNumbering (const std::vector<size_t> & massindex)
   {
-    auto valmat = values.asMatrix(m_masses.size(), D);
-    auto dvalmat = dvalues.asMatrix(m_masses.size(), D);
-    auto ddvalmat = ddvalues.asMatrix(m_masses.size(), D);
+    std::vector<bool> used(numMasses(), false);
+    if (massindex.size() != numMasses())
+      throw std::invalid_argument("setMassNumbering: wrong size");
+    for (size_t i : massindex)
+      {
+        if (i >= used.size() || used[i])
+          throw std::invalid_argument("setMassNumbering: not a permutation");
+        used[i] = true;
+      }
+    m_massindex = massindex;
+    m_version++;
+  }
 
-    for (size_t i = 0; i < m_masses.size(); i++)
+  // Renumber the masses in the state vector for locality.
+  // RCM (reverse Cuthill-McKee on the spring graph) minimizes the bandwidth
+  // of the Jacobian, MORTON sorts along a space-filling curve through the
+  // initial positions. The state vector order changes, connectors don't.
+  void reorderMasses (MassOrdering ordering = MassOrdering::RCM)
+  {
+    std::vector<size_t> order;   // mass numbers in new order
+    switch (ordering)
       {
-        valmat.row(i) = m_masses[i].pos;
-        dvalmat.row(i) = m_masses[i].vel;
-        ddvalmat.row(i) = m_masses[i].acc;
+      case MassOrdering::INSERTION:
+        m_massindex.clear();
+        m_version++;
+        return;
+      case MassOrdering::RCM:
+        order = orderRCM(); break;
+      case MassOrdering::MORTON:
+        order = orderMorton(); break;
       }
+    std::vector<size_t> massindex(order.size());
+    for (size_t k = 0; k < order.size(); k++)
+      massindex[order[k]] = k;
+    setMassNumbering (massindex);
+  }
+
+  void getState (VectorView<> values, VectorView<> dvalues, VectorView<> ddvalues) const
+  {
+    toStateVector (m_pos, values);
+    toStateVector (m_vel, dvalues);
+    toStateVector (m_acc, ddvalues);
+  }
+
+  // only the positions, in the order of the state vector
+  void getPositions (VectorView<> values) const
+  {
+    toStateVector (m_pos, values);
   }
 
   void setState (VectorView<> values, VectorView<> dvalues, VectorView<> ddvalues)
   {
-    auto valmat = values.asMatrix(m_masses.size(), D);
-    auto dvalmat = dvalues.asMatrix(m_masses.size(), D);
-    auto ddvalmat = ddvalues.asMatrix(m_masses.size(), D);
+    fromStateVector (values, m_pos);
+    fromStateVector (dvalues, m_vel);
+    fromStateVector (ddvalues, m_acc);
+  }
 
-    for (size_t i = 0; i < m_masses.size(); i++)
+private:
+  template <typename> friend class MassList;
+
+  MassView<D> massAt (size_t nr)
+  {
+    return { *this, nr, VectorView<double>(D, &m_pos[D*nr]),
+             VectorView<double>(D, &m_vel[D*nr]), VectorView<double>(D, &m_acc[D*nr]) };
+  }
+
+  Mass<D> massAt (size_t nr) const
+  {
+    Mass<D> m { m_mass[nr], {} };
+    for (int a = 0; a < D; a++)
+      {
+        m.pos(a) = m_pos[D*nr+a];
+        m.vel(a) = m_vel[D*nr+a];
+        m.acc(a) = m_acc[D*nr+a];
+      }
+    return m;
+  }
+
+  void toStateVector (const std::vector<double> & buf, VectorView<> values) const
+  {
+    for (size_t i = 0; i < numMasses(); i++)
       {
-        m_masses[i].pos = valmat.row(i);
-        m_masses[i].vel = dvalmat.row(i);
-        m_masses[i].acc = ddvalmat.row(i);
+        size_t row = massIndex(i);
+        for (int a = 0; a < D; a++)
+          values(D*row+a) = buf[D*i+a];
       }
   }
+
+  void fromStateVector (VectorView<> values, std::vector<double> & buf) const
+  {
+    for (size_t i = 0; i < numMasses(); i++)
+      {
+        size_t row = massIndex(i);
+        for (int a = 0; a < D; a++)
+          buf[D*i+a] = values(D*row+a);
+      }
+  }
+
+  // adjacency of the masses by springs and constraints
+  std::vector<std::vector<size_t>> massGraph() const
+  {
+    std::vector<std::vector<size_t>> graph(numMasses());
+    auto connect = [&](Connector c1, Connector c2)
+    {
+      if (c1.type != Connector::MASS || c2.type != Connector::MASS || c1.nr == c2.nr) return;
+      graph[c1.nr].push_back(c2.nr);
+      graph[c2.nr].push_back(c1.nr);
+    };
+    for (auto & sp : m_springs)
+      connect (sp.connectors[0], sp.connectors[1]);
+    for (auto & con : m_constraints)
+      connect (con.connectors[0], con.connectors[1]);
+    for (auto & nb : graph)
+      {
+        std::sort(nb.begin(), nb.end());
+        nb.erase(std::unique(nb.begin(), nb.end()), nb.end());
+      }
+    return graph;
+  }
+
+  std::vector<size_t> orderRCM() const
+  {
+    auto graph = massGraph();
+    size_t nm = graph.size();
+    std::vector<size_t> order;
+    order.reserve(nm);
+    std::vector<bool> visited(nm, false);
+
+    // breadth first search from start, neighbours by increasing degree,
+    // returns the last level
+    std::vector<size_t> level(nm);
+    auto bfs = [&](size_t start, std::vector<size_t> & result)
+    {
+      size_t first = result.size();
+      result.push_back(start);
+      visited[start] = true;
+      level[start] = 0;
+      std::vector<size_t> nbs;
+      for (size_t k = first; k < result.size(); k++)
+        {
+          size_t i = result[k];
+          nbs.clear();
+          for (size_t j : graph[i])
+            if (!visited[j]) nbs.push_back(j);
+          std::stable_sort(nbs.begin(), nbs.end(),
+                           [&](size_t a, size_t b) { return graph[a].size() < graph[b].size(); });
+          for (size_t j : nbs)
+            {
+              visited[j] = true;
+              level[j] = level[i]+1;
+              result.push_back(j);
+            }
+        }
+      return first;
+    };
+
+    for (size_t root = 0; root < nm; root++)
+      {
+        if (visited[root]) continue;
+
+        // pseudo-peripheral start node: repeat the search from a node of
+        // minimal degree in the last level, as long as the depth grows
+        size_t start = root;
+        size_t depth = 0;
+        for (int it = 0; it < 5; it++)
+          {
+            std::vector<size_t> comp;
+            bfs(start, comp);
+            for (size_t i : comp) visited[i] = false;
+            size_t last = comp.back();
+            if (it > 0 && level[last] <= depth) break;
+            depth = level[last];
+            size_t best = last;
+            for (size_t k = comp.size(); k-- > 0 && level[comp[k]] == depth; )
+              if (graph[comp[k]].size() < graph[best].size())
+                best = comp[k];
+            start = best;
+          }
+
+        size_t first = bfs(start, order);
+        std::reverse(order.begin()+first, order.end());
+      }
+    return order;
+  }
+
+  std::vector<size_t> orderMorton() const
+  {
+    size_t nm = numMasses();
+    double pmin[D], pmax[D];
+    for (int a = 0; a < D; a++)
+      {
+        pmin[a] = std::numeric_limits<double>::max();
+        pmax[a] = std::numeric_limits<double>::lowest();
+      }
+    for (size_t i = 0; i < nm; i++)
+      for (int a = 0; a < D; a++)
+        {
+          pmin[a] = std::min(pmin[a], m_pos[D*i+a]);
+          pmax[a] = std::max(pmax[a], m_pos[D*i+a]);
+        }
+
+    // interleave the bits of the quantized coordinates
+    const int bits = 63 / D;
+    std::vector<std::pair<uint64_t,size_t>> keys(nm);
+    for (size_t i = 0; i < nm; i++)
+      {
+        uint64_t q[D];
+        for (int a = 0; a < D; a++)
+          {
+            double ext = pmax[a]-pmin[a];
+            double rel = (ext > 0) ? (m_pos[D*i+a]-pmin[a]) / ext : 0;
+            q[a] = uint64_t(rel * ((uint64_t(1) << bits) - 1));
+          }
+        uint64_t key = 0;
+        for (int b = bits; b-- > 0; )
+          for (int a = 0; a < D; a++)
+            key = (key << 1) | ((q[a] >> b) & 1);
+        keys[i] = { key, i };
+      }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<size_t> order(nm);
+    for (size_t k = 0; k < nm; k++)
+      order[k] = keys[k].second;
+    return order;
+  }
 };
 
 template <int D>
-std::ostream & operator<< (std::ostream & ost, MassSpringSystem<D> & mss)
+std::ostream & operator<< (std::ostream & ost, const MassSpringSystem<D> & mss)
 {
   ost << "fixes:" << std::endl;
   for (auto f : mss.fixes())
@@ -153,85 +602,527 @@ std::ostream & operator<< (std::ostream & ost, MassSpringSystem<D> & mss)
 }
 
 
+// Flat copy of a MassSpringSystem for the force kernels: springs are split
+// into mass-mass and mass-fix lists and stored as structure of arrays,
+// mass-mass springs are sorted by their masses. Fix positions and inverse
+// masses are copied, so the kernels need no Connector branches and no
+// lookups into the system.
+//
+// Both lists are grouped by colors, springs of one color share no mass.
+// Colors are processed one after the other, the springs of a color can be
+// processed in parallel without races. The summation order of every mass
+// is the same for any number of threads, so results are bitwise reproducible.
 template <int D>
-class MSS_Function : public NonlinearFunction
+class CompiledMSS
 {
-  MassSpringSystem<D> & mss;
-
 public:
-  MSS_Function (MassSpringSystem<D> & _mss)
-    : mss(_mss) { }
+  size_t numMasses = 0;
+  double gravity[D];
+  std::vector<double> mass, invMass;
 
-  virtual size_t dimX() const override { return D * mss.masses().size(); }
-  virtual size_t dimF() const override { return D * mss.masses().size(); }
+  // mass-mass springs, mmI[s] < mmJ[s]
+  std::vector<size_t> mmI, mmJ;
+  std::vector<double> mmStiffness, mmLength;
+  std::vector<size_t> mmColorStart;   // color c: [mmColorStart[c], mmColorStart[c+1])
+  std::vector<std::array<size_t,2>> mmPairs;   // (mmI, mmJ) sorted, without duplicates
 
- 
-  virtual void evaluate (VectorView<double> x, VectorView<double> f) const override
+  // mass-fix springs, fix positions as D arrays
+  std::vector<size_t> mfI;
+  std::vector<double> mfFix[D];
+  std::vector<double> mfStiffness, mfLength;
+  std::vector<size_t> mfColorStart;
+
+  bool parallel = true;
+
+  // potential of the springs at the last evaluateForces with energies
+  mutable double springEnergy = 0;
+
+  size_t version = size_t(-1);
+
+  void build (const MassSpringSystem<D> & mss)
   {
-    f = 0.0;
+    numMasses = mss.numMasses();
+    for (int a = 0; a < D; a++)
+      gravity[a] = mss.getGravity()(a);
 
-    const size_t nm = mss.masses().size();
-    auto xmat = x.asMatrix(nm, D); 
-    auto fmat = f.asMatrix(nm, D);  
+    mass.resize(numMasses);
+    invMass.resize(numMasses);
+    for (size_t i = 0; i < numMasses; i++)
+      {
+        mass[mss.massIndex(i)] = mss.massValue(i);
+        invMass[mss.massIndex(i)] = 1.0 / mss.massValue(i);
+      }
 
-    for (size_t i = 0; i < nm; i++)
-      fmat.row(i) = mss.masses()[i].mass * mss.getGravity();
+    std::vector<size_t> mmsprings, mfsprings;
+    auto & springs = mss.springs();
+    for (size_t s = 0; s < springs.size(); s++)
+      {
+        auto c1 = springs[s].connectors[0];
+        auto c2 = springs[s].connectors[1];
+        if (c1.type == Connector::MASS && c2.type == Connector::MASS)
+          mmsprings.push_back(s);
+        else if (c1.type == Connector::MASS || c2.type == Connector::MASS)
+          mfsprings.push_back(s);
+      }
 
-    for (const auto &spring : mss.springs())
+    auto massnrs = [&](size_t s)
     {
-      auto c1 = spring.connectors[0];
-      auto c2 = spring.connectors[1];
+      size_t i = mss.massIndex(springs[s].connectors[0].nr);
+      size_t j = mss.massIndex(springs[s].connectors[1].nr);
+      return std::array<size_t,2> { std::min(i,j), std::max(i,j) };
+    };
+    std::sort (mmsprings.begin(), mmsprings.end(),
+               [&](size_t a, size_t b) { return massnrs(a) < massnrs(b); });
 
-      Vec<D> p1, p2;
+    // greedy coloring, in sorted order such that colors keep locality
+    std::vector<std::vector<size_t>> usedcolors(numMasses);
+    std::vector<size_t> color(springs.size(), 0);
+    auto isused = [&](size_t i, size_t c)
+    { return std::find(usedcolors[i].begin(), usedcolors[i].end(), c) != usedcolors[i].end(); };
+    for (size_t s : mmsprings)
+      {
+        auto [i,j] = massnrs(s);
+        size_t c = 0;
+        while (isused(i,c) || isused(j,c)) c++;
+        color[s] = c;
+        usedcolors[i].push_back(c);
+        usedcolors[j].push_back(c);
+      }
+    std::stable_sort (mmsprings.begin(), mmsprings.end(),
+                      [&](size_t a, size_t b) { return color[a] < color[b]; });
+    mmColorStart = ColorStarts (mmsprings, color);
 
-      if (c1.type == Connector::FIX)
-        p1 = mss.fixes()[c1.nr].pos;
-      else
-        p1 = xmat.row(c1.nr);
+    size_t nmm = mmsprings.size();
+    mmI.resize(nmm); mmJ.resize(nmm);
+    mmStiffness.resize(nmm); mmLength.resize(nmm);
+    for (size_t k = 0; k < nmm; k++)
+      {
+        auto [i,j] = massnrs(mmsprings[k]);
+        mmI[k] = i;
+        mmJ[k] = j;
+        mmStiffness[k] = springs[mmsprings[k]].stiffness;
+        mmLength[k] = springs[mmsprings[k]].length;
+      }
+    mmPairs.resize(nmm);
+    for (size_t k = 0; k < nmm; k++)
+      mmPairs[k] = { mmI[k], mmJ[k] };
+    std::sort (mmPairs.begin(), mmPairs.end());
+    mmPairs.erase (std::unique(mmPairs.begin(), mmPairs.end()), mmPairs.end());
 
-      if (c2.type == Connector::FIX)
-        p2 = mss.fixes()[c2.nr].pos;
-      else
-        p2 = xmat.row(c2.nr);
+    // the force on the mass is the same for both orientations
+    auto massnr = [&](size_t s)
+    { return mss.massIndex(springs[s].connectors[springs[s].connectors[0].type == Connector::FIX].nr); };
+    std::sort (mfsprings.begin(), mfsprings.end(),
+               [&](size_t a, size_t b) { return massnr(a) < massnr(b); });
+    // the k-th spring at a mass gets color k
+    for (size_t k = 0; k < mfsprings.size(); k++)
+      color[mfsprings[k]] = (k > 0 && massnr(mfsprings[k-1]) == massnr(mfsprings[k]))
+        ? color[mfsprings[k-1]]+1 : 0;
+    std::stable_sort (mfsprings.begin(), mfsprings.end(),
+                      [&](size_t a, size_t b) { return color[a] < color[b]; });
+    mfColorStart = ColorStarts (mfsprings, color);
+    size_t nmf = mfsprings.size();
+    mfI.resize(nmf);
+    for (int a = 0; a < D; a++)
+      mfFix[a].resize(nmf);
+    mfStiffness.resize(nmf); mfLength.resize(nmf);
+    for (size_t k = 0; k < nmf; k++)
+      {
+        auto & spring = springs[mfsprings[k]];
+        bool firstfix = spring.connectors[0].type == Connector::FIX;
+        mfI[k] = mss.massIndex(spring.connectors[firstfix ? 1 : 0].nr);
+        auto & fix = mss.fixes()[spring.connectors[firstfix ? 0 : 1].nr];
+        for (int a = 0; a < D; a++)
+          mfFix[a][k] = fix.pos(a);
+        mfStiffness[k] = spring.stiffness;
+        mfLength[k] = spring.length;
+      }
 
-      Vec<D> diff = p2 - p1;
-      const double dist = norm(diff);
-      if (dist <= 1e-12) continue;
+    springEnergy = 0;
+    version = mss.version();
+  }
 
-      const double force = spring.stiffness * (dist - spring.length);
-      Vec<D> dir12 = (1.0 / dist) * diff;   
+  static std::vector<size_t> ColorStarts (const std::vector<size_t> & sorted,
+                                          const std::vector<size_t> & color)
+  {
+    size_t ncolors = sorted.size() ? color[sorted.back()]+1 : 0;
+    std::vector<size_t> starts(ncolors+1, 0);
+    for (size_t s : sorted)
+      starts[color[s]+1]++;
+    for (size_t c = 0; c < ncolors; c++)
+      starts[c+1] += starts[c];
+    return starts;
+  }
 
-      if (c1.type == Connector::MASS)
-        fmat.row(c1.nr) += force * dir12;   
+  size_t numColors() const { return mmColorStart.size()-1 + mfColorStart.size()-1; }
 
-      if (c2.type == Connector::MASS)
-        fmat.row(c2.nr) -= force * dir12;   
-    }
+  // func(s) for all mass-mass springs, color by color, springs of one color in parallel
+  template <typename FUNC>
+  void loopMassMass (FUNC func) const
+  {
+#pragma omp parallel if (parallel && mmI.size() > 1000)
+    for (size_t c = 0; c+1 < mmColorStart.size(); c++)
+      {
+#pragma omp for schedule(static)
+        for (size_t s = mmColorStart[c]; s < mmColorStart[c+1]; s++)
+          func(s);
+      }
+  }
 
-    for (size_t i = 0; i < nm; i++)
-      fmat.row(i) *= 1.0 / mss.masses()[i].mass;
+  template <typename FUNC>
+  void loopMassFix (FUNC func) const
+  {
+#pragma omp parallel if (parallel && mfI.size() > 1000)
+    for (size_t c = 0; c+1 < mfColorStart.size(); c++)
+      {
+#pragma omp for schedule(static)
+        for (size_t s = mfColorStart[c]; s < mfColorStart[c+1]; s++)
+          func(s);
+      }
+  }
+
+  // as the loops above, and return the sum of func(s). The sum is reproducible
+  // for a fixed number of threads only.
+  template <typename FUNC>
+  double sumMassMass (FUNC func) const
+  {
+    double sum = 0;
+#pragma omp parallel if (parallel && mmI.size() > 1000) reduction(+:sum)
+    for (size_t c = 0; c+1 < mmColorStart.size(); c++)
+      {
+#pragma omp for schedule(static)
+        for (size_t s = mmColorStart[c]; s < mmColorStart[c+1]; s++)
+          sum += func(s);
+      }
+    return sum;
+  }
+
+  template <typename FUNC>
+  double sumMassFix (FUNC func) const
+  {
+    double sum = 0;
+#pragma omp parallel if (parallel && mfI.size() > 1000) reduction(+:sum)
+    for (size_t c = 0; c+1 < mfColorStart.size(); c++)
+      {
+#pragma omp for schedule(static)
+        for (size_t s = mfColorStart[c]; s < mfColorStart[c+1]; s++)
+          sum += func(s);
+      }
+    return sum;
+  }
+
+  // f = gravity + M^{-1} spring forces, for x and f as contiguous nm x D arrays.
+  // With ENERGY, the potential of the springs is stored in springEnergy.
+  template <bool ENERGY = false>
+  void evaluateForces (const double * x, double * f) const
+  {
+#pragma omp parallel for schedule(static) if (parallel && numMasses > 1000)
+    for (size_t i = 0; i < numMasses; i++)
+      for (int a = 0; a < D; a++)
+        f[D*i+a] = gravity[a];
+
+    auto massmass = [&](size_t s) -> double
+      {
+        size_t i = mmI[s], j = mmJ[s];
+        double diff[D], dist2 = 0;
+        for (int a = 0; a < D; a++)
+          {
+            diff[a] = x[D*j+a] - x[D*i+a];
+            dist2 += diff[a]*diff[a];
+          }
+        double dist = std::sqrt(dist2);
+        // force / dist, zero for degenerate springs
+        double fac = (dist > 1e-12) ? mmStiffness[s] * (dist - mmLength[s]) / dist : 0.0;
+        double faci = fac * invMass[i], facj = fac * invMass[j];
+        for (int a = 0; a < D; a++)
+          {
+            f[D*i+a] += faci * diff[a];
+            f[D*j+a] -= facj * diff[a];
+          }
+        if constexpr (ENERGY)
+          return 0.5 * mmStiffness[s] * (dist-mmLength[s]) * (dist-mmLength[s]);
+        return 0.0;
+      };
+
+    auto massfix = [&](size_t s) -> double
+      {
+        size_t i = mfI[s];
+        double diff[D], dist2 = 0;
+        for (int a = 0; a < D; a++)
+          {
+            diff[a] = mfFix[a][s] - x[D*i+a];
+            dist2 += diff[a]*diff[a];
+          }
+        double dist = std::sqrt(dist2);
+        double fac = (dist > 1e-12) ? mfStiffness[s] * (dist - mfLength[s]) / dist * invMass[i] : 0.0;
+        for (int a = 0; a < D; a++)
+          f[D*i+a] += fac * diff[a];
+        if constexpr (ENERGY)
+          return 0.5 * mfStiffness[s] * (dist-mfLength[s]) * (dist-mfLength[s]);
+        return 0.0;
+      };
+
+    if constexpr (ENERGY)
+      springEnergy = sumMassMass(massmass) + sumMassFix(massfix);
+    else
+      {
+        loopMassMass(massmass);
+        loopMassFix(massfix);
+      }
+  }
+
+  // spring tangent stiffness  k [ (1-L/d) I + L/d u u^T ]
+  static void tangentStiffness (const double * diff, double k, double length,
+                                double (&stiff)[D][D])
+  {
+    double dist2 = 0;
+    for (int a = 0; a < D; a++)
+      dist2 += diff[a]*diff[a];
+    double dist = std::sqrt(dist2);
+    double ratio = length / dist;
+    for (int a = 0; a < D; a++)
+      for (int b = 0; b < D; b++)
+        stiff[a][b] = k * ( (a==b ? 1-ratio : 0) + ratio * diff[a]*diff[b]/dist2 );
+  }
+};
+
+
+// energies and momentum of a state, see MSS_Function::diagnostics
+template <int D>
+struct MSSDiagnostics
+{
+  double t = 0;
+  double kinetic = 0;
+  double spring = 0;
+  double contact = 0;
+  double gravity = 0;       // -sum m g.x
+  double momentum[D] = { };
+
+  double total() const { return kinetic + spring + contact + gravity; }
+};
+
+
+// Diagnostics over time, and the drift of the total energy relative to the
+// first entry, scaled by the size of its energy terms. For validating step
+// sizes of long runs: conservative methods keep the drift bounded.
+template <int D>
+class DiagnosticsSeries
+{
+  std::vector<MSSDiagnostics<D>> m_series;
+  double m_maxdrift = 0;
+public:
+  void add (const MSSDiagnostics<D> & diag)
+  {
+    m_series.push_back(diag);
+    m_maxdrift = std::max(m_maxdrift, std::abs(drift()));
+  }
+
+  const std::vector<MSSDiagnostics<D>> & series() const { return m_series; }
+  size_t size() const { return m_series.size(); }
+
+  double drift() const
+  {
+    if (m_series.empty()) return 0;
+    auto & first = m_series.front();
+    double scale = first.kinetic + first.spring + first.contact + std::abs(first.gravity);
+    return (m_series.back().total() - first.total()) / (scale > 0 ? scale : 1.0);
+  }
+  double maxDrift() const { return m_maxdrift; }
+};
+
+
+template <int D>
+class MSS_Function : public SparseJacobianFunction
+{
+  const MassSpringSystem<D> & mss;
+  mutable CompiledMSS<D> m_compiled;
+  bool m_locked = false;                // see lockModel
+  bool m_projection = true;
+  bool m_diagnostics = false;
+  mutable double m_contactenergy = 0;   // of the last evaluate, with diagnostics
+
+  // contacts: the hash grid, the pairs in contact at the last evaluation,
+  // and the positions of it. The Jacobian pattern contains all pairs closer
+  // than (1+contactSkin) times the contact distance.
+  static constexpr double contactSkin = 0.5;
+  mutable SpatialHashGrid<D> m_grid;
+  mutable std::vector<std::array<size_t,2>> m_contacts;
+  mutable std::vector<double> m_contactx;
+  mutable size_t m_patternversion = 0;
+  mutable Vector<> m_fwork;             // forces for the constraint projection of the Jacobian
+
+  // c with mass numbers from stateConnector
+  Vec<D> position (Connector c, MatrixView<double> xmat) const
+  {
+    if (c.type == Connector::FIX)
+      return mss.fixes()[c.nr].pos;
+    return xmat.row(c.nr);
+  }
+
+  // jac(block i, block j) += fac * mat
+  static void addBlock (SparseMatrix & jac, size_t i, size_t j, double fac,
+                        const double (&mat)[D][D])
+  {
+    for (int a = 0; a < D; a++)
+      {
+        long pos = jac.position(D*i+a, D*j);
+        for (int b = 0; b < D; b++)
+          jac.val(pos+b) += fac * mat[a][b];
+      }
+  }
+
+  // spring forces divided by mass, and gravity
+  void evaluateSprings (VectorView<double> x, VectorView<double> f) const
+  {
+    if (m_diagnostics)
+      compiled().template evaluateForces<true> (x.data(), f.data());
+    else
+      compiled().evaluateForces (x.data(), f.data());
+  }
+
+  // update the grid to x, and find pairs closer than dist
+  void findContacts (const double * x, double dist,
+                     std::vector<std::array<size_t,2>> & pairs) const
+  {
+    const size_t nm = mss.numMasses();
+    m_grid.setCellSize ((1+contactSkin) * 2*mss.contact().radius);
+    m_grid.update (x, nm);
+    m_grid.findPairs (x, dist, pairs);
 
-   
+    // masses joined by a spring do not collide, their rest length may
+    // well be below 2 radius
+    auto & springpairs = compiled().mmPairs;
+    if (springpairs.size())
+      pairs.erase (std::remove_if (pairs.begin(), pairs.end(),
+                                   [&](const std::array<size_t,2> & p)
+                                   { return std::binary_search (springpairs.begin(), springpairs.end(), p); }),
+                   pairs.end());
+  }
+
+  // Penalty forces of contacts, divided by the masses. Mass pairs act like
+  // springs of rest length 2 radius in compression, planes push along
+  // their normal with stiffness * penetration.
+  void evaluateContacts (VectorView<double> x, VectorView<double> f) const
+  {
+    auto & contact = mss.contact();
+    m_contactenergy = 0;
+    if (!contact.active()) return;
+    auto & comp = compiled();
+    const double * px = x.data();
+    double * pf = f.data();
+    const size_t nm = comp.numMasses;
+    double length = 2*contact.radius;
 
+    m_contactx.assign(px, px+D*nm);
+    if (contact.radius > 0)
+      findContacts (px, length, m_contacts);
+    else
+      m_contacts.clear();
+
+    for (auto [i,j] : m_contacts)
+      {
+        double diff[D], dist2 = 0;
+        for (int a = 0; a < D; a++)
+          {
+            diff[a] = px[D*j+a] - px[D*i+a];
+            dist2 += diff[a]*diff[a];
+          }
+        double dist = std::sqrt(dist2);
+        if (dist < 1e-12) continue;
+        double fac = contact.stiffness * (dist - length) / dist;
+        for (int a = 0; a < D; a++)
+          {
+            pf[D*i+a] += fac * comp.invMass[i] * diff[a];
+            pf[D*j+a] -= fac * comp.invMass[j] * diff[a];
+          }
+        if (m_diagnostics)
+          m_contactenergy += 0.5 * contact.stiffness * (dist-length) * (dist-length);
+      }
+
+    for (auto & plane : contact.planes)
+      for (size_t i = 0; i < nm; i++)
+        {
+          double height = -plane.offset;
+          for (int a = 0; a < D; a++)
+            height += plane.normal[a] * px[D*i+a];
+          if (height >= contact.radius) continue;
+          double fac = contact.stiffness * (contact.radius - height) * comp.invMass[i];
+          for (int a = 0; a < D; a++)
+            pf[D*i+a] += fac * plane.normal[a];
+          if (m_diagnostics)
+            m_contactenergy += 0.5 * contact.stiffness * (contact.radius-height) * (contact.radius-height);
+        }
+  }
+
+  // contacts which are not in the pattern of jac are skipped,
+  // and patternVersion() is increased
+  void differentiateContacts (VectorView<double> x, SparseMatrix & jac) const
+  {
+    auto & contact = mss.contact();
+    if (!contact.active()) return;
+    auto & comp = compiled();
+    const double * px = x.data();
+    const size_t nm = comp.numMasses;
+    double length = 2*contact.radius;
+
+    if (contact.radius > 0)
+      findContacts (px, length, m_contacts);
+    else
+      m_contacts.clear();
+
+    for (auto [i,j] : m_contacts)
+      {
+        if (jac.position(D*i, D*j) < 0)
+          {
+            m_patternversion++;
+            continue;
+          }
+        double diff[D], stiff[D][D], dist2 = 0;
+        for (int a = 0; a < D; a++)
+          {
+            diff[a] = px[D*j+a] - px[D*i+a];
+            dist2 += diff[a]*diff[a];
+          }
+        if (dist2 <= 1e-24) continue;
+        comp.tangentStiffness (diff, contact.stiffness, length, stiff);
+        addBlock (jac, i, i, -comp.invMass[i], stiff);
+        addBlock (jac, i, j, comp.invMass[i], stiff);
+        addBlock (jac, j, j, -comp.invMass[j], stiff);
+        addBlock (jac, j, i, comp.invMass[j], stiff);
+      }
+
+    for (auto & plane : contact.planes)
+      for (size_t i = 0; i < nm; i++)
+        {
+          double height = -plane.offset;
+          for (int a = 0; a < D; a++)
+            height += plane.normal[a] * px[D*i+a];
+          if (height >= contact.radius) continue;
+          // d force / dp = -k n n^T
+          double stiff[D][D];
+          for (int a = 0; a < D; a++)
+            for (int b = 0; b < D; b++)
+              stiff[a][b] = contact.stiffness * plane.normal[a] * plane.normal[b];
+          addBlock (jac, i, i, -comp.invMass[i], stiff);
+        }
+  }
+
+  // Sequential projection of the accelerations for the distance constraints.
+  // If jac is given, it contains the derivative of fmat on input and
+  // is updated by the derivative of the projection.
+  void applyConstraints (MatrixView<double> xmat, MatrixView<double> fmat,
+                         SparseMatrix * jac) const
+  {
     for (const auto &con : mss.constraints())
     {
-      const auto c1 = con.connectors[0];
-      const auto c2 = con.connectors[1];
+      const auto c1 = mss.stateConnector(con.connectors[0]);
+      const auto c2 = mss.stateConnector(con.connectors[1]);
 
       const bool isMass1 = (c1.type == Connector::MASS);
       const bool isMass2 = (c2.type == Connector::MASS);
 
-      // positions
-      Vec<D> p1, p2;
-      if (c1.type == Connector::FIX)
-        p1 = mss.fixes()[c1.nr].pos;
-      else
-        p1 = xmat.row(c1.nr);
-
-      if (c2.type == Connector::FIX)
-        p2 = mss.fixes()[c2.nr].pos;
-      else
-        p2 = xmat.row(c2.nr);
+      Vec<D> p1 = position(c1, xmat);
+      Vec<D> p2 = position(c2, xmat);
 
       Vec<D> diff = p2 - p1;
       const double dist = norm(diff);
@@ -241,8 +1132,8 @@ public:
 
       double invm1 = 0.0;
       double invm2 = 0.0;
-      if (isMass1) invm1 = 1.0 / mss.masses()[c1.nr].mass;
-      if (isMass2) invm2 = 1.0 / mss.masses()[c2.nr].mass;
+      if (isMass1) invm1 = compiled().invMass[c1.nr];
+      if (isMass2) invm2 = compiled().invMass[c2.nr];
 
       const double denom = dist * (invm1 + invm2);
       if (denom <= 1e-12) continue;
@@ -257,6 +1148,9 @@ public:
 
       const double lambda = - num / denom;
 
+      if (jac)
+        differentiateConstraint (*jac, c1, c2, dir, dist, invm1, invm2, a2-a1, lambda);
+
       if (isMass1)
         fmat.row(c1.nr) += (-lambda * invm1) * dir;
 
@@ -264,24 +1158,377 @@ public:
         fmat.row(c2.nr) += (+lambda * invm2) * dir;
     }
   }
-  
-  virtual void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+
+  // With r = a2-a1, W = invm1+invm2:
+  //   lambda = -u.r / W,  a1' = a1 - invm1 lambda u,  a2' = a2 + invm2 lambda u
+  // and for every column j, with e = d(p2-p1)/dx_j and P = I - u u^T:
+  //   du = P e / dist,  dlambda = -(du.r + u.(da2-da1)) / W
+  void differentiateConstraint (SparseMatrix & jac, Connector c1, Connector c2,
+                                const Vec<D> & u, double dist, double invm1, double invm2,
+                                const Vec<D> & r, double lambda) const
   {
-    // TODO: exact differentiation
-    double eps = 1e-8;
-    Vector<> xl(dimX()), xr(dimX()), fl(dimF()), fr(dimF());
-    for (size_t i = 0; i < dimX(); i++)
+    const bool isMass1 = (c1.type == Connector::MASS);
+    const bool isMass2 = (c2.type == Connector::MASS);
+    const double W = invm1 + invm2;
+
+    // all nonzero columns of both rows are in the pattern of the first mass-row
+    size_t mainrow = D * (isMass1 ? c1.nr : c2.nr);
+    size_t first = jac.firstInRow(mainrow);
+    size_t next = jac.nextInRow(mainrow);
+
+    for (size_t k = first; k < next; k++)
       {
-        xl = x;
-        xl(i) -= eps;
-        xr = x;
-        xr(i) += eps;
-        evaluate (xl, fl);
-        evaluate (xr, fr);
-        df.col(i) = 1/(2*eps) * (fr-fl);
+        size_t j = jac.colNr(k);
+        
+        Vec<D> e = 0.0;
+        if (isMass2 && j/D == c2.nr) e(j%D) += 1;
+        if (isMass1 && j/D == c1.nr) e(j%D) -= 1;
+
+        Vec<D> da1 = 0.0, da2 = 0.0;
+        long pos1[D], pos2[D];
+        for (int a = 0; a < D; a++)
+          {
+            pos1[a] = isMass1 ? jac.position(D*c1.nr+a, j) : -1;
+            pos2[a] = isMass2 ? jac.position(D*c2.nr+a, j) : -1;
+            if (pos1[a] >= 0) da1(a) = jac.val(pos1[a]);
+            if (pos2[a] >= 0) da2(a) = jac.val(pos2[a]);
+          }
+
+        double ue = 0, udda = 0;
+        for (int a = 0; a < D; a++)
+          {
+            ue += u(a)*e(a);
+            udda += u(a)*(da2(a)-da1(a));
+          }
+        Vec<D> du = (1.0/dist) * (e - ue*u);
+        double dur = 0;
+        for (int a = 0; a < D; a++)
+          dur += du(a)*r(a);
+        double dlambda = -(dur + udda) / W;
+
+        // d(lambda u) = dlambda u + lambda du
+        for (int a = 0; a < D; a++)
+          {
+            double t = dlambda*u(a) + lambda*du(a);
+            if (pos1[a] >= 0) jac.val(pos1[a]) -= invm1 * t;
+            if (pos2[a] >= 0) jac.val(pos2[a]) += invm2 * t;
+          }
+      }
+  }
+
+public:
+  MSS_Function (const MassSpringSystem<D> & _mss)
+    : mss(_mss) { }
+
+  // connectivity of the system, rebuilt after modifications
+  const CompiledMSS<D> & compiled() const
+  {
+    if (m_locked) return m_compiled;
+    if (m_compiled.version != mss.version())
+      {
+        m_compiled.build(mss);
+        m_patternversion++;   // springs and masses may have changed
+      }
+    return m_compiled;
+  }
+
+  // While locked, the compiled data are used as they are and the system is
+  // not looked at for modifications, e.g. while a Simulator integrates in
+  // a background thread. Locking brings them up to date first.
+  void lockModel (bool lock)
+  {
+    if (lock) compiled();
+    m_locked = lock;
+  }
+  bool modelLocked() const { return m_locked; }
+
+  // colored parallel assembly of forces and Jacobian (if compiled with OpenMP)
+  void setParallel (bool parallel) { m_compiled.parallel = parallel; }
+
+  // The distance constraints are applied by a sequential projection of the
+  // accelerations. Switch it off if they are handled by the time stepper
+  // with MSS_Constraints instead.
+  void setConstraintProjection (bool projection) { m_projection = projection; }
+
+  // compute the potentials in the force loops of evaluate, see diagnostics
+  void setDiagnostics (bool diagnostics) { m_diagnostics = diagnostics; }
+
+  // Energies and momentum of the state (x, v). Spring and contact potentials
+  // are the ones of the last evaluate, which must have been at x (as after
+  // every step of the steppers). The rest is one pass over x and v.
+  MSSDiagnostics<D> diagnostics (VectorView<double> x, VectorView<double> v) const
+  {
+    if (!m_diagnostics)
+      throw std::logic_error("MSS_Function: diagnostics are not enabled");
+    auto & comp = compiled();
+    MSSDiagnostics<D> diag;
+    diag.spring = comp.springEnergy;
+    diag.contact = m_contactenergy;
+    for (size_t i = 0; i < comp.numMasses; i++)
+      for (int a = 0; a < D; a++)
+        {
+          double vi = v(D*i+a);
+          diag.kinetic += 0.5 * comp.mass[i] * vi*vi;
+          diag.momentum[a] += comp.mass[i] * vi;
+          diag.gravity -= comp.mass[i] * comp.gravity[a] * x(D*i+a);
+        }
+    return diag;
+  }
+
+  virtual size_t dimX() const override { return D * mss.numMasses(); }
+  virtual size_t dimF() const override { return D * mss.numMasses(); }
+
+ 
+  virtual void evaluate (VectorView<double> x, VectorView<double> f) const override
+  {
+    const size_t nm = mss.numMasses();
+    auto xmat = x.asMatrix(nm, D); 
+    auto fmat = f.asMatrix(nm, D);  
+
+    evaluateSprings (x, f);
+    evaluateContacts (x, f);
+    if (m_projection)
+      applyConstraints (xmat, fmat, nullptr);
+  }
+
+  size_t patternVersion() const override { return m_patternversion; }
+
+  // Block pattern: diagonal blocks, mass-mass springs, contact candidates
+  // near the positions of the last evaluation, and for every constraint
+  // (in order) the union of the rows of both masses, since the sequential
+  // projection couples the accelerations of the two masses.
+  virtual SparseMatrix createJacobian() const override
+  {
+    auto & comp = compiled();
+    const size_t nm = comp.numMasses;
+    std::vector<std::vector<size_t>> rows(nm);
+    for (size_t i = 0; i < nm; i++)
+      rows[i].push_back(i);
+
+    for (size_t s = 0; s < comp.mmI.size(); s++)
+      {
+        rows[comp.mmI[s]].push_back(comp.mmJ[s]);
+        rows[comp.mmJ[s]].push_back(comp.mmI[s]);
+      }
+
+    if (mss.contact().active() && mss.contact().radius > 0)
+      {
+        if (m_contactx.size() != D*nm)
+          {
+            m_contactx.resize(D*nm);
+            for (size_t i = 0; i < nm; i++)
+              for (int a = 0; a < D; a++)
+                m_contactx[D*mss.massIndex(i)+a] = mss.positions()[D*i+a];
+          }
+        std::vector<std::array<size_t,2>> candidates;
+        findContacts (m_contactx.data(), (1+contactSkin) * 2*mss.contact().radius, candidates);
+        for (auto [i,j] : candidates)
+          {
+            rows[i].push_back(j);
+            rows[j].push_back(i);
+          }
+      }
+
+    for (auto & row : rows)
+      {
+        std::sort(row.begin(), row.end());
+        row.erase(std::unique(row.begin(), row.end()), row.end());
+      }
+
+    for (const auto & con : mss.constraints())
+      {
+        if (!m_projection) break;
+        auto c1 = mss.stateConnector(con.connectors[0]);
+        auto c2 = mss.stateConnector(con.connectors[1]);
+        if (c1.type != Connector::MASS || c2.type != Connector::MASS) continue;
+        std::vector<size_t> merged;
+        std::set_union(rows[c1.nr].begin(), rows[c1.nr].end(),
+                       rows[c2.nr].begin(), rows[c2.nr].end(),
+                       std::back_inserter(merged));
+        rows[c1.nr] = merged;
+        rows[c2.nr] = merged;
+      }
+
+    std::vector<std::array<size_t,2>> blocks;
+    for (size_t i = 0; i < nm; i++)
+      for (size_t j : rows[i])
+        blocks.push_back ( { i, j } );
+    return SparseMatrix::BlockPattern(nm, D, blocks);
+  }
+
+  // Exact Jacobian. A spring contributes the tangent stiffness
+  //    K = k [ (1-L/d) I + L/d u u^T ]
+  // to the force on its first end w.r.t. its second end, and -K, resp. +K
+  // to the other blocks, scaled by the inverse masses.
+  virtual void evaluateDerivSparse (VectorView<double> x, SparseMatrix & jac) const override
+  {
+    const size_t nm = mss.numMasses();
+    auto xmat = x.asMatrix(nm, D);
+    if (m_fwork.size() != D*nm)
+      m_fwork = Vector<>(D*nm);
+    VectorView<double> f = m_fwork;
+    auto fmat = f.asMatrix(nm, D);
+
+    auto & comp = compiled();
+    jac.setZero();
+
+    comp.loopMassMass ([&](size_t s)
+      {
+        size_t i = comp.mmI[s], j = comp.mmJ[s];
+        double diff[D], stiff[D][D], dist2 = 0;
+        for (int a = 0; a < D; a++)
+          {
+            diff[a] = xmat(j,a) - xmat(i,a);
+            dist2 += diff[a]*diff[a];
+          }
+        if (dist2 <= 1e-24) return;
+        comp.tangentStiffness (diff, comp.mmStiffness[s], comp.mmLength[s], stiff);
+        addBlock (jac, i, i, -comp.invMass[i], stiff);
+        addBlock (jac, i, j, comp.invMass[i], stiff);
+        addBlock (jac, j, j, -comp.invMass[j], stiff);
+        addBlock (jac, j, i, comp.invMass[j], stiff);
+      });
+
+    comp.loopMassFix ([&](size_t s)
+      {
+        size_t i = comp.mfI[s];
+        double diff[D], stiff[D][D], dist2 = 0;
+        for (int a = 0; a < D; a++)
+          {
+            diff[a] = comp.mfFix[a][s] - xmat(i,a);
+            dist2 += diff[a]*diff[a];
+          }
+        if (dist2 <= 1e-24) return;
+        comp.tangentStiffness (diff, comp.mfStiffness[s], comp.mfLength[s], stiff);
+        addBlock (jac, i, i, -comp.invMass[i], stiff);
+      });
+
+    differentiateContacts (x, jac);
+
+    if (m_projection && mss.constraints().size())
+      {
+        evaluateSprings (x, f);
+        evaluateContacts (x, f);
+        applyConstraints (xmat, fmat, &jac);
+      }
+  }
+};
+
+
+
+// The distance constraints as  g_c = 1/2 (|p2-p1|^2 - L^2) = 0,  for the
+// constrained time steppers. Forces are scaled by the inverse masses,
+// matching the acceleration form of MSS_Function.
+template <int D>
+class MSS_Constraints : public ConstraintFunction
+{
+  const MassSpringSystem<D> & mss;
+
+public:
+  MSS_Constraints (const MassSpringSystem<D> & _mss)
+    : mss(_mss) { }
+
+  size_t dimX() const override { return D * mss.numMasses(); }
+  size_t numConstraints() const override { return mss.constraints().size(); }
+
+  void evaluate (VectorView<double> x, VectorView<double> g) const override
+  {
+    auto xmat = x.asMatrix(mss.numMasses(), D);
+    auto & constraints = mss.constraints();
+    for (size_t c = 0; c < constraints.size(); c++)
+      {
+        double diff[D];
+        distance (constraints[c], xmat, diff);
+        double dist2 = 0;
+        for (int a = 0; a < D; a++)
+          dist2 += diff[a]*diff[a];
+        g(c) = 0.5 * (dist2 - constraints[c].length*constraints[c].length);
+      }
+  }
+
+  SparseMatrix createJacobian() const override
+  {
+    std::vector<std::array<size_t,2>> entries;
+    auto & constraints = mss.constraints();
+    for (size_t c = 0; c < constraints.size(); c++)
+      for (auto con : constraints[c].connectors)
+        if (con.type == Connector::MASS)
+          for (int a = 0; a < D; a++)
+            entries.push_back ( { c, D*mss.massIndex(con.nr)+a } );
+    return SparseMatrix(constraints.size(), dimX(), std::move(entries));
+  }
+
+  // row c:  dg_c/dp2 = p2-p1,  dg_c/dp1 = p1-p2
+  void evaluateJacobian (VectorView<double> x, SparseMatrix & G) const override
+  {
+    auto xmat = x.asMatrix(mss.numMasses(), D);
+    auto & constraints = mss.constraints();
+    G.setZero();
+    for (size_t c = 0; c < constraints.size(); c++)
+      {
+        double diff[D];
+        distance (constraints[c], xmat, diff);
+        for (int e = 0; e < 2; e++)
+          {
+            auto con = constraints[c].connectors[e];
+            if (con.type != Connector::MASS) continue;
+            for (int a = 0; a < D; a++)
+              G(c, D*mss.massIndex(con.nr)+a) += (e == 1) ? diff[a] : -diff[a];
+          }
+      }
+  }
+
+  void getForceScaling (VectorView<double> s) const override
+  {
+    for (size_t i = 0; i < mss.numMasses(); i++)
+      for (int a = 0; a < D; a++)
+        s(D*mss.massIndex(i)+a) = 1.0 / mss.massValue(i);
+  }
+
+  // force on p2 is  s2 lambda (p2-p1),  on p1  s1 lambda (p1-p2)
+  void getForceDerivPattern (std::vector<std::array<size_t,2>> & entries) const override
+  {
+    for (auto & con : mss.constraints())
+      for (auto c1 : con.connectors)
+        for (auto c2 : con.connectors)
+          if (c1.type == Connector::MASS && c2.type == Connector::MASS)
+            for (int a = 0; a < D; a++)
+              entries.push_back ( { D*mss.massIndex(c1.nr)+a, D*mss.massIndex(c2.nr)+a } );
+  }
+
+  void addForceDeriv (VectorView<double> /*x*/, VectorView<double> lambda,
+                      SparseMatrix & mat, double fac) const override
+  {
+    auto & constraints = mss.constraints();
+    for (size_t c = 0; c < constraints.size(); c++)
+      for (int e1 = 0; e1 < 2; e1++)
+        for (int e2 = 0; e2 < 2; e2++)
+          {
+            auto c1 = constraints[c].connectors[e1];
+            auto c2 = constraints[c].connectors[e2];
+            if (c1.type != Connector::MASS || c2.type != Connector::MASS) continue;
+            double val = fac * lambda(c) / mss.massValue(c1.nr) * ((e1 == e2) ? 1 : -1);
+            size_t i = mss.massIndex(c1.nr), j = mss.massIndex(c2.nr);
+            for (int a = 0; a < D; a++)
+              mat(D*i+a, D*j+a) += val;
+          }
+  }
+
+private:
+  // diff = p2 - p1
+  void distance (const DistanceConstraint & con, MatrixView<double> xmat, double (&diff)[D]) const
+  {
+    for (int a = 0; a < D; a++)
+      diff[a] = 0;
+    for (int e = 0; e < 2; e++)
+      {
+        auto c = con.connectors[e];
+        double sign = (e == 1) ? 1 : -1;
+        for (int a = 0; a < D; a++)
+          diff[a] += sign * ((c.type == Connector::FIX) ? mss.fixes()[c.nr].pos(a)
+                             : xmat(mss.massIndex(c.nr), a));
       }
   }
-  
 };
 
 #endif
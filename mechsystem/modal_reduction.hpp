@@ -0,0 +1,251 @@
+#ifndef MODAL_REDUCTION_HPP
+#define MODAL_REDUCTION_HPP
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include <lanczos.hpp>
+#include "mass_spring.hpp"
+
+
+// first order system of the reduced model for the TimeSteppers,
+// y = (q, dq/dt),  q'' = -lambda q + p
+class ModalFunction : public NonlinearFunction
+{
+  std::vector<double> m_lambda, m_load;
+public:
+  ModalFunction (std::vector<double> lambda, std::vector<double> load)
+    : m_lambda(std::move(lambda)), m_load(std::move(load)) { }
+
+  size_t dimX() const override { return 2*m_lambda.size(); }
+  size_t dimF() const override { return 2*m_lambda.size(); }
+
+  void evaluate (VectorView<double> y, VectorView<double> f) const override
+  {
+    size_t k = m_lambda.size();
+    for (size_t i = 0; i < k; i++)
+      {
+        f(i) = y(k+i);
+        f(k+i) = m_load[i] - m_lambda[i] * y(i);
+      }
+  }
+
+  void evaluateDeriv (VectorView<double> y, MatrixView<double> df) const override
+  {
+    size_t k = m_lambda.size();
+    df = 0.0;
+    for (size_t i = 0; i < k; i++)
+      {
+        df(i, k+i) = 1;
+        df(k+i, i) = -m_lambda[i];
+      }
+  }
+};
+
+
+// how much of the full model the modes miss
+struct ModalError
+{
+  double displacement = 0;  // |x0 - x_ref - Phi q0|_M / |x0 - x_ref|_M, of setInitial
+  double velocity = 0;      // same for v0
+  double load = 0;          // same for the acceleration at x_ref, 0 at an equilibrium
+  double cutoff = std::numeric_limits<double>::infinity();  // omega^2 of the first dropped mode (estimate)
+  double residual = 0;      // largest relative residual of the eigenpairs
+};
+
+
+// Linear reduced model of a mass-spring system around the state x_ref:
+//
+//    u'' = a(x_ref) + a'(x_ref) u,      u = x - x_ref
+//
+// K = -M a'(x_ref) is the tangent stiffness. With the k lowest modes,
+// K Phi = M Phi Lambda and Phi^T M Phi = I, u = Phi q decouples into
+//
+//    q_i'' = -lambda_i q_i + p_i,      p = Phi^T M a(x_ref)
+//
+// which is solved exactly (state), or by any TimeStepper (function). The
+// modes come from shift-invert Lanczos, one band factorization of K - sigma M
+// and one solve per Lanczos step; afterwards a time costs O(k), positions
+// O(k n). The Jacobian must be symmetric after scaling with M, so no
+// constraint projection; the lowest modes of free systems are the rigid
+// body modes with lambda = 0.
+template <int D>
+class ModalReduction
+{
+  size_t m_n;
+  std::vector<double> m_xref, m_mass;
+  EigenPairs m_modes;
+  std::vector<double> m_load;     // p
+  std::vector<double> m_q0, m_v0;
+  ModalError m_error;
+
+  // Phi^T M u, and the relative M-norm of the part of u outside the modes
+  double project (const double * u, double * q) const
+  {
+    size_t k = numModes();
+    double normu = 0;
+    for (size_t i = 0; i < m_n; i++)
+      normu += m_mass[i] * u[i]*u[i];
+    double normq = 0;
+    for (size_t r = 0; r < k; r++)
+      {
+        const double * phi = &m_modes.vectors[r*m_n];
+        double sum = 0;
+        for (size_t i = 0; i < m_n; i++)
+          sum += m_mass[i] * phi[i] * u[i];
+        q[r] = sum;
+        normq += sum*sum;
+      }
+    if (normu == 0) return 0;
+    return std::sqrt(std::max(normu-normq, 0.0) / normu);
+  }
+
+public:
+  // sigma must lie below the lowest eigenvalue, see ShiftInvertLanczos;
+  // sigma = 0 chooses -1e-3 times the mean of K_ii/m_i, which is below the
+  // spectrum at a stable equilibrium (all lambda >= 0)
+  ModalReduction (const MSS_Function<D> & func, VectorView<double> xref, size_t k,
+                  double sigma = 0, double tol = 1e-10)
+    : m_n(xref.size()), m_xref(m_n), m_mass(m_n)
+  {
+    auto & comp = func.compiled();
+    for (size_t i = 0; i < m_n; i++)
+      {
+        m_xref[i] = xref(i);
+        m_mass[i] = comp.mass[i/D];
+      }
+
+    Vector<> a(m_n);
+    func.evaluate (xref, a);
+    SparseMatrix stiffness = func.createJacobian();
+    func.evaluateDerivSparse (xref, stiffness);
+    double meandiag = 0;
+    for (size_t i = 0; i < m_n; i++)
+      {
+        for (size_t l = stiffness.firstInRow(i); l < stiffness.nextInRow(i); l++)
+          stiffness.val(l) *= -m_mass[i];
+        meandiag += stiffness(i,i) / m_mass[i];
+      }
+    if (sigma == 0)
+      sigma = -1e-3 * std::max(std::abs(meandiag) / m_n, 1e-12);
+
+    m_modes = ShiftInvertLanczos (stiffness, m_mass, k, sigma, tol);
+
+    m_load.resize(numModes());
+    m_error.load = project (&a(0), m_load.data());
+    m_error.cutoff = m_modes.next;
+    for (double r : m_modes.residual)
+      m_error.residual = std::max(m_error.residual, r);
+    m_q0.assign(numModes(), 0.0);
+    m_v0.assign(numModes(), 0.0);
+  }
+
+  size_t numModes() const { return m_modes.lambda.size(); }
+  size_t size() const { return m_n; }
+  // omega^2 of the modes, ascending
+  const std::vector<double> & eigenvalues() const { return m_modes.lambda; }
+  // mode r, M-normalized
+  VectorView<double> mode (size_t r) { return VectorView<double>(m_n, &m_modes.vectors[r*m_n]); }
+  const std::vector<double> & load() const { return m_load; }
+  size_t lanczosSteps() const { return m_modes.steps; }
+  const ModalError & error() const { return m_error; }
+
+  // modal coordinates of the full initial state, the parts outside
+  // the modes are reported in error()
+  void setInitial (VectorView<double> x, VectorView<double> v)
+  {
+    std::vector<double> u(m_n), w(m_n);
+    for (size_t i = 0; i < m_n; i++)
+      {
+        u[i] = x(i) - m_xref[i];
+        w[i] = v(i);
+      }
+    m_error.displacement = project (u.data(), m_q0.data());
+    m_error.velocity = project (w.data(), m_v0.data());
+  }
+
+  // exact modal state at time t after setInitial
+  void state (double t, VectorView<double> q, VectorView<double> dq) const
+  {
+    double tiny = 1e-12 * (std::abs(m_modes.lambda.back()) + 1);
+    for (size_t i = 0; i < numModes(); i++)
+      {
+        double lam = m_modes.lambda[i], p = m_load[i];
+        double q0 = m_q0[i], v0 = m_v0[i];
+        if (std::abs(lam) <= tiny)
+          {
+            q(i) = q0 + v0*t + 0.5*p*t*t;
+            dq(i) = v0 + p*t;
+            continue;
+          }
+        double d0 = q0 - p/lam;     // around the static solution
+        if (lam > 0)
+          {
+            double w = std::sqrt(lam), c = std::cos(w*t), s = std::sin(w*t);
+            q(i) = p/lam + d0*c + v0/w*s;
+            dq(i) = -d0*w*s + v0*c;
+          }
+        else
+          {
+            double w = std::sqrt(-lam), c = std::cosh(w*t), s = std::sinh(w*t);
+            q(i) = p/lam + d0*c + v0/w*s;
+            dq(i) = d0*w*s + v0*c;
+          }
+      }
+  }
+
+  // x = x_ref + Phi q
+  void expand (VectorView<double> q, VectorView<double> x) const
+  {
+    for (size_t i = 0; i < m_n; i++)
+      x(i) = m_xref[i];
+    for (size_t r = 0; r < numModes(); r++)
+      {
+        const double * phi = &m_modes.vectors[r*m_n];
+        for (size_t i = 0; i < m_n; i++)
+          x(i) += q(r) * phi[i];
+      }
+  }
+
+  // v = Phi dq
+  void expandVelocity (VectorView<double> dq, VectorView<double> v) const
+  {
+    for (size_t i = 0; i < m_n; i++)
+      v(i) = 0;
+    for (size_t r = 0; r < numModes(); r++)
+      {
+        const double * phi = &m_modes.vectors[r*m_n];
+        for (size_t i = 0; i < m_n; i++)
+          v(i) += dq(r) * phi[i];
+      }
+  }
+
+  // full positions at time t, from the exact modal solution
+  void positions (double t, VectorView<double> x) const
+  {
+    Vector<> q(numModes()), dq(numModes());
+    state (t, q, dq);
+    expand (q, x);
+  }
+
+  // the reduced model for a TimeStepper, and its initial value y = (q0, v0)
+  std::shared_ptr<NonlinearFunction> function() const
+  {
+    return std::make_shared<ModalFunction>(m_modes.lambda, m_load);
+  }
+
+  void initialValue (VectorView<double> y) const
+  {
+    size_t k = numModes();
+    for (size_t i = 0; i < k; i++)
+      {
+        y(i) = m_q0[i];
+        y(k+i) = m_v0[i];
+      }
+  }
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef MSS_GENERATORS_HPP
+#define MSS_GENERATORS_HPP
+
+// Generators for common mass-spring models, built with the bulk functions
+// of MassSpringSystem. Rest lengths are the initial distances. All return
+// the number of the first generated mass, masses are numbered consecutively.
+
+#include <vector>
+#include <array>
+
+#include "mass_spring.hpp"
+
+
+// chain of n masses on the segment from start to end, neighbours connected.
+// With fixstart, the chain hangs from a fix at start and the masses are
+// placed at start + k (end-start)/n,  k = 1..n
+template <int D>
+size_t AddChain (MassSpringSystem<D> & mss, size_t n, Vec<D> start, Vec<D> end,
+                 double mass, double stiffness, bool fixstart = true)
+{
+  std::vector<double> pos(D*n);
+  for (size_t k = 0; k < n; k++)
+    {
+      double t = fixstart ? double(k+1)/n : (n > 1 ? double(k)/(n-1) : 0.0);
+      for (int a = 0; a < D; a++)
+        pos[D*k+a] = (1-t)*start(a) + t*end(a);
+    }
+  size_t first = mss.addMasses (n, pos.data(), &mass, 0);
+
+  std::vector<size_t> pairs;
+  pairs.reserve(2*n);
+  for (size_t k = first; k+1 < first+n; k++)
+    {
+      pairs.push_back(k);
+      pairs.push_back(k+1);
+    }
+  mss.addSprings (pairs.size()/2, pairs.data(), nullptr, 0, &stiffness, 0);
+
+  if (fixstart && n > 0)
+    {
+      size_t fix = mss.addFixes (1, start.data());
+      size_t fixpair[2] = { fix, first };
+      mss.addSprings (1, fixpair, nullptr, 0, &stiffness, 0, Connector::FIX, Connector::MASS);
+    }
+  return first;
+}
+
+
+// collect springs from a regular grid: mass (i,j,k) connected to (i,j,k)+offset
+inline void GridSprings (std::array<size_t,3> dims, const std::vector<std::array<int,3>> & offsets,
+                  size_t first, std::vector<size_t> & pairs)
+{
+  auto index = [&](size_t i, size_t j, size_t k) { return first + (k*dims[1]+j)*dims[0]+i; };
+  for (size_t k = 0; k < dims[2]; k++)
+    for (size_t j = 0; j < dims[1]; j++)
+      for (size_t i = 0; i < dims[0]; i++)
+        for (auto & off : offsets)
+          {
+            long i2 = long(i)+off[0], j2 = long(j)+off[1], k2 = long(k)+off[2];
+            if (i2 < 0 || j2 < 0 || k2 < 0 ||
+                i2 >= long(dims[0]) || j2 >= long(dims[1]) || k2 >= long(dims[2])) continue;
+            pairs.push_back (index(i,j,k));
+            pairs.push_back (index(i2,j2,k2));
+          }
+}
+
+
+// nx x ny cloth, mass (i,j) at origin + i e1 + j e2, number first + j*nx + i.
+// Structural springs to the grid neighbours, shear springs along the
+// diagonals, bending springs to the second neighbours.
+template <int D>
+size_t AddCloth (MassSpringSystem<D> & mss, size_t nx, size_t ny,
+                 Vec<D> origin, Vec<D> e1, Vec<D> e2,
+                 double mass, double stiffness, bool shear = true, bool bend = false)
+{
+  std::vector<double> pos(D*nx*ny);
+  for (size_t j = 0; j < ny; j++)
+    for (size_t i = 0; i < nx; i++)
+      for (int a = 0; a < D; a++)
+        pos[D*(j*nx+i)+a] = origin(a) + double(i)*e1(a) + double(j)*e2(a);
+  size_t first = mss.addMasses (nx*ny, pos.data(), &mass, 0);
+
+  std::vector<std::array<int,3>> offsets { {1,0,0}, {0,1,0} };
+  if (shear)
+    offsets.insert (offsets.end(), { {1,1,0}, {1,-1,0} });
+  if (bend)
+    offsets.insert (offsets.end(), { {2,0,0}, {0,2,0} });
+
+  std::vector<size_t> pairs;
+  GridSprings ( { nx, ny, 1 }, offsets, first, pairs);
+  mss.addSprings (pairs.size()/2, pairs.data(), nullptr, 0, &stiffness, 0);
+  return first;
+}
+
+
+// nx x ny x nz lattice with the given spacing, mass (i,j,k) number
+// first + (k*ny+j)*nx+i. Springs to the axis neighbours, optionally to the
+// face diagonals and to the second neighbours along the axes.
+inline size_t AddLattice (MassSpringSystem<3> & mss, size_t nx, size_t ny, size_t nz,
+                          Vec<3> origin, double spacing,
+                          double mass, double stiffness, bool diagonals = false, bool bend = false)
+{
+  size_t n = nx*ny*nz;
+  std::vector<double> pos(3*n);
+  for (size_t k = 0; k < nz; k++)
+    for (size_t j = 0; j < ny; j++)
+      for (size_t i = 0; i < nx; i++)
+        {
+          size_t nr = (k*ny+j)*nx+i;
+          pos[3*nr+0] = origin(0) + spacing*i;
+          pos[3*nr+1] = origin(1) + spacing*j;
+          pos[3*nr+2] = origin(2) + spacing*k;
+        }
+  size_t first = mss.addMasses (n, pos.data(), &mass, 0);
+
+  std::vector<std::array<int,3>> offsets { {1,0,0}, {0,1,0}, {0,0,1} };
+  if (diagonals)
+    offsets.insert (offsets.end(), { {1,1,0}, {1,-1,0}, {1,0,1}, {1,0,-1}, {0,1,1}, {0,1,-1} });
+  if (bend)
+    offsets.insert (offsets.end(), { {2,0,0}, {0,2,0}, {0,0,2} });
+
+  std::vector<size_t> pairs;
+  GridSprings ( { nx, ny, nz }, offsets, first, pairs);
+  mss.reserve (0, 0, pairs.size()/2);
+  mss.addSprings (pairs.size()/2, pairs.data(), nullptr, 0, &stiffness, 0);
+  return first;
+}
+
+#endif
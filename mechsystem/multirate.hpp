@@ -0,0 +1,262 @@
+#ifndef MULTIRATE_HPP
+#define MULTIRATE_HPP
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <stdexcept>
+#include <functional>
+
+#include "mass_spring.hpp"
+
+
+// Multirate (r-RESPA, impulse) method for mass-spring systems with stiff
+// and soft springs. The springs are split into a fast and a slow group,
+// contacts are slow. Gravity is fast on the masses of fast springs, as an
+// impulse it would excite stiff springs to fixes. With the outer step dt
+// and m substeps:
+//
+//    v += dt/2 a_slow(x)
+//    m times velocity Verlet with dt/m on a_fast
+//    v += dt/2 a_slow(x)
+//
+// The slow forces act as impulses at the ends of the outer step, the
+// method is explicit, symplectic and time reversible, so the energy error
+// stays bounded. Slow springs are evaluated once per outer step, fast ones
+// m times, and the substeps only touch the masses of fast springs, the
+// other masses move with constant velocity during the step.
+//
+// Distance constraints are not supported, the sequential projection
+// needs the total force.
+template <int D>
+class MultirateStepper
+{
+  std::unique_ptr<MassSpringSystem<D>> m_slowsys, m_fastsys;
+  std::unique_ptr<MSS_Function<D>> m_slow, m_fast;
+  std::vector<size_t> m_fastrow;     // state row in the full system of fast mass k
+  size_t m_substeps;
+  double m_gravity[D];
+
+  std::vector<double> m_x, m_v, m_fslow;   // full system, state order
+  std::vector<double> m_xf, m_vf, m_ffast; // masses of fast springs
+  bool m_fslowvalid = false;
+  bool m_ffastvalid = false;
+  double m_t = 0;
+  size_t m_numslow = 0, m_numfast = 0;
+
+  static VectorView<double> view (std::vector<double> & vec) { return VectorView<double>(vec.size(), vec.data()); }
+
+  void evaluateSlow ()
+  {
+    m_slow->evaluate (view(m_x), view(m_fslow));
+    for (size_t row : m_fastrow)
+      for (int a = 0; a < D; a++)
+        m_fslow[D*row+a] -= m_gravity[a];
+    m_fslowvalid = true;
+    m_numslow++;
+  }
+
+  void evaluateFast ()
+  {
+    if (m_xf.size())
+      m_fast->evaluate (view(m_xf), view(m_ffast));
+    m_ffastvalid = true;
+    m_numfast++;
+  }
+
+public:
+  // fast[s] selects the springs of the fast group, see Partition* below
+  MultirateStepper (const MassSpringSystem<D> & mss, const std::vector<bool> & fast, size_t substeps)
+    : m_substeps(std::max<size_t>(substeps, 1))
+  {
+    if (mss.constraints().size())
+      throw std::invalid_argument("MultirateStepper: distance constraints are not supported");
+    auto & springs = mss.springs();
+    if (fast.size() != springs.size())
+      throw std::invalid_argument("MultirateStepper: need one flag per spring");
+
+    // slow: the system without the fast springs
+    m_slowsys = std::make_unique<MassSpringSystem<D>>(mss);
+    m_slowsys->clearSprings();
+    for (size_t s = 0; s < springs.size(); s++)
+      if (!fast[s]) m_slowsys->addSpring (springs[s]);
+
+    // fast: the masses of fast springs, renumbered in state order, and all fixes
+    size_t nm = mss.numMasses();
+    std::vector<bool> isfast(nm, false);
+    for (size_t s = 0; s < springs.size(); s++)
+      if (fast[s])
+        for (auto c : springs[s].connectors)
+          if (c.type == Connector::MASS) isfast[c.nr] = true;
+
+    std::vector<size_t> bystate(nm);
+    for (size_t i = 0; i < nm; i++)
+      bystate[mss.massIndex(i)] = i;
+    std::vector<size_t> fastnr(nm, size_t(-1));
+    m_fastsys = std::make_unique<MassSpringSystem<D>>();
+    m_fastsys->setGravity (mss.getGravity());
+    for (int a = 0; a < D; a++)
+      m_gravity[a] = mss.getGravity()(a);
+    for (auto & f : mss.fixes())
+      m_fastsys->addFix (f);
+    for (size_t row = 0; row < nm; row++)
+      if (isfast[bystate[row]])
+        {
+          size_t i = bystate[row];
+          fastnr[i] = m_fastrow.size();
+          m_fastrow.push_back (row);
+          m_fastsys->addMass (mss.mass(Connector{Connector::MASS, i}));
+        }
+    for (size_t s = 0; s < springs.size(); s++)
+      if (fast[s])
+        {
+          Spring sp = springs[s];
+          for (auto & c : sp.connectors)
+            if (c.type == Connector::MASS) c.nr = fastnr[c.nr];
+          m_fastsys->addSpring (sp);
+        }
+
+    m_slow = std::make_unique<MSS_Function<D>>(*m_slowsys);
+    m_fast = std::make_unique<MSS_Function<D>>(*m_fastsys);
+
+    m_x.resize(D*nm); m_v.resize(D*nm); m_fslow.resize(D*nm);
+    size_t nf = m_fastrow.size();
+    m_xf.resize(D*nf); m_vf.resize(D*nf); m_ffast.resize(D*nf);
+  }
+
+  // Springs whose frequency sqrt(k (1/m1 + 1/m2)) times dt exceeds maxphase,
+  // and all other springs at their masses. Without this layer the slow
+  // springs kick the stiff masses directly, and the impulses resonate
+  // with the fast modes.
+  static std::vector<bool> PartitionByStiffness (const MassSpringSystem<D> & mss, double dt,
+                                                 double maxphase = 0.5)
+  {
+    std::vector<size_t> stiffmasses;
+    for (auto & sp : mss.springs())
+      {
+        double winv = 0;
+        for (auto c : sp.connectors)
+          if (c.type == Connector::MASS)
+            winv += 1.0 / mss.massValue(c.nr);
+        if (std::sqrt(sp.stiffness * winv) * dt > maxphase)
+          for (auto c : sp.connectors)
+            if (c.type == Connector::MASS) stiffmasses.push_back (c.nr);
+      }
+    return PartitionByMasses (mss, stiffmasses);
+  }
+
+  // all springs at one of the tagged masses
+  static std::vector<bool> PartitionByMasses (const MassSpringSystem<D> & mss,
+                                              const std::vector<size_t> & masses)
+  {
+    std::vector<bool> tagged(mss.numMasses(), false);
+    for (size_t i : masses)
+      tagged.at(i) = true;
+    std::vector<bool> fast;
+    for (auto & sp : mss.springs())
+      {
+        bool f = false;
+        for (auto c : sp.connectors)
+          f = f || (c.type == Connector::MASS && tagged[c.nr]);
+        fast.push_back (f);
+      }
+    return fast;
+  }
+
+  // Substeps such that omega dt/m <= maxphase for the local frequencies
+  // omega^2 = sum k / m of the masses in the fast group.
+  static size_t Substeps (const MassSpringSystem<D> & mss, const std::vector<bool> & fast,
+                          double dt, double maxphase = 0.5)
+  {
+    std::vector<double> ksum(mss.numMasses(), 0.0);
+    auto & springs = mss.springs();
+    for (size_t s = 0; s < springs.size(); s++)
+      if (fast[s])
+        for (auto c : springs[s].connectors)
+          if (c.type == Connector::MASS)
+            ksum[c.nr] += springs[s].stiffness;
+    double wmax = 0;
+    for (size_t i = 0; i < ksum.size(); i++)
+      wmax = std::max(wmax, std::sqrt(ksum[i] / mss.massValue(i)));
+    return std::max<size_t>(1, size_t(std::ceil(wmax * dt / maxphase)));
+  }
+
+  void setState (VectorView<double> x, VectorView<double> v)
+  {
+    for (size_t i = 0; i < m_x.size(); i++)
+      {
+        m_x[i] = x(i);
+        m_v[i] = v(i);
+      }
+    for (size_t k = 0; k < m_fastrow.size(); k++)
+      for (int a = 0; a < D; a++)
+        m_xf[D*k+a] = m_x[D*m_fastrow[k]+a];
+    m_fslowvalid = m_ffastvalid = false;
+  }
+
+  void setTime (double t) { m_t = t; }
+  double time() const { return m_t; }
+  VectorView<double> position() { return view(m_x); }
+  VectorView<double> velocity() { return view(m_v); }
+
+  size_t substeps() const { return m_substeps; }
+  size_t numFastMasses() const { return m_fastrow.size(); }
+  // evaluations of the slow and the fast forces
+  size_t numSlowEvaluations() const { return m_numslow; }
+  size_t numFastEvaluations() const { return m_numfast; }
+
+  void doStep (double dt)
+  {
+    const size_t n = m_x.size(), nf = m_fastrow.size();
+    const double h = dt / m_substeps;
+    if (!m_fslowvalid) evaluateSlow();
+    if (!m_ffastvalid) evaluateFast();
+
+    for (size_t i = 0; i < n; i++)
+      m_v[i] += 0.5*dt * m_fslow[i];
+
+    for (size_t k = 0; k < nf; k++)
+      for (int a = 0; a < D; a++)
+        m_vf[D*k+a] = m_v[D*m_fastrow[k]+a];
+
+    for (size_t sub = 0; sub < m_substeps; sub++)
+      {
+        for (size_t i = 0; i < D*nf; i++)
+          {
+            m_vf[i] += 0.5*h * m_ffast[i];
+            m_xf[i] += h * m_vf[i];
+          }
+        evaluateFast();
+        for (size_t i = 0; i < D*nf; i++)
+          m_vf[i] += 0.5*h * m_ffast[i];
+      }
+
+    // masses without fast springs: constant velocity, fast ones from the substeps
+    for (size_t i = 0; i < n; i++)
+      m_x[i] += dt * m_v[i];
+    for (size_t k = 0; k < nf; k++)
+      for (int a = 0; a < D; a++)
+        {
+          m_x[D*m_fastrow[k]+a] = m_xf[D*k+a];
+          m_v[D*m_fastrow[k]+a] = m_vf[D*k+a];
+        }
+
+    evaluateSlow();
+    for (size_t i = 0; i < n; i++)
+      m_v[i] += 0.5*dt * m_fslow[i];
+    m_t += dt;
+  }
+
+  void solve (double tend, int steps,
+              std::function<void(double,VectorView<double>)> callback = nullptr)
+  {
+    double dt = tend/steps;
+    for (int i = 0; i < steps; i++)
+      {
+        doStep(dt);
+        if (callback) callback(m_t, view(m_x));
+      }
+  }
+};
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef SIMULATOR_HPP
+#define SIMULATOR_HPP
+
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <limits>
+
+#include "mass_spring.hpp"
+#include "Newmark.hpp"
+#include "checkpoint.hpp"
+
+
+// Fixed-size ring buffer of position frames, for one producer and any
+// number of readers. Full buffers overwrite the oldest frame, readers
+// always get the newest one, so a slow reader never blocks the producer
+// for longer than one frame copy.
+class FrameRing
+{
+  size_t m_framesize;
+  size_t m_capacity;
+  std::vector<double> m_data;     // capacity x framesize
+  std::vector<double> m_time;
+  size_t m_written = 0;           // number of frames pushed so far
+  mutable std::mutex m_mutex;
+
+public:
+  FrameRing (size_t capacity, size_t framesize)
+    : m_framesize(framesize), m_capacity(std::max<size_t>(capacity, 1)),
+      m_data(m_capacity*framesize), m_time(m_capacity) { }
+
+  size_t frameSize() const { return m_framesize; }
+  size_t capacity() const { return m_capacity; }
+
+  size_t numWritten() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+  }
+
+  void push (double t, const double * frame)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t slot = m_written % m_capacity;
+    std::copy (frame, frame+m_framesize, m_data.begin()+slot*m_framesize);
+    m_time[slot] = t;
+    m_written++;
+  }
+
+  // copy the newest frame, returns its number (counting from 1),
+  // or 0 if nothing was pushed yet
+  size_t latest (double & t, double * frame) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_written == 0) return 0;
+    size_t slot = (m_written-1) % m_capacity;
+    std::copy (m_data.begin()+slot*m_framesize, m_data.begin()+(slot+1)*m_framesize, frame);
+    t = m_time[slot];
+    return m_written;
+  }
+};
+
+
+// Persistent simulation of a MassSpringSystem: owns the rhs, the stepper
+// with its state and work vectors, so advancing does not allocate and
+// does not go through getState/setState.
+//
+// advance integrates in the calling thread and writes the state back to
+// the system. start integrates in a background thread, in chunks of
+// 'steps' time steps, and pushes the positions after each chunk into the
+// frame ring; the system gets the state at stop. While running, the model
+// must not be changed: the rhs keeps its compiled data, and stop throws if
+// the model version changed in between. The number of masses is fixed at
+// construction.
+template <int D>
+class Simulator
+{
+  MassSpringSystem<D> & m_mss;
+  size_t m_nummasses;             // the stepper and frames are sized for it
+  size_t m_startversion = 0;      // model version at start
+  std::shared_ptr<MSS_Function<D>> m_func;
+  std::unique_ptr<GeneralizedAlphaStepper> m_stepper;
+  FrameRing m_frames;
+  std::vector<double> m_frame;    // positions in insertion order
+
+  std::thread m_thread;
+  std::atomic<bool> m_stop { false };
+  std::atomic<bool> m_running { false };
+  std::atomic<double> m_time { 0 };    // of the last frame, readable while running
+  std::exception_ptr m_error;
+
+  size_t m_diagevery = 0;         // record diagnostics every m_diagevery steps
+  size_t m_stepcount = 0;
+  DiagnosticsSeries<D> m_diagnostics;
+  mutable std::mutex m_diagmutex;
+
+  void recordDiagnostics ()
+  {
+    auto diag = m_func->diagnostics (m_stepper->position(), m_stepper->velocity());
+    diag.t = m_stepper->time();
+    std::lock_guard<std::mutex> lock(m_diagmutex);
+    m_diagnostics.add (diag);
+  }
+
+  // for the callback of the stepper, after every step
+  void afterStep ()
+  {
+    if (m_diagevery && ++m_stepcount % m_diagevery == 0)
+      recordDiagnostics();
+  }
+
+  void solveChunk (double dt, size_t steps)
+  {
+    if (m_diagevery)
+      m_stepper->solve (dt, steps, [this] (double, VectorView<double>) { afterStep(); });
+    else
+      m_stepper->solve (dt, steps);
+  }
+
+  void checkModel () const
+  {
+    if (m_mss.numMasses() != m_nummasses)
+      throw std::logic_error("Simulator: the number of masses changed, create a new Simulator");
+  }
+
+  // join a finished background run and release the model
+  void finishRun ()
+  {
+    if (m_thread.joinable()) m_thread.join();
+    if (m_func->modelLocked())
+      {
+        m_func->lockModel (false);
+        if (m_mss.version() != m_startversion)
+          throw std::logic_error("Simulator: the model was changed while running");
+      }
+  }
+
+  void publish ()
+  {
+    auto x = m_stepper->position();
+    for (size_t i = 0; i < m_nummasses; i++)
+      for (int a = 0; a < D; a++)
+        m_frame[D*i+a] = x(D*m_mss.massIndex(i)+a);
+    m_time = m_stepper->time();
+    m_frames.push (m_time, m_frame.data());
+  }
+
+public:
+  Simulator (MassSpringSystem<D> & mss, double rhoinf = 0.8, size_t ringsize = 4)
+    : m_mss(mss), m_nummasses(mss.numMasses()), m_func(std::make_shared<MSS_Function<D>>(mss)),
+      m_frames(ringsize, D*mss.numMasses()), m_frame(D*mss.numMasses())
+  {
+    size_t n = D*mss.numMasses();
+    m_stepper = std::make_unique<GeneralizedAlphaStepper>
+      (m_func, std::make_shared<IdentityMass>(n), rhoinf);
+
+    Vector<> x(n), v(n), a(n);
+    mss.getState (x, v, a);
+    m_stepper->setState (x, v, a);
+    m_time = m_stepper->time();
+  }
+
+  ~Simulator ()
+  {
+    if (m_thread.joinable()) { m_stop = true; m_thread.join(); }
+    m_func->lockModel (false);
+  }
+
+  Simulator (const Simulator &) = delete;
+  Simulator & operator= (const Simulator &) = delete;
+
+  GeneralizedAlphaStepper & stepper() { return *m_stepper; }
+  MSS_Function<D> & function() { return *m_func; }
+  const FrameRing & frames() const { return m_frames; }
+  double time() const { return m_time; }
+  bool running() const { return m_running; }
+
+  // copy the stepper state to the masses of the system
+  void syncToSystem ()
+  {
+    checkModel();
+    m_mss.setState (m_stepper->position(), m_stepper->velocity(), m_stepper->acceleration());
+  }
+
+  // integrate over the time interval dt with the given number of steps
+  void advance (double dt, size_t steps)
+  {
+    if (m_running)
+      throw std::logic_error("Simulator: running in background");
+    finishRun();
+    checkModel();
+    solveChunk (dt, steps);
+    syncToSystem();
+    publish();
+  }
+
+  // integrate in a background thread until stop, or time() >= tend
+  void start (double dt, size_t steps, double tend = std::numeric_limits<double>::max())
+  {
+    if (m_running)
+      throw std::logic_error("Simulator: already running");
+    finishRun();
+    checkModel();
+    m_startversion = m_mss.version();
+    m_func->lockModel (true);
+    m_stop = false;
+    m_error = nullptr;
+    m_running = true;
+    m_thread = std::thread([this, dt, steps, tend]()
+    {
+      try
+        {
+          while (!m_stop && m_stepper->time() < tend)
+            {
+              solveChunk (dt, steps);
+              publish();
+            }
+        }
+      catch (...)
+        {
+          m_error = std::current_exception();
+        }
+      m_running = false;
+    });
+  }
+
+  // Record energies and momentum every 'every' steps, 0 switches off.
+  // The potentials are computed in the force loops, see MSS_Function::diagnostics.
+  // Starts a new series with the current state.
+  void setDiagnostics (size_t every)
+  {
+    if (m_running)
+      throw std::logic_error("Simulator: running in background");
+    finishRun();
+    m_diagevery = every;
+    m_stepcount = 0;
+    m_func->setDiagnostics (every > 0);
+    {
+      std::lock_guard<std::mutex> lock(m_diagmutex);
+      m_diagnostics = DiagnosticsSeries<D>();
+    }
+    if (every)
+      {
+        Vector<> f(m_func->dimF());
+        m_func->evaluate (m_stepper->position(), f);
+        recordDiagnostics();
+      }
+  }
+
+  DiagnosticsSeries<D> diagnostics () const
+  {
+    std::lock_guard<std::mutex> lock(m_diagmutex);
+    return m_diagnostics;
+  }
+
+  // save the model with the stepper state, for restarts
+  void checkpoint (const std::string & filename)
+  {
+    if (m_running)
+      throw std::logic_error("Simulator: running in background");
+    finishRun();
+    syncToSystem();
+    StepperState state = GetStepperState(*m_stepper);
+    SaveCheckpoint (filename, m_mss, &state);
+  }
+
+  // continue from the stepper state in a checkpoint of the same model
+  void restore (const std::string & filename)
+  {
+    if (m_running)
+      throw std::logic_error("Simulator: running in background");
+    finishRun();
+    checkModel();
+    MassSpringSystem<D> saved;
+    StepperState state;
+    LoadCheckpoint (filename, saved, &state);
+    if (state.x.empty())
+      throw std::runtime_error("checkpoint: no stepper state in '"+filename+"'");
+    SetStepperState (*m_stepper, state);
+    m_time = state.t;
+    syncToSystem();
+  }
+
+  // end the background integration after the current chunk, write the state
+  // to the system, and rethrow an exception of the integration
+  void stop ()
+  {
+    m_stop = true;
+    finishRun();
+    syncToSystem();
+    if (m_error)
+      {
+        auto error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+      }
+  }
+};
+
+#endif
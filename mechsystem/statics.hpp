@@ -0,0 +1,370 @@
+#ifndef STATICS_HPP
+#define STATICS_HPP
+
+#include <vector>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+
+#include <bandmatrix.hpp>
+#include <inverse.hpp>
+#include "mass_spring.hpp"
+
+
+struct StaticOptions
+{
+  double tol = 1e-10;       // net force relative to the weight, constraints relative to length^2
+  int maxit = 50;           // Newton iterations per load step
+  int loadsteps = 1;        // initial number of gravity increments
+  int maxloadsteps = 1024;  // finest increment 1/maxloadsteps
+  bool sparse = true;       // band LU of the stiffness, else dense inverse
+};
+
+struct StaticInfo
+{
+  int iterations = 0;       // Newton iterations of the accepted load steps
+  int loadsteps = 0;        // accepted load steps
+  double residual = 0;      // net force relative to the weight
+};
+
+
+// Static equilibrium of a mass-spring system: positions x and multipliers
+// lambda of the distance constraints with
+//
+//    F(x) + G(x)^T lambda = 0,    g(x) = 0
+//
+// F the spring, contact and gravity forces. Newton's method uses the tangent
+// stiffness H = -dF/dx (with the curvature of the constraint forces) and
+// eliminates the multipliers by the Schur complement G H^{-1} G^T, so it is
+// meant for few constraints. Robustness:
+//  - line search on the augmented Lagrangian (potential energy, multiplier
+//    and penalty term of the constraints), so iterations go downhill and
+//    find stable equilibria,
+//  - H + mu M for indefinite or singular H (e.g. unstretched chains, which
+//    have no transverse stiffness), mu shrinks again after full steps,
+//  - continuation in gravity, the increment is halved when Newton fails.
+// The sparse path factors H as band matrix in the bandwidth-reducing state
+// numbering, the dense path inverts it.
+template <int D>
+class StaticSolver
+{
+  MassSpringSystem<D> & m_mss;
+  MSS_Function<D> m_func;
+  MSS_Constraints<D> m_constr;
+  StaticOptions m_opts;
+  size_t m_n, m_nc;
+  std::vector<double> m_mass;            // per unknown, state order
+  std::vector<double> m_gravity;         // per unknown
+  std::vector<double> m_cscale;          // 1/(L^2/2) of the constraints
+  std::vector<double> m_lambda;
+  double m_penalty = 0;
+
+  // work vectors
+  std::vector<double> m_a, m_force, m_g, m_res, m_dx, m_dlambda, m_xtrial, m_zero;
+  SparseMatrix m_G;
+
+  static VectorView<double> view (std::vector<double> & vec) { return VectorView<double>(vec.size(), vec.data()); }
+
+  // forces F at load factor s, the constraint values, and the potential energy
+  double evaluate (std::vector<double> & x, double s)
+  {
+    m_func.evaluate (view(x), view(m_a));
+    for (size_t i = 0; i < m_n; i++)
+      m_force[i] = m_mass[i] * (m_a[i] - (1-s) * m_gravity[i]);
+    auto diag = m_func.diagnostics (view(x), view(m_zero));
+    if (m_nc)
+      m_constr.evaluate (view(x), view(m_g));
+    return diag.spring + diag.contact + s * diag.gravity;
+  }
+
+  // augmented Lagrangian  energy - lambda.g + penalty/2 |g|^2, for the line search
+  double merit (double energy, const std::vector<double> & lambda) const
+  {
+    double sum = 0;
+    for (size_t c = 0; c < m_nc; c++)
+      sum += 0.5 * m_penalty * m_g[c]*m_g[c] - lambda[c] * m_g[c];
+    return energy + sum;
+  }
+
+  // |F + G^T lambda|_{M^-1} and the largest relative constraint violation
+  std::array<double,2> residual (std::vector<double> & x)
+  {
+    m_res = m_force;
+    if (m_nc)
+      {
+        m_constr.evaluateJacobian (view(x), m_G);
+        for (size_t c = 0; c < m_nc; c++)
+          for (size_t k = m_G.firstInRow(c); k < m_G.nextInRow(c); k++)
+            m_res[m_G.colNr(k)] += m_G.val(k) * m_lambda[c];
+      }
+    double sum = 0, viol = 0;
+    for (size_t i = 0; i < m_n; i++)
+      sum += m_res[i]*m_res[i] / m_mass[i];
+    for (size_t c = 0; c < m_nc; c++)
+      viol = std::max(viol, std::abs(m_g[c]) * m_cscale[c]);
+    return { std::sqrt(sum), viol };
+  }
+
+  // tangent stiffness H + mu M, in the pattern of the Jacobian and the constraint curvature
+  SparseMatrix stiffness (std::vector<double> & x, double mu)
+  {
+    auto entries = m_func.createJacobian().entries();
+    for (auto & con : m_mss.constraints())
+      for (auto c1 : con.connectors)
+        for (auto c2 : con.connectors)
+          if (c1.type == Connector::MASS && c2.type == Connector::MASS)
+            for (int a = 0; a < D; a++)
+              for (int b = 0; b < D; b++)
+                entries.push_back ( { D*m_mss.massIndex(c1.nr)+a, D*m_mss.massIndex(c2.nr)+b } );
+    SparseMatrix h(m_n, m_n, std::move(entries));
+    m_func.evaluateDerivSparse (view(x), h);
+    if (m_nc)
+      m_constr.addForceDeriv (view(x), view(m_lambda), h, 1);
+    for (size_t i = 0; i < m_n; i++)
+      {
+        for (size_t k = h.firstInRow(i); k < h.nextInRow(i); k++)
+          h.val(k) *= -m_mass[i];
+        h(i,i) += mu * m_mass[i];
+      }
+    return h;
+  }
+
+  // Newton direction for the current residual, false if the matrix is singular
+  bool direction (const SparseMatrix & h)
+  {
+    std::vector<double> cols(m_nc * m_n, 0.0);    // H^{-1} G^T
+    for (size_t c = 0; c < m_nc; c++)
+      for (size_t k = m_G.firstInRow(c); k < m_G.nextInRow(c); k++)
+        cols[c*m_n + m_G.colNr(k)] = m_G.val(k);
+    m_dx = m_res;
+
+    if (m_opts.sparse)
+      {
+        auto [kl, ku] = h.bandwidth();
+        BandMatrix band(m_n, kl, ku);
+        for (size_t i = 0; i < m_n; i++)
+          for (size_t k = h.firstInRow(i); k < h.nextInRow(i); k++)
+            band(i, h.colNr(k)) = h.val(k);
+        try { band.factorLU(); }
+        catch (std::domain_error &) { return false; }
+        band.solveLU (view(m_dx));
+        for (size_t c = 0; c < m_nc; c++)
+          band.solveLU (VectorView<double>(m_n, &cols[c*m_n]));
+      }
+    else
+      {
+        Matrix<> inv(m_n, m_n);
+        inv = 0.0;
+        h.addTo (inv);
+        try { calcInverse (inv); }
+        catch (std::exception &) { return false; }
+        std::vector<double> tmp(m_n);
+        auto apply = [&](double * v)
+        {
+          for (size_t i = 0; i < m_n; i++)
+            {
+              double sum = 0;
+              for (size_t j = 0; j < m_n; j++) sum += inv(i,j) * v[j];
+              tmp[i] = sum;
+            }
+          std::copy (tmp.begin(), tmp.end(), v);
+        };
+        apply (m_dx.data());
+        for (size_t c = 0; c < m_nc; c++)
+          apply (&cols[c*m_n]);
+      }
+
+    if (m_nc)
+      {
+        // G H^{-1} G^T dlambda = -g - G dx0,  dx = dx0 + H^{-1} G^T dlambda
+        Matrix<> schur(m_nc, m_nc);
+        for (size_t c = 0; c < m_nc; c++)
+          {
+            double gdx = 0;
+            for (size_t k = m_G.firstInRow(c); k < m_G.nextInRow(c); k++)
+              gdx += m_G.val(k) * m_dx[m_G.colNr(k)];
+            m_dlambda[c] = -m_g[c] - gdx;
+          }
+        for (size_t c = 0; c < m_nc; c++)
+          for (size_t d = 0; d < m_nc; d++)
+            {
+              double sum = 0;
+              for (size_t k = m_G.firstInRow(c); k < m_G.nextInRow(c); k++)
+                sum += m_G.val(k) * cols[d*m_n + m_G.colNr(k)];
+              schur(c,d) = sum;
+            }
+        try { calcInverse (schur); }
+        catch (std::exception &) { return false; }
+        std::vector<double> rhs = m_dlambda;
+        for (size_t c = 0; c < m_nc; c++)
+          {
+            double sum = 0;
+            for (size_t d = 0; d < m_nc; d++) sum += schur(c,d) * rhs[d];
+            m_dlambda[c] = sum;
+          }
+        for (size_t c = 0; c < m_nc; c++)
+          for (size_t i = 0; i < m_n; i++)
+            m_dx[i] += cols[c*m_n+i] * m_dlambda[c];
+      }
+
+    for (double d : m_dx)
+      if (!std::isfinite(d)) return false;
+    return true;
+  }
+
+  // Newton at load factor s, x and lambda are updated only on success
+  bool newton (std::vector<double> & x, double s, double scale, StaticInfo & info)
+  {
+    std::vector<double> xk = x, lambda0 = m_lambda;
+    double mu = 0, mu0 = 0;
+    for (int it = 0; it <= m_opts.maxit; it++)
+      {
+        double energy = evaluate (xk, s);
+        auto [res, viol] = residual (xk);
+        if (res <= m_opts.tol * scale && viol <= m_opts.tol)
+          {
+            x = xk;
+            info.iterations += it;
+            info.residual = res / scale;
+            return true;
+          }
+        if (it == m_opts.maxit) break;
+
+        bool accepted = false;
+        while (!accepted)
+          {
+            SparseMatrix h = stiffness (xk, mu);
+            if (mu0 == 0)
+              {
+                for (size_t i = 0; i < m_n; i++)
+                  mu0 += std::abs(h(i,i)) / m_mass[i];
+                mu0 = std::max(1e-8 * mu0 / m_n, 1e-300);
+              }
+
+            // descent of the merit function with the new multipliers lambda+dlambda:
+            // slope = -dx.H dx - penalty |g|^2 < 0
+            double slope = 0, g2 = 0;
+            bool ok = direction (h);
+            std::vector<double> lambdanew(m_nc);
+            if (ok)
+              {
+                for (size_t i = 0; i < m_n; i++)
+                  slope -= m_force[i] * m_dx[i];
+                for (size_t c = 0; c < m_nc; c++)
+                  {
+                    lambdanew[c] = m_lambda[c] + m_dlambda[c];
+                    slope += lambdanew[c] * m_g[c];
+                    g2 += m_g[c]*m_g[c];
+                  }
+                if (g2 > 0 && slope - m_penalty*g2 >= 0)
+                  m_penalty = 2*slope/g2 + 1;
+                slope -= m_penalty * g2;
+                ok = slope < 0;
+              }
+
+            if (ok)
+              {
+                double phi0 = merit (energy, lambdanew);
+                for (double alpha = 1; alpha > 1e-6; alpha *= 0.5)
+                  {
+                    for (size_t i = 0; i < m_n; i++)
+                      m_xtrial[i] = xk[i] + alpha * m_dx[i];
+                    double phi = merit (evaluate (m_xtrial, s), lambdanew);
+                    if (std::isfinite(phi) && phi <= phi0 + 1e-4 * alpha * slope)
+                      {
+                        xk = m_xtrial;
+                        for (size_t c = 0; c < m_nc; c++)
+                          m_lambda[c] += alpha * m_dlambda[c];
+                        accepted = true;
+                        if (alpha == 1) mu = (mu > 10*mu0) ? mu/10 : 0;
+                        break;
+                      }
+                  }
+              }
+
+            if (!accepted)
+              {
+                mu = (mu == 0) ? mu0 : 10*mu;
+                if (mu > 1e20 * mu0)
+                  {
+                    m_lambda = lambda0;
+                    return false;
+                  }
+                evaluate (xk, s);
+                residual (xk);
+              }
+          }
+      }
+    m_lambda = lambda0;
+    return false;
+  }
+
+public:
+  StaticSolver (MassSpringSystem<D> & mss, StaticOptions opts = StaticOptions())
+    : m_mss(mss), m_func(mss), m_constr(mss), m_opts(opts),
+      m_n(D*mss.numMasses()), m_nc(mss.constraints().size()),
+      m_mass(m_n), m_gravity(m_n), m_lambda(m_nc, 0.0),
+      m_a(m_n), m_force(m_n), m_g(m_nc), m_res(m_n), m_dx(m_n), m_dlambda(m_nc),
+      m_xtrial(m_n), m_zero(m_n, 0.0), m_G(m_constr.createJacobian())
+  {
+    m_func.setConstraintProjection (false);
+    m_func.setDiagnostics (true);
+    for (size_t i = 0; i < mss.numMasses(); i++)
+      for (int a = 0; a < D; a++)
+        {
+          m_mass[D*mss.massIndex(i)+a] = mss.massValue(i);
+          m_gravity[D*mss.massIndex(i)+a] = mss.getGravity()(a);
+        }
+    for (auto & con : mss.constraints())
+      m_cscale.push_back (2 / std::max(con.length*con.length, 1e-300));
+  }
+
+  // multipliers of the constraints at the equilibrium, the constraint
+  // forces are G^T lambda
+  const std::vector<double> & multipliers() const { return m_lambda; }
+
+  // equilibrium from the current positions, written to the system with
+  // zero velocities and accelerations
+  StaticInfo solve ()
+  {
+    std::vector<double> x(m_n), v(m_n), a(m_n);
+    m_mss.getState (view(x), view(v), view(a));
+
+    // forces are measured relative to the weight, or without gravity
+    // to the initial net force
+    double weight = 0;
+    for (size_t i = 0; i < m_n; i++)
+      weight += m_mass[i] * m_gravity[i]*m_gravity[i];
+    evaluate (x, 1);
+    double scale = std::max(std::sqrt(weight), residual(x)[0]);
+    if (scale == 0) scale = 1;
+
+    StaticInfo info;
+    double s = 0, ds = 1.0 / std::max(m_opts.loadsteps, 1);
+    if (weight == 0) s = 1;
+    while (s < 1 || info.loadsteps == 0)
+      {
+        double target = std::min(1.0, s+ds);
+        if (newton (x, target, scale, info))
+          {
+            s = target;
+            info.loadsteps++;
+            ds *= 2;
+          }
+        else
+          {
+            ds /= 2;
+            if (ds*m_opts.maxloadsteps < 1)
+              throw std::domain_error("StaticSolver: no equilibrium found");
+          }
+      }
+
+    std::fill (v.begin(), v.end(), 0.0);
+    m_mss.setState (view(x), view(v), view(v));
+    return info;
+  }
+};
+
+#endif
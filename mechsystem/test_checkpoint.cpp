@@ -0,0 +1,86 @@
+#include <iostream>
+#include <cstdio>
+
+#include "mass_spring.hpp"
+#include "Newmark.hpp"
+#include "checkpoint.hpp"
+
+// Save -> load -> continue against an uninterrupted run. Both continue
+// adaptively from the step size of the last step, so the restored run
+// has to reproduce the same steps. The restored stepper starts with a
+// new iteration matrix, the uninterrupted one is invalidated at the
+// checkpoint, otherwise the Newton iterates differ within the tolerance
+// and the step size control may take other steps.
+
+std::shared_ptr<GeneralizedAlphaStepper> MakeStepper (MassSpringSystem<2> & mss)
+{
+  auto func = std::make_shared<MSS_Function<2>> (mss);
+  func->setConstraintProjection (false);
+  size_t n = 2*mss.numMasses();
+  auto stepper = std::make_shared<GeneralizedAlphaStepper> (func, std::make_shared<IdentityMass>(n), 0.8);
+  stepper->setConstraints (std::make_shared<MSS_Constraints<2>>(mss));
+  return stepper;
+}
+
+int main()
+{
+  MassSpringSystem<2> mss;
+  mss.setGravity ( {0,-9.81} );
+  auto fA = mss.addFix ( { { 0.0, 0.0 } } );
+  auto mA = mss.addMass ( { 1, { 1.0, 0.0 } } );
+  mss.addSpring ( { 1, 10, { fA, mA } } );
+  auto mB = mss.addMass ( { 1, { 2.0, 0.0 } } );
+  mss.addSpring ( { 1, 20, { mA, mB } } );
+  auto mC = mss.addMass ( { 2, { 1.0, -1.5 } } );
+  mss.addSpring ( { 1, 50, { mB, mC } } );
+  mss.addDistanceConstraint (mA, mC, 1.5);
+
+  size_t n = 2*mss.numMasses();
+  Vector<> x(n), dx(n), ddx(n);
+  mss.getState (x, dx, ddx);
+
+  AdaptiveOptions opts;
+  opts.rtol = 1e-6;
+  opts.atol = 1e-8;
+
+  auto stepper = MakeStepper(mss);
+  stepper->setState (x, dx);
+  stepper->solveAdaptive (1, 1e-3, opts);
+
+  std::string filename = "test_checkpoint.ckpt";
+  StepperState state = GetStepperState(*stepper);
+  mss.setState (stepper->position(), stepper->velocity(), stepper->acceleration());
+  SaveCheckpoint (filename, mss, &state);
+
+  stepper->invalidate();
+  stepper->solveAdaptive (1, stepper->stepSize(), opts);
+
+  MassSpringSystem<2> mss2;
+  StepperState state2;
+  LoadCheckpoint (filename, mss2, &state2);
+  std::remove (filename.c_str());
+  auto stepper2 = MakeStepper(mss2);
+  SetStepperState (*stepper2, state2);
+  std::cout << "restored t = " << stepper2->time() << ", dt = " << stepper2->stepSize()
+            << " (saved " << state.dt << ")" << std::endl;
+  stepper2->solveAdaptive (1, stepper2->stepSize(), opts);
+
+  double err = std::abs(stepper2->time() - stepper->time());
+  for (size_t i = 0; i < n; i++)
+    {
+      err = std::max(err, std::abs(stepper2->position()(i) - stepper->position()(i)));
+      err = std::max(err, std::abs(stepper2->velocity()(i) - stepper->velocity()(i)));
+    }
+  auto lam = stepper->lagrangeMultipliers(), lam2 = stepper2->lagrangeMultipliers();
+  for (size_t i = 0; i < lam.size(); i++)
+    err = std::max(err, std::abs(lam2(i) - lam(i)));
+  std::cout << "t = " << stepper->time() << ", continued from checkpoint against uninterrupted: "
+            << err << std::endl;
+
+  if (state2.dt != state.dt || err > 1e-12)
+    {
+      std::cout << "FAILED" << std::endl;
+      return 1;
+    }
+  return 0;
+}
@@ -40,3 +40,70 @@ mss.masses[0].mass = 5
 
 for m in mss.masses:
     print (m.mass, m.pos)
+
+# state arrays are numpy views, writing them changes the system
+pos = mss.positions
+pos[0,2] += 0.1
+print (pos.shape, mss.masses[0].pos)
+
+# persistent simulator, physics in a background thread, frames polled here
+import time
+sim = Simulator(mss)
+sim.advance (0.1, 10)
+sim.start (0.01, 10, tend=sim.time+1)
+while sim.running:
+    frame = sim.latestFrame()
+    time.sleep(0.01)
+sim.stop()
+print ("t = ", sim.time, "frame = ", sim.latestFrame())
+
+# binary snapshots, and periodic checkpoints of a run
+import tempfile
+import numpy as np
+with tempfile.TemporaryDirectory() as tmp:
+    mss.save (os.path.join(tmp, "mss.ckpt"))
+    mss2 = MassSpringSystem3d.load (os.path.join(tmp, "mss.ckpt"))
+    assert np.array_equal (mss2.getState(), mss.getState())
+    assert [m.mass for m in mss2.masses] == [m.mass for m in mss.masses]
+    mss2.simulate (0.1, 10, checkpoint=os.path.join(tmp, "mss_run.ckpt"), checkpoint_every=5)
+    assert np.array_equal (MassSpringSystem3d.load (os.path.join(tmp, "mss_run.ckpt")).getState(), mss2.getState())
+    t = sim.time
+    sim.checkpoint (os.path.join(tmp, "sim.ckpt"))
+    x = mss.getState()
+    sim.advance (0.1, 10)
+    sim.restore (os.path.join(tmp, "sim.ckpt"))
+    print ("restored t = ", sim.time)
+    assert sim.time == t and np.array_equal (mss.getState(), x)
+
+# energies and momentum, computed in the force loops
+sim.setDiagnostics (10)
+sim.advance (1, 100)
+diag = sim.diagnostics()
+print ("total energy = ", diag["total"][-1], "drift = ", diag["drift"])
+assert abs(diag["drift"]) < 1e-2
+
+# stiff springs subcycled, soft springs evaluated once per step
+stiff = MassSpringSystem3d()
+stiff.gravity = (0,0,-9.81)
+stiff.addChain (20, (0,0,0), (20,0,0), 1, 100)
+stiff.addChain (20, (21,0,0), (40,0,0), 1, 1e6, fix_start=False)
+stiff.addSprings ([[19,20]], 100)
+info = stiff.simulateMultirate (1, 100)
+print ("multirate: ", info)
+assert info["substeps"] > 1 and info["fast_springs"] > 0
+assert np.all (np.isfinite (stiff.getState()))
+
+# lowest modes around the current state, evaluated in closed form
+red = ModalReduction (stiff, 10)
+print ("omega^2 = ", red.eigenvalues[:3], "error = ", red.error)
+print ("positions at t=0.5: ", red.positions(0.5)[-1])
+assert np.all (np.diff (red.eigenvalues) >= 0) and red.error["residual"] < 1e-6
+assert np.all (np.isfinite (red.positions(0.5)))
+
+# rest configuration directly, instead of damping it out in time
+hang = MassSpringSystem3d()
+hang.gravity = (0,0,-9.81)
+hang.addChain (20, (0,0,0), (20,0,0), 1, 1000)
+res = hang.solveStatic(loadsteps=2)
+print ("static: ", res, hang.masses[19].pos)
+assert res["residual"] < 1e-8 and hang.masses[19].pos[2] < 0
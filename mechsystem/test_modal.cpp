@@ -0,0 +1,107 @@
+#include <iostream>
+#include <cmath>
+
+#include "mass_spring.hpp"
+#include "modal_reduction.hpp"
+#include <timestepper.hpp>
+#include <implicitRK.hpp>
+
+// The reduced model of a prestressed string, integrated by TimeSteppers
+// from function() and initialValue(), against the exact modal solution.
+
+// modal state after 'steps' steps of the stepper up to time tend
+void Integrate (TimeStepper & stepper, const ModalReduction<2> & red,
+                double tend, int steps, VectorView<double> y)
+{
+  red.initialValue (y);
+  for (int i = 0; i < steps; i++)
+    stepper.doStep (tend/steps, y);
+}
+
+double Difference (VectorView<double> y, VectorView<double> q, VectorView<double> dq)
+{
+  size_t k = q.size();
+  double err = 0;
+  for (size_t i = 0; i < k; i++)
+    err = std::max(err, std::max(std::abs(y(i)-q(i)), std::abs(y(k+i)-dq(i))));
+  return err;
+}
+
+int main()
+{
+  // string of n masses between two fixes, springs stretched by 25%
+  size_t n = 20;
+  MassSpringSystem<2> mss;
+  mss.setGravity ( {0,-9.81} );
+  auto prev = mss.addFix ( { { 0.0, 0.0 } } );
+  for (size_t i = 1; i <= n; i++)
+    {
+      auto m = mss.addMass ( { 1, { double(i), 0.0 } } );
+      mss.addSpring ( { 0.8, 100, { prev, m } } );
+      prev = m;
+    }
+  mss.addSpring ( { 0.8, 100, { prev, mss.addFix ( { { double(n+1), 0.0 } } ) } } );
+
+  MSS_Function<2> func(mss);
+  func.setConstraintProjection (false);
+  Vector<> x(2*n), v(2*n), a(2*n);
+  mss.getState (x, v, a);
+
+  size_t k = 6;
+  ModalReduction<2> red(func, x, k);
+  for (size_t i = 0; i < n; i++)
+    x(2*i+1) = 0.05 * std::sin(M_PI*(i+1)/(n+1));
+  red.setInitial (x, v);
+  std::cout << "omega^2 = ";
+  for (double lam : red.eigenvalues()) std::cout << lam << " ";
+  std::cout << std::endl;
+
+  double tend = 2;
+  Vector<> q(k), dq(k), y(2*k);
+  red.state (tend, q, dq);
+
+  bool ok = true;
+  auto rhs = red.function();
+  CrankNicolson cn(rhs);
+  ImplicitRungeKutta gauss(rhs, Gauss2a, Gauss2b, Gauss2c);
+  struct { const char * name; TimeStepper & stepper; int order; } methods[] =
+    { { "Crank-Nicolson", cn, 2 }, { "Gauss 2", gauss, 4 } };
+  for (auto & method : methods)
+    {
+      double errold = 0;
+      for (int steps = 200; steps <= 800; steps *= 2)
+        {
+          Integrate (method.stepper, red, tend, steps, y);
+          double err = Difference (y, q, dq);
+          std::cout << method.name << ", " << steps << " steps: difference to state() " << err;
+          if (errold > 0)
+            {
+              double rate = std::log2(errold/err);
+              std::cout << ", rate " << rate;
+              if (rate < method.order-0.2) ok = false;
+            }
+          std::cout << std::endl;
+          errold = err;
+        }
+      if (errold > 1e-4) ok = false;
+    }
+
+  // the shift must lie below the spectrum
+  try
+    {
+      ModalReduction<2> above(func, x, k, 2*red.eigenvalues()[0]);
+      std::cout << "shift above the lowest eigenvalue was accepted" << std::endl;
+      ok = false;
+    }
+  catch (std::invalid_argument & e)
+    {
+      std::cout << "shift above the lowest eigenvalue: " << e.what() << std::endl;
+    }
+
+  if (!ok)
+    {
+      std::cout << "FAILED" << std::endl;
+      return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,227 @@
+#ifndef ADJOINT_HPP
+#define ADJOINT_HPP
+
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include "sensitivity.hpp"
+
+namespace ASC_ode
+{
+
+  // C(s+t, s): steps which can be reversed with s snapshots and t forward
+  // sweeps (Griewank's binomial bound), saturating
+  inline size_t BinomialSteps (size_t s, size_t t)
+  {
+    size_t m = std::min(s, t);
+    double beta = 1;
+    for (size_t i = 1; i <= m; i++)
+      beta = beta * double(s+t+1-i) / double(i);
+    if (beta > double(std::numeric_limits<size_t>::max()/2))
+      return std::numeric_limits<size_t>::max()/2;
+    return size_t(beta + 0.5);
+  }
+
+
+  // Gradient of J = sum_{k=1}^{steps} g_k(y_k) with respect to the parameters
+  // and y_0, for y_k computed by a Runge-Kutta method (see RungeKuttaStages),
+  // by the discrete adjoint. One step backward, with the stages recomputed
+  // from y_k:
+  //
+  //    z_i - tau sum_j a_ji J_j^T z_j = tau b_i lambda_{k+1},   i.e. M^T z = tau b x lambda
+  //    lambda_k = lambda_{k+1} + sum_j J_j^T z_j + dg_k/dy_k
+  //    dJ/dp   += sum_j f_p(Y_j)^T z_j
+  //
+  // backward substitution for explicit methods, M^{-1} from Newton otherwise.
+  // The gradient is exact for the discrete solution, for the cost of a few
+  // simulations independent of the number of parameters.
+  //
+  // The forward states are kept in a fixed number of snapshots placed by the
+  // binomial (revolve) schedule: with s snapshots, steps <= C(s+t, s) are
+  // reversed with at most t forward recomputations per step, e.g. 20
+  // snapshots take 10^6 steps with t = 8.
+  class AdjointRungeKutta
+  {
+  public:
+    // returns g_k(y_k) and adds dg_k/dy_k to dgdy
+    using Objective = std::function<double(size_t k, VectorView<double> y, VectorView<double> dgdy)>;
+
+  private:
+    RungeKuttaStages m_rk;
+    size_t m_n, m_np, m_stages;
+    size_t m_snapshots;
+    std::vector<double> m_store;      // m_snapshots states
+    Vector<> m_y, m_lambda, m_gradp, m_z, m_w;
+    size_t m_steps = 0, m_forward = 0;
+    double m_tau = 0, m_value = 0;
+    Objective m_objective;
+
+    VectorView<double> snapshot (size_t slot) { return VectorView<double>(m_n, &m_store[slot*m_n]); }
+
+    void advance (VectorView<double> y, size_t num)
+    {
+      for (size_t i = 0; i < num; i++)
+        {
+          m_rk.solveValues (m_tau, y);
+          m_rk.update (m_tau, y);
+        }
+      m_forward += num;
+    }
+
+    // lambda_k from lambda_{k+1}, y = y_k
+    void adjointStep (size_t k, VectorView<double> y)
+    {
+      m_rk.solve (m_tau, y);
+      m_rk.paramDerivs();
+      if (k+1 == m_steps)
+        {
+          for (size_t l = 0; l < m_n; l++)
+            m_y(l) = y(l);
+          m_rk.update (m_tau, m_y);
+          m_lambda = 0.0;
+          m_value += m_objective (m_steps, m_y, m_lambda);
+        }
+
+      size_t sn = m_stages*m_n;
+      for (size_t i = 0; i < m_stages; i++)
+        for (size_t l = 0; l < m_n; l++)
+          m_w(i*m_n+l) = m_tau * m_rk.b(i) * m_lambda(l);
+
+      if (m_rk.isExplicit())
+        for (size_t i = m_stages; i-- > 0; )
+          {
+            // z_i = w_i + tau sum_{j>i} a_ji J_j^T z_j, J_j^T z_j kept in w_j
+            for (size_t l = 0; l < m_n; l++)
+              m_z(i*m_n+l) = m_w(i*m_n+l);
+            for (size_t j = i+1; j < m_stages; j++)
+              if (m_rk.a(j,i) != 0)
+                for (size_t l = 0; l < m_n; l++)
+                  m_z(i*m_n+l) += m_tau * m_rk.a(j,i) * m_w(j*m_n+l);
+            MatrixView<double> jac = m_rk.jacobian(i);
+            for (size_t r = 0; r < m_n; r++)
+              {
+                double sum = 0;
+                for (size_t l = 0; l < m_n; l++)
+                  sum += jac(l,r) * m_z(i*m_n+l);
+                m_w(i*m_n+r) = sum;
+              }
+          }
+      else
+        {
+          MatrixView<double> inv = m_rk.stageInverse();
+          for (size_t col = 0; col < sn; col++)
+            {
+              double sum = 0;
+              for (size_t row = 0; row < sn; row++)
+                sum += inv(row, col) * m_w(row);
+              m_z(col) = sum;
+            }
+          for (size_t j = 0; j < m_stages; j++)
+            {
+              MatrixView<double> jac = m_rk.jacobian(j);
+              for (size_t r = 0; r < m_n; r++)
+                {
+                  double sum = 0;
+                  for (size_t l = 0; l < m_n; l++)
+                    sum += jac(l,r) * m_z(j*m_n+l);
+                  m_w(j*m_n+r) = sum;
+                }
+            }
+        }
+
+      for (size_t j = 0; j < m_stages; j++)
+        {
+          MatrixView<double> fp = m_rk.paramJacobian(j);
+          for (size_t l = 0; l < m_n; l++)
+            {
+              m_lambda(l) += m_w(j*m_n+l);
+              for (size_t q = 0; q < m_np; q++)
+                m_gradp(q) += fp(l,q) * m_z(j*m_n+l);
+            }
+        }
+      if (k > 0)
+        m_value += m_objective (k, y, m_lambda);
+    }
+
+    // reverses the steps [from, to), y_from in slot, the slots above are free
+    void reverse (size_t from, size_t to, size_t slot)
+    {
+      size_t l = to-from;
+      size_t free = m_snapshots-1-slot;
+      if (l == 1)
+        {
+          adjointStep (from, snapshot(slot));
+          return;
+        }
+      if (free == 0)
+        {
+          VectorView<double> y = snapshot(slot);
+          Vector<> work(m_n);
+          for (size_t k = to; k-- > from; )
+            {
+              work = y;
+              advance (work, k-from);
+              adjointStep (k, work);
+            }
+          return;
+        }
+
+      // t sweeps suffice for l <= C(free+t, free); the first part gets
+      // what the remaining free-1 snapshots cannot take with t sweeps
+      size_t t = 0;
+      while (BinomialSteps(free, t) < l) t++;
+      size_t l1 = (l > BinomialSteps(free-1, t)) ? l - BinomialSteps(free-1, t) : 1;
+      l1 = std::min(l1, l-1);
+
+      VectorView<double> next = snapshot(slot+1);
+      next = snapshot(slot);
+      advance (next, l1);
+      reverse (from+l1, to, slot+1);
+      reverse (from, from+l1, slot);
+    }
+
+  public:
+    AdjointRungeKutta (std::shared_ptr<ParametricFunction> rhs,
+                       const Matrix<> & a, const Vector<> & b, const Vector<> & c,
+                       size_t snapshots = 20, double tol = 1e-10, int maxsteps = 10)
+      : m_rk(rhs, a, b, c, tol, maxsteps),
+        m_n(m_rk.size()), m_np(m_rk.numParams()), m_stages(m_rk.numStages()),
+        m_snapshots(std::max<size_t>(snapshots, 1)), m_store(m_snapshots*m_n),
+        m_y(m_n), m_lambda(m_n), m_gradp(m_np), m_z(m_stages*m_n), m_w(m_stages*m_n) { }
+
+    // J, and dJ/dp and dJ/dy_0 into gradp and grady0, for steps steps of size tau from y0
+    double gradient (VectorView<double> y0, double tau, size_t steps, Objective objective,
+                     VectorView<double> gradp, VectorView<double> grady0)
+    {
+      m_tau = tau;
+      m_steps = steps;
+      m_objective = objective;
+      m_forward = 0;
+      m_value = 0;
+      m_gradp = 0.0;
+      m_lambda = 0.0;
+      snapshot(0) = y0;
+      if (steps > 0)
+        reverse (0, steps, 0);
+
+      for (size_t q = 0; q < m_np; q++)
+        gradp(q) = m_gradp(q);
+      for (size_t l = 0; l < m_n; l++)
+        grady0(l) = m_lambda(l);
+      return m_value;
+    }
+
+    size_t numSnapshots() const { return m_snapshots; }
+    // steps recomputed from snapshots in the last gradient, at most
+    // steps * t for the binomial schedule
+    size_t forwardSteps() const { return m_forward; }
+  };
+
+}
+
+#endif
@@ -1,17 +1,18 @@
 #ifndef AUTODIFF_HPP
 #define AUTODIFF_HPP
 
-#include <cstddef> 
-#include <ostream> 
-#include <cmath>   
-#include <array>  
+#include <cstddef>
+#include <ostream>
+#include <cmath>
+#include <array>
+#include <type_traits>
 
 
 namespace ASC_ode
 {
 
   template <size_t N, typename T = double>
-  class Variable 
+  class Variable
   {
     private:
       T m_val;
@@ -21,37 +22,84 @@ namespace ASC_ode
   };
 
   template <typename T = double>
-  auto derivative (T v, size_t /*index*/) { return T(0); } 
+  auto derivative (T /*v*/, size_t /*index*/) { return T(0); }
+
+
+  // Base of AutoDiff values and of the expression nodes built by the
+  // operators below. An expression E provides
+  //
+  //    using TScalar = ...;  static constexpr size_t SIZE = N;
+  //    TScalar value() const;  TScalar deriv (size_t i) const;
+  //
+  // Values are computed when a node is built, derivative components on
+  // demand, so assigning a whole expression to an AutoDiff is one loop over
+  // the N components without temporaries. Nodes keep AutoDiff operands by
+  // reference: evaluate expressions in the statement that builds them.
+  template <typename E>
+  struct ADExpr
+  {
+    const E & upcast() const { return static_cast<const E&>(*this); }
+  };
 
 
   template <size_t N, typename T = double>
-  class AutoDiff
+  class AutoDiff : public ADExpr<AutoDiff<N,T>>
   {
   private:
     T m_val;
     std::array<T, N> m_deriv;
-  public: 
+  public:
+    using TScalar = T;
+    static constexpr size_t SIZE = N;
+
     AutoDiff () : m_val(0), m_deriv{} {}
-    AutoDiff (T v) : m_val(v), m_deriv{} 
+    AutoDiff (T v) : m_val(v), m_deriv{}
     {
-      for (size_t i = 0; i < N; i++)
-        m_deriv[i] = derivative(v, i);
+      // nested AutoDiff starts from the derivatives of the inner value
+      if constexpr (!std::is_arithmetic_v<T>)
+        for (size_t i = 0; i < N; i++)
+          m_deriv[i] = derivative(v, i);
     }
-    
+
     template <size_t I>
-    AutoDiff (Variable<I, T> var) : m_val(var.value()), m_deriv{} 
+    AutoDiff (Variable<I, T> var) : m_val(var.value()), m_deriv{}
     {
       m_deriv[I] = 1.0;
     }
 
+    template <typename E>
+    AutoDiff (const ADExpr<E> & e) { assign (e.upcast()); }
+
+    template <typename E>
+    AutoDiff & operator= (const ADExpr<E> & e)
+    {
+      assign (e.upcast());
+      return *this;
+    }
+
     T value() const { return m_val; }
+    T deriv (size_t i) const { return m_deriv[i]; }
     std::array<T, N>& deriv() { return m_deriv; }
     const std::array<T, N>& deriv() const { return m_deriv; }
+
+  private:
+    // the local array tells the compiler the operands don't alias the
+    // result, so the loop vectorizes; x = f(x, ...) is fine as well
+    template <typename E>
+    void assign (const E & e)
+    {
+      static_assert (E::SIZE == N, "AutoDiff: expression has a different number of derivatives");
+      std::array<T, N> d;
+      for (size_t i = 0; i < N; i++)
+        d[i] = e.deriv(i);
+      m_val = e.value();
+      m_deriv = d;
+    }
   };
 
 
   template <size_t N, typename T = double>
-  auto derivative (AutoDiff<N, T> v, size_t index) 
+  auto derivative (AutoDiff<N, T> v, size_t index)
   {
     return v.deriv()[index];
   }
@@ -71,151 +119,251 @@ namespace ASC_ode
     return os;
   }
 
-  template <size_t N, typename T = double>
-  AutoDiff<N, T> operator+ (const AutoDiff<N, T>& a, const AutoDiff<N, T>& b)
-  {
-     AutoDiff<N, T> result(a.value() + b.value());
-     for (size_t i = 0; i < N; i++)
-        result.deriv()[i] = a.deriv()[i] + b.deriv()[i];
-       return result;
-   }
-
-   template <size_t N, typename T = double>
-   auto operator+ (T a, const AutoDiff<N, T>& b) { return AutoDiff<N, T>(a) + b; }
-
-
-   template <size_t N, typename T = double>
-   AutoDiff<N, T> operator* (const AutoDiff<N, T>& a, const AutoDiff<N, T>& b)
-   {
-       AutoDiff<N, T> result(a.value() * b.value());
-       for (size_t i = 0; i < N; i++)
-          result.deriv()[i] = a.deriv()[i] * b.value() + a.value() * b.deriv()[i];
-       return result;
-   }
-
-   using std::sin;
-   using std::cos;
-
-   template <size_t N, typename T = double>
-   AutoDiff<N, T> sin(const AutoDiff<N, T> &a)
-   {
-       AutoDiff<N, T> result(sin(a.value()));
-       for (size_t i = 0; i < N; i++)
-           result.deriv()[i] = cos(a.value()) * a.deriv()[i];
-       return result;
-   }
-
-   
-      // -------------------------------------------------------------
-   // Additional operators for Exercise 18.4
-   // -------------------------------------------------------------
-
-   // a - b
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> operator- (const AutoDiff<N,T>& a, const AutoDiff<N,T>& b)
-   {
-       AutoDiff<N,T> result(a.value() - b.value());
-       for (size_t i = 0; i < N; i++)
-           result.deriv()[i] = a.deriv()[i] - b.deriv()[i];
-       return result;
-   }
-
-   // scalar - AutoDiff
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> operator- (T a, const AutoDiff<N,T>& b)
-   {
-       AutoDiff<N,T> aa(a);
-       return aa - b;
-   }
-
-   // AutoDiff - scalar
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> operator- (const AutoDiff<N,T>& a, T b)
-   {
-       AutoDiff<N,T> bb(b);
-       return a - bb;
-   }
-
-   // a / b
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> operator/ (const AutoDiff<N,T>& a, const AutoDiff<N,T>& b)
-   {
-       AutoDiff<N,T> result(a.value() / b.value());
-       double denom = b.value() * b.value();
-       for (size_t i = 0; i < N; i++)
-           result.deriv()[i] =
-              (a.deriv()[i] * b.value() - a.value() * b.deriv()[i]) / denom;
-       return result;
-   }
-
-   // AutoDiff / scalar
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> operator/ (const AutoDiff<N,T>& a, T b)
-   {
-       AutoDiff<N,T> bb(b);
-       return a / bb;
-   }
-
-   // scalar / AutoDiff
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> operator/ (T a, const AutoDiff<N,T>& b)
-   {
-       AutoDiff<N,T> aa(a);
-       return aa / b;
-   }
-
-   // -------------------------------------------------------------
-   // Additional functions: cos, exp, log
-   // -------------------------------------------------------------
-
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> cos(const AutoDiff<N,T>& a)
-   {
-       AutoDiff<N,T> result(::cos(a.value()));
-       for (size_t i = 0; i < N; i++)
-           result.deriv()[i] = -::sin(a.value()) * a.deriv()[i];
-       return result;
-   }
-
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> exp(const AutoDiff<N,T>& a)
-   {
-       AutoDiff<N,T> result(::exp(a.value()));
-       for (size_t i = 0; i < N; i++)
-           result.deriv()[i] = result.value() * a.deriv()[i];
-       return result;
-   }
-
-   template <size_t N, typename T = double>
-   AutoDiff<N,T> log(const AutoDiff<N,T>& a)
-   {
-       AutoDiff<N,T> result(::log(a.value()));
-       for (size_t i = 0; i < N; i++)
-           result.deriv()[i] = a.deriv()[i] / a.value();
-       return result;
-   }
-
-// AutoDiff * scalar
-template <size_t N, typename T = double>
-AutoDiff<N,T> operator* (const AutoDiff<N,T>& a, T b)
-{
-    AutoDiff<N,T> r(a.value() * b);
-    for (size_t i = 0; i < N; i++)
-        r.deriv()[i] = a.deriv()[i] * b;
-    return r;
-}
+  template <typename E>
+  std::ostream & operator<< (std::ostream& os, const ADExpr<E>& e)
+  {
+    return os << AutoDiff<E::SIZE, typename E::TScalar>(e);
+  }
 
-// scalar * AutoDiff
-template <size_t N, typename T = double>
-AutoDiff<N,T> operator* (T a, const AutoDiff<N,T>& b)
-{
-    AutoDiff<N,T> r(a * b.value());
-    for (size_t i = 0; i < N; i++)
-        r.deriv()[i] = a * b.deriv()[i];
-    return r;
-}
- 
 
+  // -------------------------------------------------------------
+  // Expression nodes
+  // -------------------------------------------------------------
+
+  // operands: AutoDiff by reference, nested expressions by value
+  template <typename E> struct ADStore { using type = const E; };
+  template <size_t N, typename T> struct ADStore<AutoDiff<N,T>> { using type = const AutoDiff<N,T> &; };
+
+  template <typename A, typename B>
+  concept ADCompatible = std::is_same_v<typename A::TScalar, typename B::TScalar> && A::SIZE == B::SIZE;
+
+
+  template <typename A, typename B>
+  class ADSum : public ADExpr<ADSum<A,B>>
+  {
+    typename ADStore<A>::type m_a;
+    typename ADStore<B>::type m_b;
+  public:
+    using TScalar = typename A::TScalar;
+    static constexpr size_t SIZE = A::SIZE;
+  private:
+    TScalar m_val;
+  public:
+    ADSum (const A & a, const B & b) : m_a(a), m_b(b), m_val(a.value() + b.value()) { }
+    TScalar value() const { return m_val; }
+    TScalar deriv (size_t i) const { return m_a.deriv(i) + m_b.deriv(i); }
+  };
+
+  template <typename A, typename B>
+  class ADDiff : public ADExpr<ADDiff<A,B>>
+  {
+    typename ADStore<A>::type m_a;
+    typename ADStore<B>::type m_b;
+  public:
+    using TScalar = typename A::TScalar;
+    static constexpr size_t SIZE = A::SIZE;
+  private:
+    TScalar m_val;
+  public:
+    ADDiff (const A & a, const B & b) : m_a(a), m_b(b), m_val(a.value() - b.value()) { }
+    TScalar value() const { return m_val; }
+    TScalar deriv (size_t i) const { return m_a.deriv(i) - m_b.deriv(i); }
+  };
+
+  // (ab)' = a' b + a b'
+  template <typename A, typename B>
+  class ADProd : public ADExpr<ADProd<A,B>>
+  {
+    typename ADStore<A>::type m_a;
+    typename ADStore<B>::type m_b;
+  public:
+    using TScalar = typename A::TScalar;
+    static constexpr size_t SIZE = A::SIZE;
+  private:
+    TScalar m_va, m_vb;
+  public:
+    ADProd (const A & a, const B & b) : m_a(a), m_b(b), m_va(a.value()), m_vb(b.value()) { }
+    TScalar value() const { return m_va * m_vb; }
+    TScalar deriv (size_t i) const { return m_a.deriv(i) * m_vb + m_va * m_b.deriv(i); }
+  };
+
+  // (a/b)' = a'/b - (a/b) b'/b
+  template <typename A, typename B>
+  class ADQuot : public ADExpr<ADQuot<A,B>>
+  {
+    typename ADStore<A>::type m_a;
+    typename ADStore<B>::type m_b;
+  public:
+    using TScalar = typename A::TScalar;
+    static constexpr size_t SIZE = A::SIZE;
+  private:
+    TScalar m_val, m_inv, m_quotinv;
+  public:
+    ADQuot (const A & a, const B & b)
+      : m_a(a), m_b(b), m_val(a.value() / b.value()),
+        m_inv(1.0 / b.value()), m_quotinv(m_val * m_inv) { }
+    TScalar value() const { return m_val; }
+    TScalar deriv (size_t i) const { return m_a.deriv(i) * m_inv - m_quotinv * m_b.deriv(i); }
+  };
+
+  // s a
+  template <typename A>
+  class ADScale : public ADExpr<ADScale<A>>
+  {
+    typename ADStore<A>::type m_a;
+  public:
+    using TScalar = typename A::TScalar;
+    static constexpr size_t SIZE = A::SIZE;
+  private:
+    TScalar m_s, m_val;
+  public:
+    ADScale (const A & a, TScalar s) : m_a(a), m_s(s), m_val(s * a.value()) { }
+    TScalar value() const { return m_val; }
+    TScalar deriv (size_t i) const { return m_s * m_a.deriv(i); }
+  };
+
+  // a + s, derivatives of a
+  template <typename A>
+  class ADShift : public ADExpr<ADShift<A>>
+  {
+    typename ADStore<A>::type m_a;
+  public:
+    using TScalar = typename A::TScalar;
+    static constexpr size_t SIZE = A::SIZE;
+  private:
+    TScalar m_val;
+  public:
+    ADShift (const A & a, TScalar s) : m_a(a), m_val(a.value() + s) { }
+    TScalar value() const { return m_val; }
+    TScalar deriv (size_t i) const { return m_a.deriv(i); }
+  };
+
+  // f(a) with value f(a.value()) and f'(a.value()) given: chain rule f'(a) a'
+  template <typename A>
+  class ADChain : public ADExpr<ADChain<A>>
+  {
+    typename ADStore<A>::type m_a;
+  public:
+    using TScalar = typename A::TScalar;
+    static constexpr size_t SIZE = A::SIZE;
+  private:
+    TScalar m_val, m_df;
+  public:
+    ADChain (const A & a, TScalar val, TScalar df) : m_a(a), m_val(val), m_df(df) { }
+    TScalar value() const { return m_val; }
+    TScalar deriv (size_t i) const { return m_df * m_a.deriv(i); }
+  };
+
+
+  // -------------------------------------------------------------
+  // Operators. Scalars are taken as the value type of the expression
+  // (a non-deduced parameter), so double and int mix with any AutoDiff
+  // without being promoted to one.
+  // -------------------------------------------------------------
+
+  template <typename A, typename B> requires ADCompatible<A,B>
+  auto operator+ (const ADExpr<A>& a, const ADExpr<B>& b) { return ADSum<A,B>(a.upcast(), b.upcast()); }
+
+  template <typename A>
+  auto operator+ (typename A::TScalar a, const ADExpr<A>& b) { return ADShift<A>(b.upcast(), a); }
+
+  template <typename A>
+  auto operator+ (const ADExpr<A>& a, typename A::TScalar b) { return ADShift<A>(a.upcast(), b); }
+
+
+  template <typename A, typename B> requires ADCompatible<A,B>
+  auto operator* (const ADExpr<A>& a, const ADExpr<B>& b) { return ADProd<A,B>(a.upcast(), b.upcast()); }
+
+  template <typename A>
+  auto operator* (const ADExpr<A>& a, typename A::TScalar b) { return ADScale<A>(a.upcast(), b); }
+
+  template <typename A>
+  auto operator* (typename A::TScalar a, const ADExpr<A>& b) { return ADScale<A>(b.upcast(), a); }
+
+
+  template <typename A, typename B> requires ADCompatible<A,B>
+  auto operator- (const ADExpr<A>& a, const ADExpr<B>& b) { return ADDiff<A,B>(a.upcast(), b.upcast()); }
+
+  template <typename A>
+  auto operator- (const ADExpr<A>& a) { return ADScale<A>(a.upcast(), -1.0); }
+
+  template <typename A>
+  auto operator- (typename A::TScalar a, const ADExpr<A>& b) { return ADShift<ADScale<A>>(-b, a); }
+
+  template <typename A>
+  auto operator- (const ADExpr<A>& a, typename A::TScalar b) { return ADShift<A>(a.upcast(), -b); }
+
+
+  template <typename A, typename B> requires ADCompatible<A,B>
+  auto operator/ (const ADExpr<A>& a, const ADExpr<B>& b) { return ADQuot<A,B>(a.upcast(), b.upcast()); }
+
+  template <typename A>
+  auto operator/ (const ADExpr<A>& a, typename A::TScalar b)
+  {
+    return ADScale<A>(a.upcast(), typename A::TScalar(1.0 / b));
+  }
+
+  // (s/b)' = -(s/b) b'/b
+  template <typename A>
+  auto operator/ (typename A::TScalar a, const ADExpr<A>& b)
+  {
+    using T = typename A::TScalar;
+    T inv = 1.0 / b.upcast().value();
+    T val = a * inv;
+    return ADChain<A>(b.upcast(), val, T(-val * inv));
+  }
+
+
+  // -------------------------------------------------------------
+  // Elementary functions, unqualified calls on the value so that
+  // nested AutoDiff works
+  // -------------------------------------------------------------
+
+  using std::sin;
+  using std::cos;
+  using std::exp;
+  using std::log;
+  using std::sqrt;
+
+  template <typename A>
+  auto sin (const ADExpr<A>& a)
+  {
+    using T = typename A::TScalar;
+    T v = a.upcast().value();
+    return ADChain<A>(a.upcast(), T(sin(v)), T(cos(v)));
+  }
+
+  template <typename A>
+  auto cos (const ADExpr<A>& a)
+  {
+    using T = typename A::TScalar;
+    T v = a.upcast().value();
+    return ADChain<A>(a.upcast(), T(cos(v)), T(-sin(v)));
+  }
+
+  template <typename A>
+  auto exp (const ADExpr<A>& a)
+  {
+    using T = typename A::TScalar;
+    T e = exp(a.upcast().value());
+    return ADChain<A>(a.upcast(), e, e);
+  }
+
+  template <typename A>
+  auto sqrt (const ADExpr<A>& a)
+  {
+    using T = typename A::TScalar;
+    T s = sqrt(a.upcast().value());
+    return ADChain<A>(a.upcast(), s, T(0.5 / s));
+  }
+
+  template <typename A>
+  auto log (const ADExpr<A>& a)
+  {
+    using T = typename A::TScalar;
+    T v = a.upcast().value();
+    return ADChain<A>(a.upcast(), T(log(v)), T(1.0 / v));
+  }
 
 } // namespace ASC_ode
 
@@ -0,0 +1,74 @@
+#ifndef AUTODIFF_FUNCTION_HPP
+#define AUTODIFF_FUNCTION_HPP
+
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "nonlinfunc.hpp"
+#include "autodiff.hpp"
+
+namespace ASC_ode
+{
+
+  // NonlinearFunction from a functor with a templated call operator
+  //
+  //    template <typename T>
+  //    void operator() (VectorView<T> x, VectorView<T> f) const
+  //
+  // evaluate calls it with double, evaluateDeriv with AutoDiff<N>. The
+  // Jacobian is exact, N columns per sweep: for dimX <= N one sweep,
+  // larger systems are seeded in chunks of N unknowns.
+  template <size_t N, typename FUNC>
+  class AutoDiffFunction : public NonlinearFunction
+  {
+    FUNC m_func;
+    size_t m_dimx, m_dimf;
+    mutable std::vector<AutoDiff<N>> m_x, m_f;
+
+  public:
+    AutoDiffFunction (FUNC func, size_t dimx, size_t dimf)
+      : m_func(func), m_dimx(dimx), m_dimf(dimf), m_x(dimx), m_f(dimf) { }
+
+    size_t dimX() const override { return m_dimx; }
+    size_t dimF() const override { return m_dimf; }
+
+    FUNC & func() { return m_func; }
+
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      m_func (x, f);
+    }
+
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      for (size_t first = 0; first < m_dimx; first += N)
+        {
+          size_t num = std::min(N, m_dimx-first);
+          for (size_t i = 0; i < m_dimx; i++)
+            m_x[i] = AutoDiff<N>(x(i));
+          for (size_t j = 0; j < num; j++)
+            m_x[first+j].deriv()[j] = 1;
+
+          m_func (VectorView<AutoDiff<N>>(m_dimx, m_x.data()),
+                  VectorView<AutoDiff<N>>(m_dimf, m_f.data()));
+
+          for (size_t i = 0; i < m_dimf; i++)
+            for (size_t j = 0; j < num; j++)
+              df(i, first+j) = m_f[i].deriv()[j];
+        }
+    }
+  };
+
+
+  // AutoDiffFunction with N derivatives per sweep, e.g. N = dimX for small systems
+  template <size_t N = 8, typename FUNC>
+  auto MakeAutoDiffFunction (FUNC func, size_t dimx, size_t dimf)
+  {
+    return std::make_shared<AutoDiffFunction<N,FUNC>> (func, dimx, dimf);
+  }
+
+}
+
+#endif
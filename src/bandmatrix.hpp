@@ -0,0 +1,160 @@
+#ifndef BANDMATRIX_HPP
+#define BANDMATRIX_HPP
+
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <vector.hpp>
+#include <matrix.hpp>
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+  // square band matrix with kl sub- and ku super-diagonals,
+  // stored row by row, entry (i,j) at  i*(kl+ku+1) + j-i+kl
+  class BandMatrix
+  {
+    size_t m_n, m_kl, m_ku, m_width;
+    std::vector<double> m_val;
+    bool m_factored = false;
+
+  public:
+    BandMatrix (size_t n, size_t kl, size_t ku)
+      : m_n(n), m_kl(kl), m_ku(ku), m_width(kl+ku+1), m_val(n*(kl+ku+1), 0.0) { }
+
+    size_t size() const { return m_n; }
+    size_t lowerBandwidth() const { return m_kl; }
+    size_t upperBandwidth() const { return m_ku; }
+    bool isFactored() const { return m_factored; }
+
+    bool inBand (size_t i, size_t j) const
+    { return j+m_kl >= i && j <= i+m_ku; }
+
+    double & operator() (size_t i, size_t j)
+    { return m_val[i*m_width + j+m_kl-i]; }
+    double operator() (size_t i, size_t j) const
+    { return inBand(i,j) ? m_val[i*m_width + j+m_kl-i] : 0.0; }
+
+    size_t firstCol (size_t i) const { return (i > m_kl) ? i-m_kl : 0; }
+    size_t nextCol (size_t i) const { return std::min(m_n, i+m_ku+1); }
+
+    void setZero()
+    {
+      std::fill(m_val.begin(), m_val.end(), 0.0);
+      m_factored = false;
+    }
+
+    // y = A x, only valid before factorization
+    void mult (VectorView<double> x, VectorView<double> y) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        {
+          double sum = 0;
+          for (size_t j = firstCol(i); j < nextCol(i); j++)
+            sum += (*this)(i,j) * x(j);
+          y(i) = sum;
+        }
+    }
+
+    // mat += fac A
+    void addTo (MatrixView<double> mat, double fac = 1) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        for (size_t j = firstCol(i); j < nextCol(i); j++)
+          mat(i,j) += fac * (*this)(i,j);
+    }
+
+    // in-place Cholesky factorization A = L L^T of a symmetric positive
+    // definite matrix, uses the lower band only
+    void factorCholesky ()
+    {
+      if (m_kl != m_ku)
+        throw std::logic_error("BandMatrix::factorCholesky needs a symmetric band");
+      for (size_t i = 0; i < m_n; i++)
+        {
+          for (size_t j = firstCol(i); j <= i; j++)
+            {
+              double sum = (*this)(i,j);
+              for (size_t k = std::max(firstCol(i), firstCol(j)); k < j; k++)
+                sum -= (*this)(i,k) * (*this)(j,k);
+              if (j < i)
+                (*this)(i,j) = sum / (*this)(j,j);
+              else
+                {
+                  if (sum <= 0)
+                    throw std::domain_error("BandMatrix::factorCholesky: matrix not positive definite");
+                  (*this)(i,i) = std::sqrt(sum);
+                }
+            }
+        }
+      m_factored = true;
+    }
+
+    // solves L L^T x = b in place
+    void solveCholesky (VectorView<double> x) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        {
+          double sum = x(i);
+          for (size_t k = firstCol(i); k < i; k++)
+            sum -= (*this)(i,k) * x(k);
+          x(i) = sum / (*this)(i,i);
+        }
+      for (size_t i = m_n; i-- > 0; )
+        {
+          x(i) /= (*this)(i,i);
+          for (size_t k = firstCol(i); k < i; k++)
+            x(k) -= (*this)(i,k) * x(i);
+        }
+    }
+
+    // in-place factorization A = L U without pivoting, L has unit diagonal.
+    // No fill-in outside the band. Meant for diagonally dominant matrices,
+    // such as iteration matrices of implicit time steppers.
+    void factorLU ()
+    {
+      for (size_t k = 0; k < m_n; k++)
+        {
+          double pivot = (*this)(k,k);
+          if (!(std::abs(pivot) > 0))
+            throw std::domain_error("BandMatrix::factorLU: zero pivot");
+          size_t nextrow = std::min(m_n, k+m_kl+1);
+          size_t nextcol = nextCol(k);
+          for (size_t i = k+1; i < nextrow; i++)
+            {
+              double l = (*this)(i,k) /= pivot;
+              if (l == 0) continue;
+              for (size_t j = k+1; j < nextcol; j++)
+                (*this)(i,j) -= l * (*this)(k,j);
+            }
+        }
+      m_factored = true;
+    }
+
+    // solves L U x = b in place
+    void solveLU (VectorView<double> x) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        {
+          double sum = x(i);
+          for (size_t k = firstCol(i); k < i; k++)
+            sum -= (*this)(i,k) * x(k);
+          x(i) = sum;
+        }
+      for (size_t i = m_n; i-- > 0; )
+        {
+          double sum = x(i);
+          for (size_t k = i+1; k < nextCol(i); k++)
+            sum -= (*this)(i,k) * x(k);
+          x(i) = sum / (*this)(i,i);
+        }
+    }
+  };
+
+}
+
+#endif
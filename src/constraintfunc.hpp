@@ -0,0 +1,138 @@
+#ifndef CONSTRAINTFUNC_HPP
+#define CONSTRAINTFUNC_HPP
+
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <memory>
+
+#include "sparsematrix.hpp"
+#include "bandmatrix.hpp"
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+  // Holonomic constraints g(x) = 0 of a second order system.
+  // The constraint forces are  diag(s) G^T lambda  with the sparse Jacobian
+  // G = dg/dx and a force scaling s. For systems in acceleration form
+  // (masses divided out, like the mass-spring function) s is the inverse mass.
+  class ConstraintFunction
+  {
+  public:
+    virtual ~ConstraintFunction() = default;
+    virtual size_t dimX() const = 0;
+    virtual size_t numConstraints() const = 0;
+    virtual void evaluate (VectorView<double> x, VectorView<double> g) const = 0;
+    // a numConstraints x dimX matrix with the sparsity pattern of G
+    virtual SparseMatrix createJacobian() const = 0;
+    // fill the values of G, G must come from createJacobian
+    virtual void evaluateJacobian (VectorView<double> x, SparseMatrix & G) const = 0;
+    virtual void getForceScaling (VectorView<double> s) const { s = 1.0; }
+
+    // The curvature term  K = d(diag(s) G^T lambda)/dx  of the constraint
+    // forces, for the Newton matrix of implicit steppers. Optional, without
+    // it Newton converges only linearly for large multipliers.
+    virtual void getForceDerivPattern (std::vector<std::array<size_t,2>> & /*entries*/) const { }
+    // mat += fac K, the pattern of mat must contain the one from getForceDerivPattern
+    virtual void addForceDeriv (VectorView<double> /*x*/, VectorView<double> /*lambda*/,
+                                SparseMatrix & /*mat*/, double /*fac*/) const { }
+  };
+
+
+  // y += fac diag(s) G^T lambda
+  inline void AddConstraintForce (const SparseMatrix & G, VectorView<double> s,
+                                  double fac, VectorView<double> lambda, VectorView<double> y)
+  {
+    for (size_t c = 0; c < G.height(); c++)
+      for (size_t k = G.firstInRow(c); k < G.nextInRow(c); k++)
+        {
+          size_t j = G.colNr(k);
+          y(j) += fac * s(j) * G.val(k) * lambda(c);
+        }
+  }
+
+
+  // Schur complement  A = G diag(w) G^T  of the constraints, for w > 0 SPD
+  // if G has full rank. Constraints sharing an unknown couple, so for chains
+  // and meshes A is as sparse as G. Constraints numbered along chains give a
+  // narrow band, then A is factored by band Cholesky, else it is solved by
+  // Jacobi-preconditioned CG (which needs O(m) steps for long chains).
+  class ConstraintSchurComplement
+  {
+    SparseMatrix m_A;
+    // for every unknown j the entries (constraint, position in G) of column j
+    std::vector<std::vector<std::array<size_t,2>>> m_cols;
+    SparseCGSolver m_solver;
+    std::unique_ptr<BandMatrix> m_band;
+
+  public:
+    // G defines the pattern
+    ConstraintSchurComplement (const SparseMatrix & G)
+      : m_cols(G.width()), m_solver(G.height(), 1e-12, 10*G.height()+1000)
+    {
+      for (size_t c = 0; c < G.height(); c++)
+        for (size_t k = G.firstInRow(c); k < G.nextInRow(c); k++)
+          m_cols[G.colNr(k)].push_back ( { c, k } );
+
+      std::vector<std::array<size_t,2>> entries;
+      for (size_t c = 0; c < G.height(); c++)
+        entries.push_back ( { c, c } );
+      for (auto & col : m_cols)
+        for (auto [c1, k1] : col)
+          for (auto [c2, k2] : col)
+            entries.push_back ( { c1, c2 } );
+      m_A = SparseMatrix(G.height(), G.height(), std::move(entries));
+
+      size_t bw = m_A.bandwidth()[0];
+      if (bw <= 64)
+        m_band = std::make_unique<BandMatrix>(G.height(), bw, bw);
+    }
+
+    const SparseMatrix & matrix() const { return m_A; }
+
+    // A = G diag(w) G^T, G with the pattern from the constructor
+    void assemble (const SparseMatrix & G, VectorView<double> w)
+    {
+      m_A.setZero();
+      for (size_t j = 0; j < m_cols.size(); j++)
+        for (auto [c1, k1] : m_cols[j])
+          {
+            double val = G.val(k1) * w(j);
+            for (auto [c2, k2] : m_cols[j])
+              m_A(c1, c2) += val * G.val(k2);
+          }
+      // unused constraints (empty rows of G) are decoupled
+      for (size_t c = 0; c < m_A.height(); c++)
+        if (G.firstInRow(c) == G.nextInRow(c))
+          m_A(c,c) = 1;
+
+      if (m_band)
+        {
+          m_band->setZero();
+          for (size_t i = 0; i < m_A.height(); i++)
+            for (size_t k = m_A.firstInRow(i); k < m_A.nextInRow(i); k++)
+              (*m_band)(i, m_A.colNr(k)) = m_A.val(k);
+          m_band->factorCholesky();
+        }
+      else
+        m_solver.setMatrix(m_A);
+    }
+
+    // solve A x = b
+    void solve (VectorView<double> b, VectorView<double> x)
+    {
+      x = b;
+      if (m_band)
+        m_band->solveCholesky(x);
+      else
+        {
+          x = 0.0;
+          m_solver.solve(m_A, b, x);
+        }
+    }
+  };
+
+}
+
+#endif
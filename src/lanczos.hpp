@@ -0,0 +1,257 @@
+#ifndef LANCZOS_HPP
+#define LANCZOS_HPP
+
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+#include "sparsematrix.hpp"
+#include "bandmatrix.hpp"
+
+namespace ASC_ode
+{
+
+  // Eigenvalues and vectors of the symmetric tridiagonal matrix with diagonal d
+  // and off-diagonal e (e[i] couples i and i+1), by the implicit QL method.
+  // On return d holds the eigenvalues in ascending order, and column j of the
+  // row-major n x n matrix z the eigenvector of d[j].
+  inline void TridiagonalEigen (std::vector<double> & d, std::vector<double> e,
+                                std::vector<double> & z)
+  {
+    const size_t n = d.size();
+    const double eps = std::numeric_limits<double>::epsilon();
+    e.resize(n, 0.0);
+    z.assign(n*n, 0.0);
+    for (size_t i = 0; i < n; i++)
+      z[i*n+i] = 1;
+
+    for (size_t l = 0; l < n; l++)
+      {
+        int iter = 0;
+        size_t m;
+        do
+          {
+            for (m = l; m+1 < n; m++)
+              if (std::abs(e[m]) <= eps * (std::abs(d[m]) + std::abs(d[m+1])))
+                break;
+            if (m == l) break;
+            if (iter++ == 60)
+              throw std::domain_error("TridiagonalEigen: no convergence");
+
+            double g = (d[l+1]-d[l]) / (2*e[l]);
+            double r = std::hypot(g, 1.0);
+            g = d[m]-d[l] + e[l] / (g + std::copysign(r, g));
+            double s = 1, c = 1, p = 0;
+            bool underflow = false;
+            for (size_t i = m; i-- > l; )
+              {
+                double f = s*e[i], b = c*e[i];
+                r = std::hypot(f, g);
+                e[i+1] = r;
+                if (r == 0)
+                  {
+                    d[i+1] -= p;
+                    e[m] = 0;
+                    underflow = true;
+                    break;
+                  }
+                s = f/r;
+                c = g/r;
+                g = d[i+1]-p;
+                r = (d[i]-g)*s + 2*c*b;
+                p = s*r;
+                d[i+1] = g+p;
+                g = c*r-b;
+                for (size_t k = 0; k < n; k++)
+                  {
+                    f = z[k*n+i+1];
+                    z[k*n+i+1] = s*z[k*n+i] + c*f;
+                    z[k*n+i] = c*z[k*n+i] - s*f;
+                  }
+              }
+            if (underflow) continue;
+            d[l] -= p;
+            e[l] = g;
+            e[m] = 0;
+          }
+        while (m != l);
+      }
+
+    std::vector<size_t> order(n);
+    std::iota (order.begin(), order.end(), 0);
+    std::sort (order.begin(), order.end(), [&](size_t i, size_t j) { return d[i] < d[j]; });
+    std::vector<double> dsorted(n), zsorted(n*n);
+    for (size_t j = 0; j < n; j++)
+      {
+        dsorted[j] = d[order[j]];
+        for (size_t k = 0; k < n; k++)
+          zsorted[k*n+j] = z[k*n+order[j]];
+      }
+    d = std::move(dsorted);
+    z = std::move(zsorted);
+  }
+
+
+
+  // result of ShiftInvertLanczos
+  struct EigenPairs
+  {
+    std::vector<double> lambda;     // ascending
+    std::vector<double> vectors;    // k x n, row i the vector of lambda[i], M-orthonormal
+    std::vector<double> residual;   // |K phi - lambda M phi|_{M^-1} / (|lambda| + |sigma|)
+    double next = std::numeric_limits<double>::infinity();   // estimate of eigenvalue k+1
+    size_t steps = 0;               // Lanczos steps = solves with K - sigma M
+  };
+
+
+  // The k smallest eigenpairs of K phi = lambda M phi, for sparse symmetric K
+  // and diagonal M = diag(mass) > 0. Lanczos on the shift-invert operator
+  // (K - sigma M)^{-1} M, which is symmetric in the M inner product, with full
+  // reorthogonalization. Eigenvalues close to sigma converge first, so sigma
+  // should be just below the wanted ones; K - sigma M is factored once by a
+  // band Cholesky factorization, its bandwidth comes from the pattern of K.
+  // sigma must lie below the spectrum, then K - sigma M is positive definite
+  // and needs no pivoting; otherwise the factorization fails and
+  // std::invalid_argument is thrown.
+  inline EigenPairs ShiftInvertLanczos (const SparseMatrix & K, const std::vector<double> & mass,
+                                        size_t k, double sigma, double tol = 1e-10)
+  {
+    const size_t n = K.height();
+    if (mass.size() != n)
+      throw std::invalid_argument("ShiftInvertLanczos: need one mass per row");
+    k = std::min(k, n);
+
+    auto [kl, ku] = K.bandwidth();
+    size_t bw = std::max(kl, ku);
+    BandMatrix shifted(n, bw, bw);
+    for (size_t i = 0; i < n; i++)
+      {
+        for (size_t l = K.firstInRow(i); l < K.nextInRow(i); l++)
+          shifted(i, K.colNr(l)) = K.val(l);
+        shifted(i, i) -= sigma * mass[i];
+      }
+    try
+      {
+        shifted.factorCholesky();
+      }
+    catch (std::domain_error &)
+      {
+        throw std::invalid_argument("ShiftInvertLanczos: sigma is not below the smallest eigenvalue");
+      }
+
+    auto mdot = [&](const double * a, const double * b)
+    {
+      double sum = 0;
+      for (size_t i = 0; i < n; i++) sum += mass[i] * a[i] * b[i];
+      return sum;
+    };
+
+    std::vector<double> basis;      // Lanczos vectors, one per row
+    std::vector<double> alpha, beta;
+    std::vector<double> w(n);
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<double> dist(-1, 1);
+
+    // new start vector, M-orthogonal to the basis
+    auto restart = [&]()
+    {
+      for (auto & wi : w) wi = dist(random);
+      for (int pass = 0; pass < 2; pass++)
+        for (size_t j = 0; j < alpha.size(); j++)
+          {
+            double c = mdot(w.data(), &basis[j*n]);
+            for (size_t i = 0; i < n; i++) w[i] -= c * basis[j*n+i];
+          }
+      double nw = std::sqrt(mdot(w.data(), w.data()));
+      for (auto & wi : w) wi /= nw;
+    };
+
+    EigenPairs res;
+    std::vector<double> theta, s;
+    restart();
+    for (size_t j = 0; j < n; j++)
+      {
+        basis.insert (basis.end(), w.begin(), w.end());
+        const double * v = &basis[j*n];
+
+        // w = (K - sigma M)^{-1} M v, orthogonalized twice against the basis
+        for (size_t i = 0; i < n; i++) w[i] = mass[i] * v[i];
+        VectorView<double> wv(n, w.data());
+        shifted.solveCholesky (wv);
+        alpha.push_back (mdot(w.data(), v));
+        for (int pass = 0; pass < 2; pass++)
+          for (size_t l = 0; l <= j; l++)
+            {
+              double c = mdot(w.data(), &basis[l*n]);
+              for (size_t i = 0; i < n; i++) w[i] -= c * basis[l*n+i];
+            }
+        double b = std::sqrt(mdot(w.data(), w.data()));
+        res.steps = j+1;
+
+        // Ritz values theta = 1/(lambda-sigma), the largest belong to the wanted
+        // eigenvalues, with the residual estimates |b s_{j,i}|
+        bool check = j+1 == n || (j+1 >= k && (j+1-k) % 5 == 0);
+        if (check)
+          {
+            theta = alpha;
+            TridiagonalEigen (theta, beta, s);
+            size_t m = j+1;
+            bool converged = true;
+            for (size_t i = m-k; i < m; i++)
+              if (std::abs(b * s[j*m+i]) > tol * std::abs(theta[i]))
+                converged = false;
+            if (converged || m == n)
+              {
+                res.next = (m > k) ? sigma + 1/theta[m-k-1] : std::numeric_limits<double>::infinity();
+                if (m > k && theta[m-k-1] <= 0) res.next = std::numeric_limits<double>::infinity();
+                res.lambda.resize(k);
+                res.vectors.assign(k*n, 0.0);
+                for (size_t r = 0; r < k; r++)
+                  {
+                    size_t i = m-1-r;
+                    res.lambda[r] = sigma + 1/theta[i];
+                    for (size_t l = 0; l < m; l++)
+                      for (size_t q = 0; q < n; q++)
+                        res.vectors[r*n+q] += s[l*m+i] * basis[l*n+q];
+                  }
+                break;
+              }
+          }
+
+        if (j+1 == n) break;
+        beta.push_back (b);
+        if (b > 1e-12 * std::abs(alpha.back()))
+          for (auto & wi : w) wi /= b;
+        else
+          {
+            // invariant subspace, continue with a decoupled block
+            beta.back() = 0;
+            restart();
+          }
+      }
+
+    // true residuals
+    std::vector<double> kphi(n);
+    for (size_t r = 0; r < k; r++)
+      {
+        const double * phi = &res.vectors[r*n];
+        K.mult (VectorView<double>(n, const_cast<double*>(phi)), VectorView<double>(n, kphi.data()));
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+          {
+            double ri = kphi[i] - res.lambda[r] * mass[i] * phi[i];
+            sum += ri*ri / mass[i];
+          }
+        res.residual.push_back (std::sqrt(sum) / (std::abs(res.lambda[r]) + std::abs(sigma)));
+      }
+    return res;
+  }
+
+}
+
+#endif
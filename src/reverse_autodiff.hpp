@@ -0,0 +1,282 @@
+#ifndef REVERSE_AUTODIFF_HPP
+#define REVERSE_AUTODIFF_HPP
+
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <stdexcept>
+
+#include "nonlinfunc.hpp"
+
+namespace ASC_ode
+{
+
+  class Tape;
+
+  // Scalar for reverse mode: its value and its entry on a tape. Values
+  // without a tape (e.g. converted doubles) are constants.
+  class ReverseAD
+  {
+    double m_val = 0;
+    size_t m_index = 0;       // entry 0 of every tape collects the constants
+    Tape * m_tape = nullptr;
+
+    friend class Tape;
+    ReverseAD (Tape * tape, double v, size_t index) : m_val(v), m_index(index), m_tape(tape) { }
+
+    // result of an elementary operation with partial derivatives da, db
+    static inline ReverseAD record (double val, const ReverseAD & a, double da,
+                                    const ReverseAD & b, double db);
+    static ReverseAD record (double val, const ReverseAD & a, double da)
+    {
+      return record (val, a, da, ReverseAD(), 0);
+    }
+
+  public:
+    ReverseAD (double v = 0) : m_val(v) { }
+
+    double value() const { return m_val; }
+    size_t index() const { return m_index; }
+    Tape * tape() const { return m_tape; }
+
+    friend ReverseAD operator+ (const ReverseAD & a, const ReverseAD & b)
+    { return record (a.m_val+b.m_val, a, 1, b, 1); }
+    friend ReverseAD operator- (const ReverseAD & a, const ReverseAD & b)
+    { return record (a.m_val-b.m_val, a, 1, b, -1); }
+    friend ReverseAD operator* (const ReverseAD & a, const ReverseAD & b)
+    { return record (a.m_val*b.m_val, a, b.m_val, b, a.m_val); }
+    friend ReverseAD operator/ (const ReverseAD & a, const ReverseAD & b)
+    {
+      double inv = 1 / b.m_val, q = a.m_val * inv;
+      return record (q, a, inv, b, -q*inv);
+    }
+    friend ReverseAD operator- (const ReverseAD & a) { return record (-a.m_val, a, -1); }
+
+    friend ReverseAD sin (const ReverseAD & a) { return record (std::sin(a.m_val), a, std::cos(a.m_val)); }
+    friend ReverseAD cos (const ReverseAD & a) { return record (std::cos(a.m_val), a, -std::sin(a.m_val)); }
+    friend ReverseAD exp (const ReverseAD & a)
+    {
+      double e = std::exp(a.m_val);
+      return record (e, a, e);
+    }
+    friend ReverseAD log (const ReverseAD & a) { return record (std::log(a.m_val), a, 1/a.m_val); }
+    friend ReverseAD sqrt (const ReverseAD & a)
+    {
+      double s = std::sqrt(a.m_val);
+      return record (s, a, 0.5/s);
+    }
+
+    friend std::ostream & operator<< (std::ostream & os, const ReverseAD & a)
+    {
+      return os << a.m_val;
+    }
+  };
+
+
+  // Tape of elementary operations: per entry the (at most two) arguments and
+  // the partial derivatives with respect to them. Unused arguments point to
+  // entry 0, so the reverse sweep has no branches. The entries are kept in
+  // one array whose memory stays in place when the tape is rewound, so
+  // recording the same computation again does not allocate.
+  //
+  // Sections: record from m = mark(), sweep them with reverse(m, size()),
+  // then rewind(m). Adjoints of values recorded before m keep what the
+  // section contributed, so a long computation can be differentiated section
+  // by section, recomputing each one from a checkpoint.
+  class Tape
+  {
+    struct Entry
+    {
+      size_t arg[2];
+      double partial[2];
+    };
+    std::vector<Entry> m_entries;
+    std::vector<double> m_adjoint;
+
+    friend class ReverseAD;
+    size_t push (size_t a, double da, size_t b, double db)
+    {
+      m_entries.push_back ( { { a, b }, { da, db } } );
+      return m_entries.size()-1;
+    }
+
+  public:
+    Tape (size_t reserve = 1024)
+    {
+      m_entries.reserve (std::max<size_t>(reserve, 1));
+      push (0, 0, 0, 0);
+    }
+
+    // new independent variable
+    ReverseAD variable (double v)
+    {
+      return ReverseAD(this, v, push(0, 0, 0, 0));
+    }
+
+    size_t size() const { return m_entries.size(); }
+    size_t mark() const { return size(); }
+    void rewind (size_t mark) { m_entries.resize (std::max<size_t>(mark, 1)); }
+    void clear() { rewind(1); }
+
+    // scalar adjoints, one per entry
+    void clearAdjoints() { m_adjoint.assign (size(), 0.0); }
+
+    // adjoint of v, 0 for values which are not on this tape
+    double adjoint (const ReverseAD & v) const
+    {
+      if (v.tape() != this || v.index() >= std::min(size(), m_adjoint.size()))
+        return 0;
+      return m_adjoint[v.index()];
+    }
+
+    // adjoint of v += a, e.g. to seed a sweep; constants have no adjoint
+    void addAdjoint (const ReverseAD & v, double a)
+    {
+      if (v.tape() != this) return;
+      if (v.index() >= size())
+        throw std::logic_error("Tape::addAdjoint: value has been rewound");
+      if (m_adjoint.size() < size())
+        m_adjoint.resize (size(), 0.0);
+      m_adjoint[v.index()] += a;
+    }
+
+    // adjoint[arg] += partial * adjoint[entry], for the entries [from, to) backwards
+    void reverse (size_t from, size_t to)
+    {
+      if (m_adjoint.size() < size())
+        m_adjoint.resize (size(), 0.0);
+      for (size_t k = to; k-- > std::max<size_t>(from, 1); )
+        {
+          const Entry & e = m_entries[k];
+          double a = m_adjoint[k];
+          m_adjoint[e.arg[0]] += e.partial[0] * a;
+          m_adjoint[e.arg[1]] += e.partial[1] * a;
+        }
+    }
+
+    // d y / d v for all entries v, read by adjoint(v)
+    void gradient (const ReverseAD & y)
+    {
+      clearAdjoints();
+      if (y.tape() != this) return;
+      m_adjoint[y.index()] = 1;
+      reverse (1, size());
+    }
+
+    // W adjoints per entry in one sweep, e.g. W rows of a Jacobian;
+    // adjoint must have size() entries
+    template <size_t W>
+    void reverse (std::vector<std::array<double,W>> & adjoint, size_t from, size_t to) const
+    {
+      for (size_t k = to; k-- > std::max<size_t>(from, 1); )
+        {
+          const Entry & e = m_entries[k];
+          const std::array<double,W> a = adjoint[k];
+          std::array<double,W> & a0 = adjoint[e.arg[0]];
+          std::array<double,W> & a1 = adjoint[e.arg[1]];
+          for (size_t w = 0; w < W; w++)
+            a0[w] += e.partial[0] * a[w];
+          for (size_t w = 0; w < W; w++)
+            a1[w] += e.partial[1] * a[w];
+        }
+    }
+  };
+
+
+  inline ReverseAD ReverseAD::record (double val, const ReverseAD & a, double da,
+                                      const ReverseAD & b, double db)
+  {
+    Tape * tape = a.m_tape ? a.m_tape : b.m_tape;
+    if (!tape) return ReverseAD(val);
+    if (b.m_tape && b.m_tape != tape)
+      throw std::logic_error("ReverseAD: operands are on different tapes");
+    return ReverseAD(tape, val, tape->push(a.m_index, da, b.m_index, db));
+  }
+
+
+
+  // value and gradient of a scalar functor (dimF = 1, same signature as for
+  // AutoDiffFunction) by one taped evaluation and one reverse sweep
+  template <typename FUNC>
+  double Gradient (const FUNC & func, VectorView<double> x, VectorView<double> grad, Tape & tape)
+  {
+    size_t n = x.size();
+    tape.clear();
+    std::vector<ReverseAD> rx, rf(1);
+    rx.reserve(n);
+    for (size_t i = 0; i < n; i++)
+      rx.push_back (tape.variable(x(i)));
+    func (VectorView<ReverseAD>(n, rx.data()), VectorView<ReverseAD>(1, rf.data()));
+
+    tape.gradient (rf[0]);
+    for (size_t i = 0; i < n; i++)
+      grad(i) = tape.adjoint(rx[i]);
+    return rf[0].value();
+  }
+
+
+  // NonlinearFunction from a templated functor as for AutoDiffFunction, the
+  // Jacobian by reverse mode: one taped evaluation, then W rows per sweep.
+  // Pays off for dimF much smaller than dimX.
+  template <size_t W, typename FUNC>
+  class ReverseAutoDiffFunction : public NonlinearFunction
+  {
+    FUNC m_func;
+    size_t m_dimx, m_dimf;
+    mutable Tape m_tape;
+    mutable std::vector<ReverseAD> m_x, m_f;
+    mutable std::vector<std::array<double,W>> m_adjoint;
+
+  public:
+    ReverseAutoDiffFunction (FUNC func, size_t dimx, size_t dimf)
+      : m_func(func), m_dimx(dimx), m_dimf(dimf), m_x(dimx), m_f(dimf) { }
+
+    size_t dimX() const override { return m_dimx; }
+    size_t dimF() const override { return m_dimf; }
+
+    FUNC & func() { return m_func; }
+    const Tape & tape() const { return m_tape; }
+
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      m_func (x, f);
+    }
+
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      m_tape.clear();
+      for (size_t j = 0; j < m_dimx; j++)
+        m_x[j] = m_tape.variable(x(j));
+      m_func (VectorView<ReverseAD>(m_dimx, m_x.data()),
+              VectorView<ReverseAD>(m_dimf, m_f.data()));
+
+      for (size_t first = 0; first < m_dimf; first += W)
+        {
+          size_t num = std::min(W, m_dimf-first);
+          m_adjoint.assign (m_tape.size(), std::array<double,W>{});
+          for (size_t i = 0; i < num; i++)
+            if (m_f[first+i].tape() == &m_tape)
+              m_adjoint[m_f[first+i].index()][i] += 1;
+          m_tape.reverse (m_adjoint, 1, m_tape.size());
+
+          for (size_t i = 0; i < num; i++)
+            for (size_t j = 0; j < m_dimx; j++)
+              df(first+i, j) = m_adjoint[m_x[j].index()][i];
+        }
+    }
+  };
+
+
+  template <size_t W = 4, typename FUNC>
+  auto MakeReverseAutoDiffFunction (FUNC func, size_t dimx, size_t dimf)
+  {
+    return std::make_shared<ReverseAutoDiffFunction<W,FUNC>> (func, dimx, dimf);
+  }
+
+}
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef SENSITIVITY_HPP
+#define SENSITIVITY_HPP
+
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+#include <vector.hpp>
+#include <matrix.hpp>
+#include <inverse.hpp>
+
+#include "nonlinfunc.hpp"
+#include "autodiff.hpp"
+
+namespace ASC_ode
+{
+
+  // right hand side f(x, p) with parameters p, e.g. stiffness, masses, R and C
+  class ParametricFunction : public NonlinearFunction
+  {
+  public:
+    virtual size_t numParams() const = 0;
+    virtual void setParameters (VectorView<double> p) = 0;
+    virtual void getParameters (VectorView<double> p) const = 0;
+    // df/dp, dimF x numParams
+    virtual void evaluateParamDeriv (VectorView<double> x, MatrixView<double> dfdp) const = 0;
+  };
+
+
+  // ParametricFunction from a functor with a templated call operator
+  //
+  //    template <typename T>
+  //    void operator() (VectorView<T> x, VectorView<T> p, VectorView<T> f) const
+  //
+  // both derivatives by AutoDiff<N>, N columns per sweep as in AutoDiffFunction
+  template <size_t N, typename FUNC>
+  class ParametricAutoDiffFunction : public ParametricFunction
+  {
+    FUNC m_func;
+    size_t m_dimx, m_dimf;
+    std::vector<double> m_p;
+    mutable std::vector<AutoDiff<N>> m_x, m_par, m_f;
+
+    // derivatives with respect to x (seedx) or p, columns [first, first+num)
+    void sweep (VectorView<double> x, bool seedx, size_t first, size_t num) const
+    {
+      for (size_t i = 0; i < m_dimx; i++)
+        m_x[i] = AutoDiff<N>(x(i));
+      for (size_t i = 0; i < m_p.size(); i++)
+        m_par[i] = AutoDiff<N>(m_p[i]);
+      auto & seed = seedx ? m_x : m_par;
+      for (size_t j = 0; j < num; j++)
+        seed[first+j].deriv()[j] = 1;
+
+      m_func (VectorView<AutoDiff<N>>(m_dimx, m_x.data()),
+              VectorView<AutoDiff<N>>(m_par.size(), m_par.data()),
+              VectorView<AutoDiff<N>>(m_dimf, m_f.data()));
+    }
+
+  public:
+    ParametricAutoDiffFunction (FUNC func, size_t dimx, size_t dimf, std::vector<double> p)
+      : m_func(func), m_dimx(dimx), m_dimf(dimf), m_p(std::move(p)),
+        m_x(dimx), m_par(m_p.size()), m_f(dimf) { }
+
+    size_t dimX() const override { return m_dimx; }
+    size_t dimF() const override { return m_dimf; }
+    size_t numParams() const override { return m_p.size(); }
+
+    FUNC & func() { return m_func; }
+
+    void setParameters (VectorView<double> p) override
+    {
+      for (size_t i = 0; i < m_p.size(); i++)
+        m_p[i] = p(i);
+    }
+
+    void getParameters (VectorView<double> p) const override
+    {
+      for (size_t i = 0; i < m_p.size(); i++)
+        p(i) = m_p[i];
+    }
+
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      m_func (x, VectorView<double>(m_p.size(), const_cast<double*>(m_p.data())), f);
+    }
+
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      for (size_t first = 0; first < m_dimx; first += N)
+        {
+          size_t num = std::min(N, m_dimx-first);
+          sweep (x, true, first, num);
+          for (size_t i = 0; i < m_dimf; i++)
+            for (size_t j = 0; j < num; j++)
+              df(i, first+j) = m_f[i].deriv()[j];
+        }
+    }
+
+    void evaluateParamDeriv (VectorView<double> x, MatrixView<double> dfdp) const override
+    {
+      for (size_t first = 0; first < m_p.size(); first += N)
+        {
+          size_t num = std::min(N, m_p.size()-first);
+          sweep (x, false, first, num);
+          for (size_t i = 0; i < m_dimf; i++)
+            for (size_t j = 0; j < num; j++)
+              dfdp(i, first+j) = m_f[i].deriv()[j];
+        }
+    }
+  };
+
+
+  template <size_t N = 8, typename FUNC>
+  auto MakeParametricAutoDiffFunction (FUNC func, size_t dimx, size_t dimf, std::vector<double> p)
+  {
+    return std::make_shared<ParametricAutoDiffFunction<N,FUNC>> (func, dimx, dimf, std::move(p));
+  }
+
+
+
+  // Stages k_j = f(y + tau sum_i a_ji k_i, p) of a Runge-Kutta step with the
+  // Jacobians at the stage values, for the sensitivity and adjoint steppers.
+  // Explicit for a strictly lower triangular a, else all stages by Newton as
+  // ImplicitRungeKutta does (implicit Euler: a = b = c = 1, Crank-Nicolson:
+  // a = [[0,0],[1/2,1/2]], b = [1/2,1/2], Gauss, Radau). After Newton
+  // converged, the stage matrix
+  //
+  //    M = I - blockdiag(J(Y_j)) (tau a x I),   block (j,i) = delta_ji I - tau a_ji J(Y_j)
+  //
+  // is set up and inverted once more at the solution.
+  class RungeKuttaStages
+  {
+    std::shared_ptr<ParametricFunction> m_rhs;
+    Matrix<> m_a;
+    Vector<> m_b, m_c;
+    size_t m_stages, m_n, m_np;
+    bool m_explicit;
+    double m_tol;
+    int m_maxsteps;
+
+    Vector<> m_k, m_ystage, m_f, m_res;
+    std::vector<Matrix<>> m_jac, m_fp;
+    Matrix<> m_inv;
+
+    // stage value y + tau sum_i a_ji k_i, of the i < upto
+    void stageValue (double tau, VectorView<double> y, size_t j, size_t upto)
+    {
+      VectorView<double> yj = stageValue(j);
+      for (size_t l = 0; l < m_n; l++)
+        yj(l) = y(l);
+      for (size_t i = 0; i < upto; i++)
+        if (m_a(j,i) != 0)
+          for (size_t l = 0; l < m_n; l++)
+            yj(l) += tau * m_a(j,i) * m_k(i*m_n+l);
+    }
+
+    // with jacobians = false, the Jacobians and M^{-1} are only computed
+    // as far as Newton needs them, not at the converged stages
+    void solveNewton (double tau, VectorView<double> y, bool jacobians)
+    {
+      size_t sn = m_stages*m_n;
+      for (size_t j = 0; j < m_stages; j++)
+        m_rhs->evaluate (y, stage(j));
+
+      for (int it = 0; it <= m_maxsteps; it++)
+        {
+          double err = 0;
+          for (size_t j = 0; j < m_stages; j++)
+            {
+              stageValue (tau, y, j, m_stages);
+              m_rhs->evaluate (stageValue(j), m_f);
+              for (size_t l = 0; l < m_n; l++)
+                {
+                  m_res(j*m_n+l) = m_k(j*m_n+l) - m_f(l);
+                  err += m_res(j*m_n+l) * m_res(j*m_n+l);
+                }
+            }
+          bool converged = std::sqrt(err) < m_tol;
+          if (converged && !jacobians) return;
+
+          for (size_t j = 0; j < m_stages; j++)
+            m_rhs->evaluateDeriv (stageValue(j), m_jac[j]);
+          for (size_t j = 0; j < m_stages; j++)
+            for (size_t i = 0; i < m_stages; i++)
+              for (size_t l = 0; l < m_n; l++)
+                for (size_t r = 0; r < m_n; r++)
+                  m_inv(j*m_n+l, i*m_n+r) = ((i == j && l == r) ? 1.0 : 0.0)
+                    - tau * m_a(j,i) * m_jac[j](l,r);
+          calcInverse (m_inv);
+
+          if (converged) return;
+          if (it == m_maxsteps) break;
+
+          for (size_t row = 0; row < sn; row++)
+            {
+              double sum = 0;
+              for (size_t col = 0; col < sn; col++)
+                sum += m_inv(row, col) * m_res(col);
+              m_k(row) -= sum;
+            }
+        }
+      throw std::domain_error("Newton did not converge");
+    }
+
+  public:
+    RungeKuttaStages (std::shared_ptr<ParametricFunction> rhs,
+                      const Matrix<> & a, const Vector<> & b, const Vector<> & c,
+                      double tol = 1e-10, int maxsteps = 10)
+      : m_rhs(rhs), m_a(a), m_b(b), m_c(c),
+        m_stages(c.size()), m_n(rhs->dimX()), m_np(rhs->numParams()),
+        m_explicit(true), m_tol(tol), m_maxsteps(maxsteps),
+        m_k(m_stages*m_n), m_ystage(m_stages*m_n), m_f(m_n), m_res(m_stages*m_n),
+        m_jac(m_stages, Matrix<>(m_n, m_n)), m_fp(m_stages, Matrix<>(m_n, m_np)),
+        m_inv(m_stages*m_n, m_stages*m_n)
+    {
+      for (size_t j = 0; j < m_stages; j++)
+        for (size_t i = j; i < m_stages; i++)
+          if (m_a(j,i) != 0) m_explicit = false;
+    }
+
+    size_t numStages() const { return m_stages; }
+    size_t size() const { return m_n; }
+    size_t numParams() const { return m_np; }
+    bool isExplicit() const { return m_explicit; }
+    double a (size_t j, size_t i) const { return m_a(j,i); }
+    double b (size_t j) const { return m_b(j); }
+
+    VectorView<double> stage (size_t j) { return m_k.range(j*m_n, (j+1)*m_n); }
+    VectorView<double> stageValue (size_t j) { return m_ystage.range(j*m_n, (j+1)*m_n); }
+    // df/dx and, after paramDerivs, df/dp at stage value j
+    MatrixView<double> jacobian (size_t j) { return m_jac[j]; }
+    MatrixView<double> paramJacobian (size_t j) { return m_fp[j]; }
+    // M^{-1}, implicit methods only
+    MatrixView<double> stageInverse() { return m_inv; }
+
+    // stages and Jacobians of the step from y
+    void solve (double tau, VectorView<double> y)
+    {
+      if (!m_explicit)
+        {
+          solveNewton (tau, y, true);
+          return;
+        }
+      for (size_t j = 0; j < m_stages; j++)
+        {
+          stageValue (tau, y, j, j);
+          m_rhs->evaluate (stageValue(j), stage(j));
+          m_rhs->evaluateDeriv (stageValue(j), m_jac[j]);
+        }
+    }
+
+    // stages of the step from y only, for advancing the state;
+    // jacobian() and stageInverse() are not valid afterwards
+    void solveValues (double tau, VectorView<double> y)
+    {
+      if (!m_explicit)
+        {
+          solveNewton (tau, y, false);
+          return;
+        }
+      for (size_t j = 0; j < m_stages; j++)
+        {
+          stageValue (tau, y, j, j);
+          m_rhs->evaluate (stageValue(j), stage(j));
+        }
+    }
+
+    void paramDerivs()
+    {
+      for (size_t j = 0; j < m_stages; j++)
+        m_rhs->evaluateParamDeriv (stageValue(j), m_fp[j]);
+    }
+
+    // y += tau sum_j b_j k_j
+    void update (double tau, VectorView<double> y) const
+    {
+      for (size_t j = 0; j < m_stages; j++)
+        if (m_b(j) != 0)
+          for (size_t l = 0; l < m_n; l++)
+            y(l) += tau * m_b(j) * m_k(j*m_n+l);
+    }
+  };
+
+
+
+  // Runge-Kutta step which also advances the sensitivities S = dy/dp (n x P),
+  // the exact derivative of the discrete solution. Staggered: the stage
+  // derivatives
+  //
+  //    dk_j = J(Y_j) (S + tau sum_i a_ji dk_i) + f_p(Y_j)
+  //
+  // are found by forward substitution for explicit methods, else by applying
+  // M^{-1} from the converged Newton iteration to all P right hand sides. So
+  // the P sensitivities cost one Jacobian, one inversion and matrix products
+  // per step instead of P more simulations.
+  class SensitivityRungeKutta
+  {
+    RungeKuttaStages m_rk;
+    size_t m_n, m_np, m_stages;
+    Matrix<> m_rhss, m_dk, m_ss;
+
+  public:
+    SensitivityRungeKutta (std::shared_ptr<ParametricFunction> rhs,
+                           const Matrix<> & a, const Vector<> & b, const Vector<> & c,
+                           double tol = 1e-10, int maxsteps = 10)
+      : m_rk(rhs, a, b, c, tol, maxsteps),
+        m_n(m_rk.size()), m_np(m_rk.numParams()), m_stages(m_rk.numStages()),
+        m_rhss(m_stages*m_n, m_np), m_dk(m_stages*m_n, m_np), m_ss(m_n, m_np) { }
+
+    size_t numParams() const { return m_np; }
+
+    // advances y and its sensitivities s = dy/dp by one step
+    void doStep (double tau, VectorView<double> y, MatrixView<double> s)
+    {
+      m_rk.solve (tau, y);
+      m_rk.paramDerivs();
+
+      for (size_t j = 0; j < m_stages; j++)
+        {
+          // explicit: stage sensitivity S + tau sum_{i<j} a_ji dk_i
+          for (size_t l = 0; l < m_n; l++)
+            for (size_t q = 0; q < m_np; q++)
+              m_ss(l,q) = s(l,q);
+          if (m_rk.isExplicit())
+            for (size_t i = 0; i < j; i++)
+              if (m_rk.a(j,i) != 0)
+                for (size_t l = 0; l < m_n; l++)
+                  for (size_t q = 0; q < m_np; q++)
+                    m_ss(l,q) += tau * m_rk.a(j,i) * m_dk(i*m_n+l, q);
+
+          MatrixView<double> jac = m_rk.jacobian(j), fp = m_rk.paramJacobian(j);
+          MatrixView<double> target = m_rk.isExplicit() ? m_dk : m_rhss;
+          for (size_t l = 0; l < m_n; l++)
+            for (size_t q = 0; q < m_np; q++)
+              {
+                double sum = fp(l,q);
+                for (size_t r = 0; r < m_n; r++)
+                  sum += jac(l,r) * m_ss(r,q);
+                target(j*m_n+l, q) = sum;
+              }
+        }
+
+      if (!m_rk.isExplicit())
+        {
+          MatrixView<double> inv = m_rk.stageInverse();
+          size_t sn = m_stages*m_n;
+          for (size_t row = 0; row < sn; row++)
+            for (size_t q = 0; q < m_np; q++)
+              {
+                double sum = 0;
+                for (size_t col = 0; col < sn; col++)
+                  sum += inv(row, col) * m_rhss(col, q);
+                m_dk(row, q) = sum;
+              }
+        }
+
+      for (size_t j = 0; j < m_stages; j++)
+        {
+          double fac = tau * m_rk.b(j);
+          if (fac == 0) continue;
+          for (size_t l = 0; l < m_n; l++)
+            for (size_t q = 0; q < m_np; q++)
+              s(l,q) += fac * m_dk(j*m_n+l, q);
+        }
+      m_rk.update (tau, y);
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <array>
+#include <limits>
+#include <bit>
+#include <ostream>
+
+// GCC and clang vector extensions map SIMD<W> to SSE/AVX/AVX-512 registers
+// (whatever -march allows, see the CMake option ASC_ODE_NATIVE; wider
+// packs are split). Other compilers, or ASC_ODE_NO_SIMD, get the scalar
+// fallback: plain loops over the lanes.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(ASC_ODE_NO_SIMD)
+#define ASC_ODE_VECTOR_EXT
+#endif
+
+namespace ASC_ode
+{
+
+#ifdef ASC_ODE_VECTOR_EXT
+  // vector types per width, vector_size has to be a literal
+  template <size_t W> struct SIMDRegister;
+  template <> struct SIMDRegister<1>
+  {
+    typedef double TV __attribute__ ((vector_size (8)));
+    typedef int64_t TI __attribute__ ((vector_size (8)));
+  };
+  template <> struct SIMDRegister<2>
+  {
+    typedef double TV __attribute__ ((vector_size (16)));
+    typedef int64_t TI __attribute__ ((vector_size (16)));
+  };
+  template <> struct SIMDRegister<4>
+  {
+    typedef double TV __attribute__ ((vector_size (32)));
+    typedef int64_t TI __attribute__ ((vector_size (32)));
+  };
+  template <> struct SIMDRegister<8>
+  {
+    typedef double TV __attribute__ ((vector_size (64)));
+    typedef int64_t TI __attribute__ ((vector_size (64)));
+  };
+#endif
+
+  // doubles per register of the target, packs wider than that are split
+  // into several registers and lose most of the gain
+#if defined(__AVX512F__)
+  inline constexpr size_t SIMDWidth = 8;
+#elif defined(__AVX__)
+  inline constexpr size_t SIMDWidth = 4;
+#else
+  inline constexpr size_t SIMDWidth = 2;
+#endif
+
+
+  // W doubles processed together, e.g. the same expression at W points.
+  // Arithmetic is lane-wise, doubles convert to all lanes, so a pack can be
+  // the value type of AutoDiff<N, SIMD<W>>: one evaluation gives values and
+  // derivatives at W points. Comparisons only select lanes (ifLess, ifNaN),
+  // code on packs must not branch on values.
+  template <size_t W>
+  class SIMD
+  {
+#ifdef ASC_ODE_VECTOR_EXT
+    static_assert (W == 1 || W == 2 || W == 4 || W == 8, "SIMD: 1, 2, 4 or 8 lanes");
+    using TV = typename SIMDRegister<W>::TV;
+    using TI = typename SIMDRegister<W>::TI;
+    TV m_v;
+    SIMD (TV v) : m_v(v) { }
+#else
+    std::array<double, W> m_v;
+#endif
+
+  public:
+    static constexpr size_t SIZE = W;
+
+    SIMD () : SIMD(0.0) { }
+#ifdef ASC_ODE_VECTOR_EXT
+    SIMD (double v) : m_v(v - TV{}) { }     // broadcast, v - 0 folds away (v + 0 does not)
+#else
+    SIMD (double v) { m_v.fill(v); }
+#endif
+    // W values from p
+    static SIMD load (const double * p)
+    {
+      SIMD res;
+      std::memcpy (&res.m_v, p, sizeof(res.m_v));
+      return res;
+    }
+
+    void store (double * p) const { std::memcpy (p, &m_v, sizeof(m_v)); }
+    double operator[] (size_t i) const { return m_v[i]; }
+    void set (size_t i, double v) { m_v[i] = v; }
+
+#ifdef ASC_ODE_VECTOR_EXT
+    friend SIMD operator+ (SIMD a, SIMD b) { return a.m_v + b.m_v; }
+    friend SIMD operator- (SIMD a, SIMD b) { return a.m_v - b.m_v; }
+    friend SIMD operator* (SIMD a, SIMD b) { return a.m_v * b.m_v; }
+    friend SIMD operator/ (SIMD a, SIMD b) { return a.m_v / b.m_v; }
+    friend SIMD operator- (SIMD a) { return -a.m_v; }
+    friend SIMD min (SIMD a, SIMD b) { return a.m_v < b.m_v ? a.m_v : b.m_v; }
+    friend SIMD max (SIMD a, SIMD b) { return a.m_v > b.m_v ? a.m_v : b.m_v; }
+    // lane-wise  a < b ? x : y,  and  a is NaN ? x : y
+    friend SIMD ifLess (SIMD a, SIMD b, SIMD x, SIMD y) { return a.m_v < b.m_v ? x.m_v : y.m_v; }
+    friend SIMD ifNaN (SIMD a, SIMD x, SIMD y) { return a.m_v != a.m_v ? x.m_v : y.m_v; }
+#else
+    friend SIMD operator+ (SIMD a, SIMD b) { return a.lanes (b, [](double x, double y) { return x+y; }); }
+    friend SIMD operator- (SIMD a, SIMD b) { return a.lanes (b, [](double x, double y) { return x-y; }); }
+    friend SIMD operator* (SIMD a, SIMD b) { return a.lanes (b, [](double x, double y) { return x*y; }); }
+    friend SIMD operator/ (SIMD a, SIMD b) { return a.lanes (b, [](double x, double y) { return x/y; }); }
+    friend SIMD operator- (SIMD a) { return SIMD(0.0) - a; }
+    friend SIMD min (SIMD a, SIMD b) { return a.lanes (b, [](double x, double y) { return x < y ? x : y; }); }
+    friend SIMD max (SIMD a, SIMD b) { return a.lanes (b, [](double x, double y) { return x > y ? x : y; }); }
+    friend SIMD ifLess (SIMD a, SIMD b, SIMD x, SIMD y)
+    {
+      SIMD res;
+      for (size_t i = 0; i < W; i++) res.m_v[i] = a.m_v[i] < b.m_v[i] ? x.m_v[i] : y.m_v[i];
+      return res;
+    }
+    friend SIMD ifNaN (SIMD a, SIMD x, SIMD y)
+    {
+      SIMD res;
+      for (size_t i = 0; i < W; i++) res.m_v[i] = a.m_v[i] != a.m_v[i] ? x.m_v[i] : y.m_v[i];
+      return res;
+    }
+#endif
+
+    SIMD & operator+= (SIMD b) { return *this = *this + b; }
+    SIMD & operator-= (SIMD b) { return *this = *this - b; }
+    SIMD & operator*= (SIMD b) { return *this = *this * b; }
+    SIMD & operator/= (SIMD b) { return *this = *this / b; }
+
+    friend SIMD sqrt (SIMD a)
+    {
+      SIMD res;
+      for (size_t i = 0; i < W; i++) res.m_v[i] = std::sqrt(a.m_v[i]);
+      return res;
+    }
+
+    // nearest integer, for |a| < 2^51 (adding 1.5 2^52 rounds away the
+    // fraction; not with -ffast-math, which may drop the pair)
+    friend SIMD round (SIMD a)
+    {
+      const SIMD magic(6755399441055744.0);
+      return (a + magic) - magic;
+    }
+
+    // 2^n for integer n in [-1022, 1023]: n+1023 into the exponent bits
+    friend SIMD pow2i (SIMD n)
+    {
+      SIMD t = n + SIMD(4503599627370496.0 + 1023.0);
+      SIMD res;
+#ifdef ASC_ODE_VECTOR_EXT
+      res.m_v = (TV)((TI)t.m_v << 52);
+#else
+      for (size_t i = 0; i < W; i++)
+        res.m_v[i] = std::bit_cast<double>(std::bit_cast<uint64_t>(t.m_v[i]) << 52);
+#endif
+      return res;
+    }
+
+    // a = m 2^e with m in [1,2), for positive normal a
+    friend void splitExponent (SIMD a, SIMD & m, SIMD & e)
+    {
+      const uint64_t mantissa = 0x000FFFFFFFFFFFFFull, one = 0x3FF0000000000000ull;
+#ifdef ASC_ODE_VECTOR_EXT
+      TI bits = (TI)a.m_v;
+      m.m_v = (TV)((bits & int64_t(mantissa)) | int64_t(one));
+      // biased exponent into the mantissa of 2^52 (no int64 -> double before AVX-512)
+      e.m_v = (TV)(((bits >> 52) & 0x7FF) | 0x4330000000000000ll) - (4503599627370496.0 + 1023.0);
+#else
+      for (size_t i = 0; i < W; i++)
+        {
+          uint64_t bits = std::bit_cast<uint64_t>(a.m_v[i]);
+          m.m_v[i] = std::bit_cast<double>((bits & mantissa) | one);
+          e.m_v[i] = double(int64_t((bits >> 52) & 0x7FF)) - 1023.0;
+        }
+#endif
+    }
+
+    friend std::ostream & operator<< (std::ostream & os, SIMD a)
+    {
+      os << "(";
+      for (size_t i = 0; i < W; i++)
+        os << a.m_v[i] << (i+1 < W ? ", " : ")");
+      return os;
+    }
+
+  private:
+#ifndef ASC_ODE_VECTOR_EXT
+    template <typename OP>
+    SIMD lanes (SIMD b, OP op) const
+    {
+      SIMD res;
+      for (size_t i = 0; i < W; i++) res.m_v[i] = op(m_v[i], b.m_v[i]);
+      return res;
+    }
+#endif
+  };
+
+
+
+  // -------------------------------------------------------------
+  // Elementary functions on packs: argument reduction and the minimax
+  // polynomials of fdlibm in pack arithmetic, no branches, so all lanes go
+  // through the same instructions. Relative error within 2 ulp.
+  // -------------------------------------------------------------
+
+  namespace simd_detail
+  {
+    template <size_t W, size_t K>
+    SIMD<W> Horner (SIMD<W> x, const double (&c)[K])
+    {
+      SIMD<W> sum(c[K-1]);
+      for (size_t k = K-1; k-- > 0; )
+        sum = sum * x + SIMD<W>(c[k]);
+      return sum;
+    }
+
+    // 0 for even, 1 for odd integer n
+    template <size_t W>
+    SIMD<W> Odd (SIMD<W> n)
+    {
+      return n - 2.0 * round(0.5*n - 0.25);
+    }
+
+    // sin and cos for |r| <= pi/4 (__kernel_sin, __kernel_cos)
+    template <size_t W>
+    void SinCosKernel (SIMD<W> r, SIMD<W> & s, SIMD<W> & c)
+    {
+      static constexpr double sc[] = { -1.66666666666666324348e-01, 8.33333333332248946124e-03,
+                                       -1.98412698298579493134e-04, 2.75573137070700676789e-06,
+                                       -2.50507602534068634195e-08, 1.58969099521155010221e-10 };
+      static constexpr double cc[] = { 4.16666666666666019037e-02, -1.38888888888741095749e-03,
+                                       2.48015872894767294178e-05, -2.75573143513906633035e-07,
+                                       2.08757232129817482790e-09, -1.13596475577881948265e-11 };
+      SIMD<W> z = r*r;
+      s = r + (r*z) * Horner (z, sc);
+      c = (1.0 - 0.5*z) + (z*z) * Horner (z, cc);
+    }
+
+    // x = r + q pi/2 with |r| <= pi/4, pi/2 in three parts
+    template <size_t W>
+    SIMD<W> ReduceHalfPi (SIMD<W> x, SIMD<W> & q)
+    {
+      q = round (x * 0.63661977236758134308);
+      return ((x - q * 1.57079632673412561417e+00)
+              - q * 6.07710050630396597660e-11) - q * 2.02226624871116645580e-21;
+    }
+  }
+
+
+  // sin(r + q pi/2): quadrant 0..3 gives sin r, cos r, -sin r, -cos r.
+  // The reduction is accurate for |x| up to about 10^6.
+  template <size_t W>
+  void sincos (SIMD<W> x, SIMD<W> & s, SIMD<W> & c)
+  {
+    using namespace simd_detail;
+    SIMD<W> q, sr, cr;
+    SIMD<W> r = ReduceHalfPi (x, q);
+    SinCosKernel (r, sr, cr);
+    SIMD<W> odd = Odd(q);
+    SIMD<W> sign = 1.0 - 2.0 * Odd(round(0.5*q - 0.25));
+    s = sign * (odd * cr + (1.0-odd) * sr);
+    c = sign * ((1.0-odd) * cr - odd * sr);
+  }
+
+  template <size_t W>
+  SIMD<W> sin (SIMD<W> x)
+  {
+    SIMD<W> s, c;
+    sincos (x, s, c);
+    return s;
+  }
+
+  template <size_t W>
+  SIMD<W> cos (SIMD<W> x)
+  {
+    SIMD<W> s, c;
+    sincos (x, s, c);
+    return c;
+  }
+
+  // exp(x) = 2^n exp(r), |r| <= ln2/2, exp(r) = 1 + r + r c/(2-c) with
+  // c = r - r^2 P(r^2) (__ieee754_exp). 2^n is applied in two factors, so
+  // subnormal results come out right; overflow (inf), underflow (0) and
+  // NaN are set by lane selects
+  template <size_t W>
+  SIMD<W> exp (SIMD<W> x)
+  {
+    static constexpr double ec[] = { 1.66666666666666019037e-01, -2.77777777770155933842e-03,
+                                     6.61375632143793436117e-05, -1.65339022054652515390e-06,
+                                     4.13813679705723846039e-08 };
+    SIMD<W> xc = max (min (x, SIMD<W>(710.0)), SIMD<W>(-746.0));
+    SIMD<W> n = round (xc * 1.44269504088896338700);
+    SIMD<W> r = (xc - n * 6.93147180369123816490e-01) - n * 1.90821492927058770002e-10;
+    SIMD<W> z = r*r;
+    SIMD<W> c = r - z * simd_detail::Horner (z, ec);
+    SIMD<W> n1 = round (0.5*n - 0.25);     // floor(n/2), both factors normal
+    SIMD<W> res = ((1.0 + (r + r*c / (2.0-c))) * pow2i(n1)) * pow2i(n-n1);
+
+    res = ifLess (SIMD<W>(7.09782712893383973096e+02), x,
+                  SIMD<W>(std::numeric_limits<double>::infinity()), res);
+    res = ifLess (x, SIMD<W>(-7.45133219101941108420e+02), SIMD<W>(0.0), res);
+    return ifNaN (x, x, res);
+  }
+
+  // x = m 2^e, m in [sqrt(1/2), sqrt(2)): log m = 2s + s R(s^2) with
+  // s = (m-1)/(m+1) (__ieee754_log). Subnormals are scaled by 2^52 first;
+  // log(0) = -inf, negative x and NaN give NaN, log(inf) = inf by lane selects
+  template <size_t W>
+  SIMD<W> log (SIMD<W> x)
+  {
+    static constexpr double lc[] = { 6.666666666666735130e-01, 3.999999999940941908e-01,
+                                     2.857142874366239149e-01, 2.222219843214978396e-01,
+                                     1.818357216161805012e-01, 1.531383769920937332e-01,
+                                     1.479819860511658591e-01 };
+    const SIMD<W> minnormal(std::numeric_limits<double>::min());
+    SIMD<W> m, e;
+    splitExponent (ifLess (x, minnormal, x * 4503599627370496.0, x), m, e);
+    e = e - ifLess (x, minnormal, SIMD<W>(52.0), SIMD<W>(0.0));
+    SIMD<W> big = round (m * 0.70710678118654752440 - 0.5);   // 1 for m >= sqrt 2
+    m = m * (1.0 - 0.5*big);
+    e = e + big;
+    SIMD<W> s = (m - 1.0) / (m + 1.0);
+    SIMD<W> z = s*s;
+    SIMD<W> logm = 2.0*s + (s*z) * simd_detail::Horner (z, lc);
+    SIMD<W> res = e * 6.93147180369123816490e-01 + (e * 1.90821492927058770002e-10 + logm);
+
+    const double inf = std::numeric_limits<double>::infinity();
+    res = ifLess (SIMD<W>(std::numeric_limits<double>::max()), x, SIMD<W>(inf), res);
+    res = ifLess (x, SIMD<W>(std::numeric_limits<double>::denorm_min()), SIMD<W>(-inf), res);
+    res = ifLess (x, SIMD<W>(0.0), SIMD<W>(std::numeric_limits<double>::quiet_NaN()), res);
+    return ifNaN (x, x, res);
+  }
+
+}
+
+#endif
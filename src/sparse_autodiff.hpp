@@ -0,0 +1,212 @@
+#ifndef SPARSE_AUTODIFF_HPP
+#define SPARSE_AUTODIFF_HPP
+
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <limits>
+#include <iterator>
+
+#include "sparsematrix.hpp"
+#include "autodiff.hpp"
+
+namespace ASC_ode
+{
+
+  // Scalar which records on which unknowns a value depends. Evaluating a
+  // functor with it gives the sparsity pattern of the Jacobian at the point
+  // of evaluation (branches follow the values there).
+  class SparsityTracer
+  {
+    double m_val = 0;
+    std::vector<size_t> m_dep;    // sorted
+
+    static SparsityTracer combine (double val, const SparsityTracer & a, const SparsityTracer & b)
+    {
+      SparsityTracer res(val);
+      res.m_dep.reserve(a.m_dep.size()+b.m_dep.size());
+      std::set_union (a.m_dep.begin(), a.m_dep.end(), b.m_dep.begin(), b.m_dep.end(),
+                      std::back_inserter(res.m_dep));
+      return res;
+    }
+
+    static SparsityTracer apply (double val, const SparsityTracer & a)
+    {
+      SparsityTracer res(a);
+      res.m_val = val;
+      return res;
+    }
+
+  public:
+    SparsityTracer (double v = 0) : m_val(v) { }
+    SparsityTracer (double v, size_t index) : m_val(v), m_dep{index} { }
+
+    double value() const { return m_val; }
+    const std::vector<size_t> & dependencies() const { return m_dep; }
+
+    friend SparsityTracer operator+ (const SparsityTracer & a, const SparsityTracer & b)
+    { return combine (a.m_val+b.m_val, a, b); }
+    friend SparsityTracer operator- (const SparsityTracer & a, const SparsityTracer & b)
+    { return combine (a.m_val-b.m_val, a, b); }
+    friend SparsityTracer operator* (const SparsityTracer & a, const SparsityTracer & b)
+    { return combine (a.m_val*b.m_val, a, b); }
+    friend SparsityTracer operator/ (const SparsityTracer & a, const SparsityTracer & b)
+    { return combine (a.m_val/b.m_val, a, b); }
+    friend SparsityTracer operator- (const SparsityTracer & a) { return apply (-a.m_val, a); }
+
+    friend SparsityTracer sin (const SparsityTracer & a) { return apply (std::sin(a.m_val), a); }
+    friend SparsityTracer cos (const SparsityTracer & a) { return apply (std::cos(a.m_val), a); }
+    friend SparsityTracer exp (const SparsityTracer & a) { return apply (std::exp(a.m_val), a); }
+    friend SparsityTracer log (const SparsityTracer & a) { return apply (std::log(a.m_val), a); }
+    friend SparsityTracer sqrt (const SparsityTracer & a) { return apply (std::sqrt(a.m_val), a); }
+  };
+
+
+  // pattern of the dimf x x.size() Jacobian of a functor as for AutoDiffFunction
+  template <typename FUNC>
+  SparseMatrix DetectSparsity (const FUNC & func, VectorView<double> x, size_t dimf)
+  {
+    size_t n = x.size();
+    std::vector<SparsityTracer> tx, tf(dimf);
+    tx.reserve(n);
+    for (size_t i = 0; i < n; i++)
+      tx.emplace_back (x(i), i);
+    func (VectorView<SparsityTracer>(n, tx.data()), VectorView<SparsityTracer>(dimf, tf.data()));
+
+    std::vector<std::array<size_t,2>> entries;
+    for (size_t i = 0; i < dimf; i++)
+      for (size_t j : tf[i].dependencies())
+        entries.push_back ( { i, j } );
+    return SparseMatrix(dimf, n, std::move(entries));
+  }
+
+
+  // Curtis-Powell-Reid grouping: columns without a common row get the same
+  // color, so one seed direction per color recovers all entries. Greedy,
+  // columns with most entries first; the number of colors is at least the
+  // largest number of entries in a row.
+  inline std::vector<size_t> ColorColumns (const SparseMatrix & pattern)
+  {
+    size_t h = pattern.height(), w = pattern.width();
+    std::vector<size_t> firstincol(w+1, 0), rows(pattern.nze());
+    for (size_t k = 0; k < pattern.nze(); k++)
+      firstincol[pattern.colNr(k)+1]++;
+    for (size_t j = 0; j < w; j++)
+      firstincol[j+1] += firstincol[j];
+    std::vector<size_t> fill(firstincol.begin(), firstincol.end()-1);
+    for (size_t i = 0; i < h; i++)
+      for (size_t k = pattern.firstInRow(i); k < pattern.nextInRow(i); k++)
+        rows[fill[pattern.colNr(k)]++] = i;
+
+    std::vector<size_t> order(w);
+    std::iota (order.begin(), order.end(), 0);
+    std::stable_sort (order.begin(), order.end(), [&](size_t a, size_t b)
+    { return firstincol[a+1]-firstincol[a] > firstincol[b+1]-firstincol[b]; });
+
+    const size_t none = std::numeric_limits<size_t>::max();
+    std::vector<size_t> color(w, none), forbidden(w, none);
+    for (size_t j : order)
+      {
+        for (size_t l = firstincol[j]; l < firstincol[j+1]; l++)
+          {
+            size_t i = rows[l];
+            for (size_t k = pattern.firstInRow(i); k < pattern.nextInRow(i); k++)
+              {
+                size_t c = color[pattern.colNr(k)];
+                if (c != none) forbidden[c] = j;
+              }
+          }
+        size_t c = 0;
+        while (forbidden[c] == j) c++;
+        color[j] = c;
+      }
+    return color;
+  }
+
+
+  // Sparse Jacobian by AutoDiff<K>: columns are colored, the unknowns of one
+  // color are seeded in the same derivative lane, and each entry is read off
+  // the lane of its column's color. A sweep handles K colors, so the cost is
+  // ceil(colors/K) evaluations, for a mass-spring system about the largest
+  // number of neighbors of a mass, independent of its size. The pattern must
+  // contain all entries which can be nonzero.
+  template <size_t K, typename FUNC>
+  class SparseAutoDiffFunction : public SparseJacobianFunction
+  {
+    FUNC m_func;
+    size_t m_dimx, m_dimf;
+    SparseMatrix m_pattern;
+    std::vector<size_t> m_color;
+    size_t m_numcolors = 0;
+    mutable std::vector<AutoDiff<K>> m_x, m_f;
+
+  public:
+    SparseAutoDiffFunction (FUNC func, size_t dimx, size_t dimf, SparseMatrix pattern)
+      : m_func(func), m_dimx(dimx), m_dimf(dimf), m_pattern(std::move(pattern)),
+        m_color(ColorColumns(m_pattern)), m_x(dimx), m_f(dimf)
+    {
+      for (size_t c : m_color)
+        m_numcolors = std::max(m_numcolors, c+1);
+    }
+
+    size_t dimX() const override { return m_dimx; }
+    size_t dimF() const override { return m_dimf; }
+
+    FUNC & func() { return m_func; }
+    size_t numColors() const { return m_numcolors; }
+    const std::vector<size_t> & colors() const { return m_color; }
+
+    void evaluate (VectorView<double> x, VectorView<double> f) const override
+    {
+      m_func (x, f);
+    }
+
+    SparseMatrix createJacobian() const override { return m_pattern; }
+
+    void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const override
+    {
+      for (size_t first = 0; first < m_numcolors; first += K)
+        {
+          for (size_t j = 0; j < m_dimx; j++)
+            {
+              m_x[j] = AutoDiff<K>(x(j));
+              if (m_color[j] >= first && m_color[j] < first+K)
+                m_x[j].deriv()[m_color[j]-first] = 1;
+            }
+
+          m_func (VectorView<AutoDiff<K>>(m_dimx, m_x.data()),
+                  VectorView<AutoDiff<K>>(m_dimf, m_f.data()));
+
+          for (size_t i = 0; i < m_dimf; i++)
+            for (size_t l = df.firstInRow(i); l < df.nextInRow(i); l++)
+              {
+                size_t c = m_color[df.colNr(l)];
+                if (c >= first && c < first+K)
+                  df.val(l) = m_f[i].deriv()[c-first];
+              }
+        }
+    }
+  };
+
+
+  template <size_t K = 8, typename FUNC>
+  auto MakeSparseAutoDiffFunction (FUNC func, size_t dimx, size_t dimf, SparseMatrix pattern)
+  {
+    return std::make_shared<SparseAutoDiffFunction<K,FUNC>> (func, dimx, dimf, std::move(pattern));
+  }
+
+  // pattern detected at x
+  template <size_t K = 8, typename FUNC>
+  auto MakeSparseAutoDiffFunction (FUNC func, VectorView<double> x, size_t dimf)
+  {
+    SparseMatrix pattern = DetectSparsity (func, x, dimf);
+    return std::make_shared<SparseAutoDiffFunction<K,FUNC>> (func, x.size(), dimf, std::move(pattern));
+  }
+
+}
+
+#endif
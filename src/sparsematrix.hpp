@@ -0,0 +1,354 @@
+#ifndef SPARSEMATRIX_HPP
+#define SPARSEMATRIX_HPP
+
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <vector.hpp>
+#include <matrix.hpp>
+#include "nonlinfunc.hpp"
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+  // sparse matrix in compressed row storage, column numbers sorted within rows
+  class SparseMatrix
+  {
+    size_t m_height = 0, m_width = 0;
+    std::vector<size_t> m_firstinrow;
+    std::vector<size_t> m_colnr;
+    std::vector<double> m_val;
+
+  public:
+    SparseMatrix() = default;
+
+    // pattern from a list of (row, col) entries, duplicates are merged
+    SparseMatrix (size_t height, size_t width,
+                  std::vector<std::array<size_t,2>> entries)
+      : m_height(height), m_width(width), m_firstinrow(height+1, 0)
+    {
+      std::sort (entries.begin(), entries.end());
+      entries.erase (std::unique(entries.begin(), entries.end()), entries.end());
+
+      m_colnr.resize(entries.size());
+      for (size_t k = 0; k < entries.size(); k++)
+        {
+          m_firstinrow[entries[k][0]+1]++;
+          m_colnr[k] = entries[k][1];
+        }
+      for (size_t i = 0; i < height; i++)
+        m_firstinrow[i+1] += m_firstinrow[i];
+      m_val.assign(m_colnr.size(), 0.0);
+    }
+
+    // pattern of D x D blocks, from (block-row, block-col) entries
+    static SparseMatrix BlockPattern (size_t nblocks, size_t bs,
+                                      const std::vector<std::array<size_t,2>> & blocks)
+    {
+      std::vector<std::array<size_t,2>> entries;
+      entries.reserve(blocks.size()*bs*bs);
+      for (auto [bi, bj] : blocks)
+        for (size_t i = 0; i < bs; i++)
+          for (size_t j = 0; j < bs; j++)
+            entries.push_back ( { bi*bs+i, bj*bs+j } );
+      return SparseMatrix(nblocks*bs, nblocks*bs, std::move(entries));
+    }
+
+    size_t height() const { return m_height; }
+    size_t width() const { return m_width; }
+    size_t nze() const { return m_colnr.size(); }
+
+    size_t firstInRow (size_t i) const { return m_firstinrow[i]; }
+    size_t nextInRow (size_t i) const { return m_firstinrow[i+1]; }
+    size_t colNr (size_t k) const { return m_colnr[k]; }
+    double & val (size_t k) { return m_val[k]; }
+    double val (size_t k) const { return m_val[k]; }
+
+    // position of entry (i,j) in the value array, or -1 if not in the pattern
+    long position (size_t i, size_t j) const
+    {
+      auto first = m_colnr.begin()+m_firstinrow[i];
+      auto next = m_colnr.begin()+m_firstinrow[i+1];
+      auto pos = std::lower_bound(first, next, j);
+      if (pos == next || *pos != j) return -1;
+      return pos - m_colnr.begin();
+    }
+
+    double & operator() (size_t i, size_t j)
+    {
+      long pos = position(i, j);
+      if (pos < 0) throw std::out_of_range("SparseMatrix: entry not in pattern");
+      return m_val[pos];
+    }
+
+    double operator() (size_t i, size_t j) const
+    {
+      long pos = position(i, j);
+      return (pos < 0) ? 0.0 : m_val[pos];
+    }
+
+    // the pattern as list of (row, col) entries
+    std::vector<std::array<size_t,2>> entries() const
+    {
+      std::vector<std::array<size_t,2>> ent;
+      ent.reserve(nze());
+      for (size_t i = 0; i < m_height; i++)
+        for (size_t k = m_firstinrow[i]; k < m_firstinrow[i+1]; k++)
+          ent.push_back ( { i, m_colnr[k] } );
+      return ent;
+    }
+
+    void setZero() { std::fill(m_val.begin(), m_val.end(), 0.0); }
+    void scale (double fac) { for (auto & v : m_val) v *= fac; }
+
+    // y = A x
+    void mult (VectorView<double> x, VectorView<double> y) const
+    {
+      for (size_t i = 0; i < m_height; i++)
+        {
+          double sum = 0;
+          for (size_t k = m_firstinrow[i]; k < m_firstinrow[i+1]; k++)
+            sum += m_val[k] * x(m_colnr[k]);
+          y(i) = sum;
+        }
+    }
+
+    // y += fac A x
+    void multAdd (double fac, VectorView<double> x, VectorView<double> y) const
+    {
+      for (size_t i = 0; i < m_height; i++)
+        {
+          double sum = 0;
+          for (size_t k = m_firstinrow[i]; k < m_firstinrow[i+1]; k++)
+            sum += m_val[k] * x(m_colnr[k]);
+          y(i) += fac * sum;
+        }
+    }
+
+    // mat += fac A
+    void addTo (MatrixView<double> mat, double fac = 1) const
+    {
+      for (size_t i = 0; i < m_height; i++)
+        for (size_t k = m_firstinrow[i]; k < m_firstinrow[i+1]; k++)
+          mat(i, m_colnr[k]) += fac * m_val[k];
+    }
+
+    // lower and upper bandwidth of the pattern
+    std::array<size_t,2> bandwidth() const
+    {
+      size_t kl = 0, ku = 0;
+      for (size_t i = 0; i < m_height; i++)
+        for (size_t k = m_firstinrow[i]; k < m_firstinrow[i+1]; k++)
+          {
+            size_t j = m_colnr[k];
+            if (j < i) kl = std::max(kl, i-j);
+            else ku = std::max(ku, j-i);
+          }
+      return { kl, ku };
+    }
+
+    void getDiag (VectorView<double> diag) const
+    {
+      for (size_t i = 0; i < m_height; i++)
+        diag(i) = (*this)(i,i);
+    }
+  };
+
+
+
+  // NonlinearFunction which provides its Jacobian as sparse matrix
+  class SparseJacobianFunction : public NonlinearFunction
+  {
+  public:
+    // a matrix with the sparsity pattern of the Jacobian
+    virtual SparseMatrix createJacobian() const = 0;
+    // fill the values of df, df must come from createJacobian
+    virtual void evaluateDerivSparse (VectorView<double> x, SparseMatrix & df) const = 0;
+    // changes when createJacobian would return a different pattern,
+    // e.g. for contacts which are not in the current one
+    virtual size_t patternVersion() const { return 0; }
+
+    // dense Jacobian via the sparse one, the pattern is kept until
+    // patternVersion() or the size changes
+    void evaluateDeriv (VectorView<double> x, MatrixView<double> df) const override
+    {
+      if (!m_densejac || m_densejac->height() != dimF() || m_densejacversion != patternVersion())
+        newDensePattern();
+      evaluateDerivSparse(x, *m_densejac);
+      if (m_densejacversion != patternVersion())
+        {
+          // e.g. new contacts found by the evaluation
+          newDensePattern();
+          evaluateDerivSparse(x, *m_densejac);
+        }
+      df = 0.0;
+      m_densejac->addTo(df);
+    }
+
+  private:
+    mutable std::unique_ptr<SparseMatrix> m_densejac;   // pattern for evaluateDeriv
+    mutable size_t m_densejacversion = 0;
+
+    void newDensePattern () const
+    {
+      m_densejac = std::make_unique<SparseMatrix>(createJacobian());
+      m_densejacversion = patternVersion();
+    }
+  };
+
+
+
+  // Jacobi-preconditioned conjugate gradients for SPD sparse matrices.
+  // Keeps its work vectors, the initial value of x is used as start vector.
+  class SparseCGSolver
+  {
+    Vector<> m_diaginv, m_r, m_z, m_p, m_q;
+    double m_tol;
+    int m_maxsteps;
+    int m_steps = 0;
+  public:
+    SparseCGSolver (size_t n, double tol = 1e-12, int maxsteps = 10000)
+      : m_diaginv(n), m_r(n), m_z(n), m_p(n), m_q(n), m_tol(tol), m_maxsteps(maxsteps) { }
+
+    void setMatrix (const SparseMatrix & a)
+    {
+      a.getDiag(m_diaginv);
+      for (size_t i = 0; i < m_diaginv.size(); i++)
+        m_diaginv(i) = (m_diaginv(i) != 0) ? 1.0/m_diaginv(i) : 1.0;
+    }
+
+    int steps() const { return m_steps; }
+
+    // solves A x = b, relative tolerance in the preconditioned residual
+    void solve (const SparseMatrix & a, VectorView<double> b, VectorView<double> x)
+    {
+      size_t n = b.size();
+      a.mult(x, m_r);
+      for (size_t i = 0; i < n; i++)
+        {
+          m_r(i) = b(i) - m_r(i);
+          m_z(i) = m_diaginv(i) * m_r(i);
+        }
+      m_p = m_z;
+
+      double rz = 0;
+      for (size_t i = 0; i < n; i++) rz += m_r(i)*m_z(i);
+      double rz0 = rz;
+
+      for (m_steps = 0; m_steps < m_maxsteps; m_steps++)
+        {
+          if (rz <= m_tol*m_tol*rz0 || rz == 0) return;
+
+          a.mult(m_p, m_q);
+          double pq = 0;
+          for (size_t i = 0; i < n; i++) pq += m_p(i)*m_q(i);
+          double alpha = rz / pq;
+
+          double rznew = 0;
+          for (size_t i = 0; i < n; i++)
+            {
+              x(i) += alpha * m_p(i);
+              m_r(i) -= alpha * m_q(i);
+              m_z(i) = m_diaginv(i) * m_r(i);
+              rznew += m_r(i)*m_z(i);
+            }
+          double beta = rznew / rz;
+          rz = rznew;
+          for (size_t i = 0; i < n; i++)
+            m_p(i) = m_z(i) + beta * m_p(i);
+        }
+      throw std::domain_error("CG did not converge");
+    }
+  };
+
+
+
+  // Jacobi-preconditioned BiCGStab for general sparse matrices.
+  // Keeps its work vectors, the initial value of x is used as start vector.
+  class SparseBiCGStabSolver
+  {
+    Vector<> m_diaginv, m_r, m_r0, m_p, m_v, m_s, m_t, m_y, m_z;
+    double m_tol;
+    int m_maxsteps;
+    int m_steps = 0;
+
+    static double dot (VectorView<double> a, VectorView<double> b)
+    {
+      double sum = 0;
+      for (size_t i = 0; i < a.size(); i++) sum += a(i)*b(i);
+      return sum;
+    }
+
+  public:
+    SparseBiCGStabSolver (size_t n, double tol = 1e-12, int maxsteps = 10000)
+      : m_diaginv(n), m_r(n), m_r0(n), m_p(n), m_v(n), m_s(n), m_t(n), m_y(n), m_z(n),
+        m_tol(tol), m_maxsteps(maxsteps) { }
+
+    void setMatrix (const SparseMatrix & a)
+    {
+      a.getDiag(m_diaginv);
+      for (size_t i = 0; i < m_diaginv.size(); i++)
+        m_diaginv(i) = (m_diaginv(i) != 0) ? 1.0/m_diaginv(i) : 1.0;
+    }
+
+    int steps() const { return m_steps; }
+
+    // solves A x = b up to the relative residual tol
+    void solve (const SparseMatrix & a, VectorView<double> b, VectorView<double> x)
+    {
+      size_t n = b.size();
+      a.mult(x, m_r);
+      for (size_t i = 0; i < n; i++)
+        m_r(i) = b(i) - m_r(i);
+      m_r0 = m_r;
+      m_p = 0.0;
+      m_v = 0.0;
+
+      double normb = std::sqrt(dot(b, b));
+      if (normb == 0) normb = 1;
+      double rho = 1, alpha = 1, omega = 1;
+
+      for (m_steps = 0; m_steps < m_maxsteps; m_steps++)
+        {
+          if (std::sqrt(dot(m_r, m_r)) <= m_tol * normb) return;
+
+          double rhonew = dot(m_r0, m_r);
+          if (rhonew == 0) break;
+          double beta = (rhonew/rho) * (alpha/omega);
+          rho = rhonew;
+          for (size_t i = 0; i < n; i++)
+            {
+              m_p(i) = m_r(i) + beta * (m_p(i) - omega * m_v(i));
+              m_y(i) = m_diaginv(i) * m_p(i);
+            }
+          a.mult(m_y, m_v);
+          alpha = rho / dot(m_r0, m_v);
+          for (size_t i = 0; i < n; i++)
+            {
+              m_s(i) = m_r(i) - alpha * m_v(i);
+              m_z(i) = m_diaginv(i) * m_s(i);
+            }
+          a.mult(m_z, m_t);
+          double tt = dot(m_t, m_t);
+          omega = (tt > 0) ? dot(m_t, m_s) / tt : 0;
+          for (size_t i = 0; i < n; i++)
+            {
+              x(i) += alpha * m_y(i) + omega * m_z(i);
+              m_r(i) = m_s(i) - omega * m_t(i);
+            }
+          if (omega == 0) break;
+        }
+      if (std::sqrt(dot(m_r, m_r)) > m_tol * normb)
+        throw std::domain_error("BiCGStab did not converge");
+    }
+  };
+
+}
+
+#endif
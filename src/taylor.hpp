@@ -0,0 +1,434 @@
+#ifndef TAYLOR_HPP
+#define TAYLOR_HPP
+
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <deque>
+#include <cmath>
+#include <ostream>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+#include <vector.hpp>
+
+namespace ASC_ode
+{
+  using namespace nanoblas;
+
+  // Coefficients of the intermediate results of a function, kept from one
+  // evaluation to the next while the TaylorIntegrator computes a series
+  // order by order. In pass k, the coefficients below k of each product,
+  // quotient and elementary function come from the cache and only
+  // coefficient k is computed, O(k) instead of O(k^2). The results are
+  // matched by their sequence number, so every pass has to do the same
+  // operations; branches on values are fine, they do not change.
+  template <size_t K, typename T = double>
+  class TaylorCache
+  {
+    std::deque<std::array<T, K+1>> m_slots;   // stay in place when it grows
+    size_t m_next = 0, m_known = 0;
+    static inline thread_local TaylorCache * s_active = nullptr;
+
+  public:
+    // used by the Taylor operations of this thread while it exists
+    class Scope
+    {
+      TaylorCache * m_prev;
+    public:
+      Scope (TaylorCache & cache) : m_prev(s_active) { s_active = &cache; }
+      ~Scope () { s_active = m_prev; }
+      Scope (const Scope &) = delete;
+      Scope & operator= (const Scope &) = delete;
+    };
+
+    static TaylorCache * active() { return s_active; }
+
+    // next evaluation, which knows the coefficients below known
+    void pass (size_t known)
+    {
+      m_next = 0;
+      m_known = known;
+    }
+
+    // slot of the next result and the number of valid coefficients in it
+    std::array<T, K+1> & next (size_t & known)
+    {
+      known = m_known;
+      if (m_next == m_slots.size())
+        {
+          m_slots.emplace_back();
+          known = 0;
+        }
+      return m_slots[m_next++];
+    }
+  };
+
+
+
+  // Truncated Taylor series c_0 + c_1 t + ... + c_d t^d, c_k = f^(k)(0)/k!,
+  // of degree d <= K. The operations combine the coefficients by the usual
+  // recurrences, O(d^2) each, and keep the larger degree of their operands;
+  // constants have degree 0. Derivatives of any order in one pass, where
+  // nested AutoDiff grows with 2^order.
+  template <size_t K, typename T = double>
+  class Taylor
+  {
+    std::array<T, K+1> m_c;
+    size_t m_deg = 0;
+
+    // With an active TaylorCache, takes the known coefficients of this
+    // result from its slot and returns the first one to compute, else 0
+    size_t restore (T *& slot)
+    {
+      slot = nullptr;
+      auto cache = TaylorCache<K,T>::active();
+      if (!cache) return 0;
+      size_t known;
+      slot = cache->next(known).data();
+      size_t from = std::min(known, m_deg+1);
+      for (size_t k = 0; k < from; k++)
+        m_c[k] = slot[k];
+      return from;
+    }
+
+    void store (T * slot, size_t from) const
+    {
+      if (slot)
+        for (size_t k = from; k <= m_deg; k++)
+          slot[k] = m_c[k];
+    }
+
+  public:
+    Taylor () : m_c{} { }
+    Taylor (T v) : m_c{} { m_c[0] = v; }
+
+    // the independent variable x0 + t
+    static Taylor Variable (T x0, size_t degree = K)
+    {
+      Taylor res(x0);
+      res.m_deg = std::min(degree, K);
+      if (res.m_deg > 0) res.m_c[1] = 1;
+      return res;
+    }
+
+    size_t degree() const { return m_deg; }
+    void setDegree (size_t d) { m_deg = std::min(d, K); }
+    T value() const { return m_c[0]; }
+    T & operator[] (size_t k) { return m_c[k]; }
+    const T & operator[] (size_t k) const { return m_c[k]; }
+    // k-th derivative at 0
+    T derivative (size_t k) const
+    {
+      T fac = 1;
+      for (size_t i = 2; i <= k; i++) fac *= i;
+      return fac * m_c[k];
+    }
+
+    friend Taylor operator+ (const Taylor & a, const Taylor & b)
+    {
+      Taylor res;
+      res.m_deg = std::max(a.m_deg, b.m_deg);
+      for (size_t k = 0; k <= res.m_deg; k++)
+        res.m_c[k] = a.m_c[k] + b.m_c[k];
+      return res;
+    }
+
+    friend Taylor operator- (const Taylor & a, const Taylor & b)
+    {
+      Taylor res;
+      res.m_deg = std::max(a.m_deg, b.m_deg);
+      for (size_t k = 0; k <= res.m_deg; k++)
+        res.m_c[k] = a.m_c[k] - b.m_c[k];
+      return res;
+    }
+
+    friend Taylor operator- (const Taylor & a)
+    {
+      Taylor res;
+      res.m_deg = a.m_deg;
+      for (size_t k = 0; k <= res.m_deg; k++)
+        res.m_c[k] = -a.m_c[k];
+      return res;
+    }
+
+    // c_k = sum_j a_j b_{k-j}
+    friend Taylor operator* (const Taylor & a, const Taylor & b)
+    {
+      Taylor res;
+      res.m_deg = std::max(a.m_deg, b.m_deg);
+      T * slot;
+      size_t from = res.restore(slot);
+      for (size_t k = from; k <= res.m_deg; k++)
+        {
+          T sum = 0;
+          for (size_t j = (k > b.m_deg ? k-b.m_deg : 0); j <= std::min(k, a.m_deg); j++)
+            sum += a.m_c[j] * b.m_c[k-j];
+          res.m_c[k] = sum;
+        }
+      res.store(slot, from);
+      return res;
+    }
+
+    // c_k = (a_k - sum_{j>=1} b_j c_{k-j}) / b_0
+    friend Taylor operator/ (const Taylor & a, const Taylor & b)
+    {
+      Taylor res;
+      res.m_deg = std::max(a.m_deg, b.m_deg);
+      T * slot;
+      size_t from = res.restore(slot);
+      T inv = 1 / b.m_c[0];
+      for (size_t k = from; k <= res.m_deg; k++)
+        {
+          T sum = a.m_c[k];
+          for (size_t j = 1; j <= std::min(k, b.m_deg); j++)
+            sum -= b.m_c[j] * res.m_c[k-j];
+          res.m_c[k] = sum * inv;
+        }
+      res.store(slot, from);
+      return res;
+    }
+
+    // e' = a' e:  e_k = 1/k sum_j j a_j e_{k-j}
+    friend Taylor exp (const Taylor & a)
+    {
+      Taylor res;
+      res.m_deg = a.m_deg;
+      T * slot;
+      size_t from = res.restore(slot);
+      if (from == 0)
+        res.m_c[0] = std::exp(a.m_c[0]);
+      for (size_t k = std::max<size_t>(from, 1); k <= res.m_deg; k++)
+        {
+          T sum = 0;
+          for (size_t j = 1; j <= k; j++)
+            sum += T(j) * a.m_c[j] * res.m_c[k-j];
+          res.m_c[k] = sum / T(k);
+        }
+      res.store(slot, from);
+      return res;
+    }
+
+    // s' = a' c, c' = -a' s
+    friend void sincos (const Taylor & a, Taylor & s, Taylor & c)
+    {
+      s.m_deg = c.m_deg = a.m_deg;
+      T * slots, * slotc;
+      size_t from = s.restore(slots);
+      c.restore(slotc);
+      if (from == 0)
+        {
+          s.m_c[0] = std::sin(a.m_c[0]);
+          c.m_c[0] = std::cos(a.m_c[0]);
+        }
+      for (size_t k = std::max<size_t>(from, 1); k <= a.m_deg; k++)
+        {
+          T sums = 0, sumc = 0;
+          for (size_t j = 1; j <= k; j++)
+            {
+              sums += T(j) * a.m_c[j] * c.m_c[k-j];
+              sumc += T(j) * a.m_c[j] * s.m_c[k-j];
+            }
+          s.m_c[k] = sums / T(k);
+          c.m_c[k] = -sumc / T(k);
+        }
+      s.store(slots, from);
+      c.store(slotc, from);
+    }
+
+    friend Taylor sin (const Taylor & a)
+    {
+      Taylor s, c;
+      sincos (a, s, c);
+      return s;
+    }
+
+    friend Taylor cos (const Taylor & a)
+    {
+      Taylor s, c;
+      sincos (a, s, c);
+      return c;
+    }
+
+    // a = exp(l):  l_k = (a_k - 1/k sum_{j<k} j l_j a_{k-j}) / a_0
+    friend Taylor log (const Taylor & a)
+    {
+      Taylor res;
+      res.m_deg = a.m_deg;
+      T * slot;
+      size_t from = res.restore(slot);
+      if (from == 0)
+        res.m_c[0] = std::log(a.m_c[0]);
+      for (size_t k = std::max<size_t>(from, 1); k <= res.m_deg; k++)
+        {
+          T sum = 0;
+          for (size_t j = 1; j < k; j++)
+            sum += T(j) * res.m_c[j] * a.m_c[k-j];
+          res.m_c[k] = (a.m_c[k] - sum / T(k)) / a.m_c[0];
+        }
+      res.store(slot, from);
+      return res;
+    }
+
+    // a = r^2:  r_k = (a_k - sum_{0<j<k} r_j r_{k-j}) / (2 r_0)
+    friend Taylor sqrt (const Taylor & a)
+    {
+      Taylor res;
+      res.m_deg = a.m_deg;
+      T * slot;
+      size_t from = res.restore(slot);
+      if (from == 0)
+        res.m_c[0] = std::sqrt(a.m_c[0]);
+      for (size_t k = std::max<size_t>(from, 1); k <= res.m_deg; k++)
+        {
+          T sum = 0;
+          for (size_t j = 1; j < k; j++)
+            sum += res.m_c[j] * res.m_c[k-j];
+          res.m_c[k] = (a.m_c[k] - sum) / (2*res.m_c[0]);
+        }
+      res.store(slot, from);
+      return res;
+    }
+
+    friend std::ostream & operator<< (std::ostream & os, const Taylor & a)
+    {
+      os << "[";
+      for (size_t k = 0; k <= a.m_deg; k++)
+        os << a.m_c[k] << (k < a.m_deg ? ", " : "]");
+      return os;
+    }
+  };
+
+
+
+  // Taylor series method for y' = f(y), f a functor as for AutoDiffFunction
+  //
+  //    template <typename T>
+  //    void operator() (VectorView<T> y, VectorView<T> f) const
+  //
+  // The coefficients of y(t_n + t) follow from y_{k+1} = f(y)_k / (k+1), one
+  // evaluation with Taylor<K> per order. A TaylorCache keeps the lower
+  // coefficients of the intermediate results between the evaluations, so
+  // order p costs O(p^2) per operation of f. Order and step size from the
+  // tolerance and the last two coefficients (Jorba & Zou 2005):
+  //
+  //    p = -ln(tol)/2 + 1,   h = min_{k=p-1,p} (tol/|y_k|)^{1/k} * safety
+  //
+  // with tol relative to max(|y|, 1). For smooth problems and tight
+  // tolerances the steps get long and few, so it beats RK4 with tiny steps
+  // for reference solutions. K is the largest order.
+  template <size_t K, typename FUNC>
+  class TaylorIntegrator
+  {
+    FUNC m_func;
+    size_t m_n;
+    std::vector<Taylor<K>> m_y, m_f;
+    TaylorCache<K> m_cache;
+    size_t m_order = 0;
+    size_t m_steps = 0;
+
+  public:
+    TaylorIntegrator (FUNC func, size_t n) : m_func(func), m_n(n), m_y(n), m_f(n) { }
+
+    FUNC & func() { return m_func; }
+    size_t order() const { return m_order; }
+    size_t steps() const { return m_steps; }
+
+    // Taylor coefficients of the solution through y, up to order p
+    void series (VectorView<double> y, size_t p)
+    {
+      p = std::min(p, K);
+      m_order = p;
+      for (size_t i = 0; i < m_n; i++)
+        {
+          m_y[i] = Taylor<K>(y(i));
+          m_y[i].setDegree(0);
+        }
+      typename TaylorCache<K>::Scope scope(m_cache);
+      for (size_t k = 0; k < p; k++)
+        {
+          // coefficient k of f(y), the lower ones are cached
+          m_cache.pass (k);
+          m_func (VectorView<Taylor<K>>(m_n, m_y.data()), VectorView<Taylor<K>>(m_n, m_f.data()));
+          for (size_t i = 0; i < m_n; i++)
+            {
+              m_y[i].setDegree(k+1);
+              m_y[i][k+1] = m_f[i][k] / double(k+1);
+            }
+        }
+    }
+
+    // coefficient k of component i, after series
+    double coefficient (size_t i, size_t k) const { return m_y[i][k]; }
+
+    // y(t_n + h) from the series, by Horner
+    void evaluate (double h, VectorView<double> y) const
+    {
+      for (size_t i = 0; i < m_n; i++)
+        {
+          double sum = m_y[i][m_order];
+          for (size_t k = m_order; k-- > 0; )
+            sum = sum*h + m_y[i][k];
+          y(i) = sum;
+        }
+    }
+
+    // fixed step with order K
+    void doStep (double tau, VectorView<double> y)
+    {
+      series (y, K);
+      evaluate (tau, y);
+      m_steps++;
+    }
+
+    // one step of at most hmax with the order and step from tol, returns the step
+    double adaptiveStep (VectorView<double> y, double tol, double hmax)
+    {
+      double ynorm = 1;
+      for (size_t i = 0; i < m_n; i++)
+        ynorm = std::max(ynorm, std::abs(y(i)));
+      double eps = tol * ynorm;
+      size_t p = std::clamp<size_t>(size_t(std::ceil(-0.5*std::log(tol) + 1)), 2, K);
+      series (y, p);
+
+      double h = hmax;
+      for (size_t k = p-1; k <= p; k++)
+        {
+          double ck = 0;
+          for (size_t i = 0; i < m_n; i++)
+            ck = std::max(ck, std::abs(m_y[i][k]));
+          if (ck > 0)
+            h = std::min(h, std::pow(eps/ck, 1.0/k) * std::exp(-0.7/(p-1.0)));
+        }
+      evaluate (h, y);
+      m_steps++;
+      return h;
+    }
+
+    // from t to tend, callback(t, y) after every step, returns tend
+    double solve (double t, double tend, VectorView<double> y, double tol,
+                  std::function<void(double,VectorView<double>)> callback = nullptr)
+    {
+      while (t < tend)
+        {
+          double h = adaptiveStep (y, tol, tend-t);
+          if (h <= 1e-14 * (std::abs(t)+1))
+            throw std::domain_error("TaylorIntegrator: step size underflow");
+          t = (tend-t-h <= 1e-14 * (std::abs(tend)+1)) ? tend : t+h;
+          if (callback) callback(t, y);
+        }
+      return t;
+    }
+  };
+
+
+  template <size_t K = 30, typename FUNC>
+  auto MakeTaylorIntegrator (FUNC func, size_t n)
+  {
+    return TaylorIntegrator<K,FUNC> (func, n);
+  }
+
+}
+
+#endif